@@ -0,0 +1,170 @@
+// Throughput of `struct queue` against the
+// list backed queue it replaced
+//
+// Build and run with `make queue_bench`
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "collections/list.h"
+#include "collections/queue.h"
+
+#define ITEMS_PER_PRODUCER (2 * 1000 * 1000)
+#define QUEUE_SIZE (1024)
+
+////////////////////////////////////////
+// Previous implementation            //
+////////////////////////////////////////
+
+// Same as before except waits are loops
+// so it survive more than one consumer
+struct legacy_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t readySignal;
+  pthread_cond_t taskArriveSignal;
+  int queueSize;
+  int itemsInQueue;
+  list_t* queue;
+};
+
+static struct legacy_queue* legacy_new(int size) {
+  struct legacy_queue* this = malloc(sizeof(*this));
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->readySignal, NULL);
+  pthread_cond_init(&this->taskArriveSignal, NULL);
+  this->queue = list_new();
+  this->itemsInQueue = 0;
+  this->queueSize = size;
+  return this;
+}
+
+static void legacy_destroy(struct legacy_queue* this) {
+  list_destroy(this->queue);
+  pthread_cond_destroy(&this->readySignal);
+  pthread_cond_destroy(&this->taskArriveSignal);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+}
+
+static void legacy_enqueue(struct legacy_queue* this, void* data) {
+  pthread_mutex_lock(&this->lock);
+  while (this->itemsInQueue >= this->queueSize)
+    pthread_cond_wait(&this->readySignal, &this->lock);
+
+  list_rpush(this->queue, list_node_new(data));
+  this->itemsInQueue++;
+
+  pthread_mutex_unlock(&this->lock);
+  pthread_cond_signal(&this->taskArriveSignal);
+}
+
+static void legacy_remove(struct legacy_queue* this, void** data) {
+  pthread_mutex_lock(&this->lock);
+  while (this->itemsInQueue <= 0)
+    pthread_cond_wait(&this->taskArriveSignal, &this->lock);
+
+  list_node_t* node = list_at(this->queue, 0);
+  this->itemsInQueue--;
+  *data = node->val;
+  list_remove(this->queue, node);
+
+  pthread_mutex_unlock(&this->lock);
+  pthread_cond_signal(&this->readySignal);
+}
+
+////////////////////////////////////////
+// Benchmark                          //
+////////////////////////////////////////
+
+struct bench {
+  bool isLegacy;
+  struct queue* queue;
+  struct legacy_queue* legacy;
+  int itemsPerConsumer;
+};
+
+static void* producer(void* arg) {
+  struct bench* bench = arg;
+  for (uintptr_t i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+    if (bench->isLegacy)
+      legacy_enqueue(bench->legacy, (void*) i);
+    else
+      queue_enqueue(bench->queue, (void*) i);
+  }
+  return NULL;
+}
+
+static void* consumer(void* arg) {
+  struct bench* bench = arg;
+  uintptr_t sum = 0;
+  for (int i = 0; i < bench->itemsPerConsumer; i++) {
+    void* data;
+    if (bench->isLegacy)
+      legacy_remove(bench->legacy, &data);
+    else
+      queue_remove(bench->queue, &data);
+    sum += (uintptr_t) data;
+  }
+  return (void*) sum;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char* name, struct bench* bench, int producers, int consumers) {
+  pthread_t threads[producers + consumers];
+  bench->itemsPerConsumer = ITEMS_PER_PRODUCER * producers / consumers;
+
+  double start = now();
+  for (int i = 0; i < consumers; i++)
+    pthread_create(&threads[i], NULL, consumer, bench);
+  for (int i = 0; i < producers; i++)
+    pthread_create(&threads[consumers + i], NULL, producer, bench);
+
+  uintptr_t sum = 0;
+  for (int i = 0; i < consumers; i++) {
+    void* res;
+    pthread_join(threads[i], &res);
+    sum += (uintptr_t) res;
+  }
+  for (int i = 0; i < producers; i++)
+    pthread_join(threads[consumers + i], NULL);
+  double elapsed = now() - start;
+
+  uintptr_t expected = (uintptr_t) producers * ITEMS_PER_PRODUCER * (ITEMS_PER_PRODUCER + 1) / 2;
+  double total = (double) ITEMS_PER_PRODUCER * producers;
+  printf("%-8s %dP/%dC  %8.2f Mops/s  %7.1f ns/item%s\n", name, producers, consumers,
+         total / elapsed / 1e6, elapsed / total * 1e9, sum == expected ? "" : "  (CHECKSUM MISMATCH)");
+}
+
+static void runAll(int producers, int consumers) {
+  struct bench bench = {.isLegacy = true};
+  bench.legacy = legacy_new(QUEUE_SIZE);
+  run("list", &bench, producers, consumers);
+  legacy_destroy(bench.legacy);
+
+  bench.isLegacy = false;
+  if (producers == 1 && consumers == 1) {
+    bench.queue = queue_new_spsc(QUEUE_SIZE);
+    run("spsc", &bench, producers, consumers);
+    queue_destroy(bench.queue);
+  }
+
+  bench.queue = queue_new(QUEUE_SIZE);
+  run("mpmc", &bench, producers, consumers);
+  queue_destroy(bench.queue);
+}
+
+int main() {
+  runAll(1, 1);
+  runAll(2, 2);
+  runAll(4, 4);
+  return EXIT_SUCCESS;
+}
+
@@ -9,6 +9,7 @@
 #include "../fluffyvm.h"
 #include "../fluffyvm_types.h"
 #include "../coroutine.h"
+#include "../channel.h"
 #include "../config.h"
 #include "../interpreter.h"
 #include "../util/util.h"
@@ -199,29 +200,33 @@ FLUFFYVM_DECLARE(void, lua_pushvalue, lua_State* L, int idx) {
   interpreter_push(L->owner, callState, sourceValue);
 }
 
+// Replace value at `location` with converted
+// one like Lua does, `tmp` unrooted after
+static void replaceConverted(lua_State* L, int location, struct value tmp, foxgc_root_reference_t* tmpRootRef) {
+  struct fluffyvm_call_state* callState = L->currentCallState;
+  if (tmp.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    interpreter_error(L->owner, fluffyvm_get_errmsg(L->owner));
+   
+  callState->generalStack[location] = tmp;
+  foxgc_api_write_array(callState->gc_generalObjectStack, location, value_get_object_ptr(tmp));
+  
+  foxgc_api_remove_from_root2(L->owner->heap, fluffyvm_get_root(L->owner), tmpRootRef);
+}
+
 FLUFFYVM_DECLARE(const char*, lua_tolstring, lua_State* L, int idx, size_t* len) {
   struct fluffyvm_call_state* callState = L->currentCallState;
   
   int location = fluffyvm_compat_lua54_lua_absindex(L, idx) - 1;
   struct value val = callState->generalStack[location];
+  foxgc_root_reference_t* tmpRootRef = NULL;
   switch (val.type) {
     case FLUFFYVM_TVALUE_STRING:
       break;
     case FLUFFYVM_TVALUE_LONG:
     case FLUFFYVM_TVALUE_DOUBLE: 
-      {
-        foxgc_root_reference_t* tmpRootRef = NULL;
-        struct value tmp = value_tostring(L->owner, val, &tmpRootRef);
-        if (tmp.type == FLUFFYVM_TVALUE_NOT_PRESENT)
-          interpreter_error(L->owner, fluffyvm_get_errmsg(L->owner));
-         
-        callState->generalStack[location] = tmp;
-        val = tmp;
-        foxgc_api_write_array(callState->gc_generalObjectStack, location, value_get_object_ptr(tmp));
-        
-        foxgc_api_remove_from_root2(L->owner->heap, fluffyvm_get_root(L->owner), tmpRootRef);
-        break;
-      }
+      val = value_tostring(L->owner, val, &tmpRootRef);
+      replaceConverted(L, location, val, tmpRootRef);
+      break;
     default:
       interpreter_error_printf(L->owner, "%s: expect long or number got %s", __func__, value_get_string(value_typename(L->owner, val)));
   }
@@ -461,13 +466,11 @@ EXPORT FLUFFYVM_DECLARE(void, lua_newtable, lua_State* L) {
   fluffyvm_compat_lua54_lua_createtable(L, 0, 0);
 }
 
+// Arguments count passed through `transferCount`
+// and results count returned the same way
 static int trampoline(struct fluffyvm* F, struct fluffyvm_call_state* callState, void* udata) {
   lua_State* L = fluffyvm_get_executing_coroutine(F);
-  assert(fluffyvm_compat_lua54_lua_gettop(L) >= 2);
-
-  int* nresults = (void*) fluffyvm_compat_lua54_lua_topointer(L, -2);
-  int nargs = fluffyvm_compat_lua54_lua_tonumber(L, -1);
-  fluffyvm_compat_lua54_lua_pop(L, 2);
+  int nargs = L->transferCount;
   
   if (!fluffyvm_compat_lua54_lua_isfunction(L, 1)) {
     fluffyvm_compat_lua54_lua_pushliteral(L, "main function is not present");
@@ -475,16 +478,50 @@ static int trampoline(struct fluffyvm* F, struct fluffyvm_call_state* callState,
   }
   
   fluffyvm_compat_lua54_lua_call(L, nargs, LUA_MULTRET);
-  if (nresults)
-    *nresults = fluffyvm_compat_lua54_lua_gettop(L);
+  L->transferCount = fluffyvm_compat_lua54_lua_gettop(L);
   return 0;
 }
 
+// Return NULL on error (errmsg set)
+static struct fluffyvm_closure* getTrampoline(struct fluffyvm* vm) {
+  struct compat_layer_lua54_static_data* data = vm->compatLayerLua54StaticData;
+  struct fluffyvm_closure* trampolineClosure = atomic_load(&data->coroutineTrampoline);
+  if (trampolineClosure)
+    return trampolineClosure;
+
+  pthread_mutex_lock(&data->trampolineLock);
+  if ((trampolineClosure = data->coroutineTrampoline))
+    goto done;
+  
+  foxgc_root_reference_t* closureRootRef = NULL;
+  trampolineClosure = closure_from_cfunction(vm, &closureRootRef, trampoline, NULL, NULL, value_nil);
+  if (!trampolineClosure)
+    goto done;
+
+  // Lua C functions called by it yield
+  // through its C frame
+  closure_set_need_fiber(trampolineClosure, true);
+
+  struct value tmp = value_not_present;
+  trampolineClosure->env = tmp;
+  foxgc_api_root_add(vm->heap, trampolineClosure->gc_this, vm->staticDataRoot, &data->trampolineRootRef);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), closureRootRef);
+  atomic_store(&data->coroutineTrampoline, trampolineClosure);
+  
+  done:
+  pthread_mutex_unlock(&data->trampolineLock);
+  return trampolineClosure;
+}
+
 EXPORT FLUFFYVM_DECLARE(lua_State*, lua_newthread, lua_State* L) {
   ensureStackFits(L, 1);  
   foxgc_root_reference_t* coroutineRootRef = NULL;
   
-  struct value thread = value_new_coroutine(L->owner, L->owner->compatLayerLua54StaticData->coroutineTrampoline, &coroutineRootRef);
+  struct fluffyvm_closure* trampolineClosure = getTrampoline(L->owner);
+  if (!trampolineClosure)
+    interpreter_error(L->owner, fluffyvm_get_errmsg(L->owner));
+
+  struct value thread = value_new_coroutine(L->owner, trampolineClosure, &coroutineRootRef);
   if (thread.type == FLUFFYVM_TVALUE_NOT_PRESENT)
     interpreter_error(L->owner, fluffyvm_get_errmsg(L->owner));
   
@@ -497,10 +534,20 @@ EXPORT FLUFFYVM_DECLARE(lua_State*, lua_newthread, lua_State* L) {
 EXPORT FLUFFYVM_DECLARE(int, lua_resume, lua_State* L, lua_State* target, int nargs, int* nresults) {
   ensureStackFits(L, 8 + nargs);
  
-  fluffyvm_compat_lua54_lua_pushlightuserdata(target, nresults);
-  fluffyvm_compat_lua54_lua_pushinteger(target, nargs);
+  // Counts go through the coroutine itself
+  // nothing pushed or allocated for them
+  target->transferCount = nargs;
   coroutine_resume(target->owner, target);
-  return target->hasError ? LUA_ERRRUN : LUA_OK;
+  if (target->hasError)
+    return LUA_ERRRUN;
+
+  if (nresults)
+    *nresults = target->transferCount;
+  return LUA_OK;
+}
+
+EXPORT FLUFFYVM_DECLARE(int, lua_yield, lua_State* L, int nresults) {
+  return coroutine_yield_stackless(L->owner, nresults);
 }
 
 EXPORT FLUFFYVM_DECLARE(void, lua_pushlightuserdata, lua_State* L, void* ptr) {
@@ -541,15 +588,10 @@ bool fluffyvm_compat_layer_lua54_init(struct fluffyvm* vm) {
   vm->compatLayerLua54StaticData = malloc(sizeof(*vm->compatLayerLua54StaticData));
   if (!vm->compatLayerLua54StaticData)
     return false;
-    
-  foxgc_root_reference_t* closureRootRef = NULL;
-  struct fluffyvm_closure* trampolineClosure = closure_from_cfunction(vm, &closureRootRef, trampoline, NULL, NULL, value_nil);
-  if (!trampolineClosure)
-    return false;
-
-  struct value tmp = value_not_present;
-  trampolineClosure->env = tmp;
-  vm->compatLayerLua54StaticData->coroutineTrampoline = trampolineClosure;
+  
+  pthread_mutex_init(&vm->compatLayerLua54StaticData->trampolineLock, NULL);
+  atomic_init(&vm->compatLayerLua54StaticData->coroutineTrampoline, NULL);
+  vm->compatLayerLua54StaticData->trampolineRootRef = NULL;
   
   vm->modules.compatLayer_Lua54.moduleID = value_get_module_id();
   vm->modules.compatLayer_Lua54.type.userdata = 1;
@@ -557,6 +599,12 @@ bool fluffyvm_compat_layer_lua54_init(struct fluffyvm* vm) {
 }
 
 void fluffyvm_compat_layer_lua54_cleanup(struct fluffyvm* F) {
+  if (!F->compatLayerLua54StaticData)
+    return;
+
+  if (F->compatLayerLua54StaticData->trampolineRootRef)
+    foxgc_api_remove_from_root2(F->heap, F->staticDataRoot, F->compatLayerLua54StaticData->trampolineRootRef);
+  pthread_mutex_destroy(&F->compatLayerLua54StaticData->trampolineLock);
   free(F->compatLayerLua54StaticData);
 }
 
@@ -617,24 +665,16 @@ EXPORT FLUFFYVM_DECLARE(void, lua_xmove, lua_State* L, lua_State* to, int n) {
   if (n < 0)
     interpreter_error_printf(L->owner, "%s: expected positive n got %d", __func__, n);
 
-  if (to->fiber->state == FIBER_RUNNING)
+  if (to->state == COROUTINE_RUNNING)
     interpreter_error(L->owner, L->owner->staticStrings.attemptToXmoveOnRunningCoroutine);
-  else if (to->fiber->state == FIBER_DEAD)
+  else if (to->state == COROUTINE_DEAD)
     interpreter_error(L->owner, L->owner->staticStrings.attemptToXmoveOnDeadCoroutine);
   
   if (n == 0)
     return;
 
-  if (!fluffyvm_compat_lua54_lua_checkstack(to, 1))
-    interpreter_error(L->owner, L->owner->staticStrings.stackOverflow);
-
-  int moveStart = fluffyvm_compat_lua54_lua_gettop(L) - n;
-  if (moveStart < 0)
-    interpreter_error(L->owner, L->owner->staticStrings.stackUnderflow);
-
-  for (int i = 0; i < n; i++)
-    interpreter_push(L->owner, to->currentCallState, L->currentCallState->generalStack[moveStart + i]);
-  fluffyvm_compat_lua54_lua_pop(L, n);
+  if (!interpreter_xmove(L->owner, L->currentCallState, to->currentCallState, n))
+    interpreter_error(L->owner, fluffyvm_get_errmsg(L->owner));
 }
 
 EXPORT FLUFFYVM_DECLARE(lua_State*, lua_tothread, lua_State* L, int idx) {
@@ -710,6 +750,27 @@ FLUFFYVM_DECLARE(void, lua_register, lua_State* L, const char* name, lua_CFuncti
   fluffyvm_compat_lua54_lua_setglobal(L, name);
 }
 
+EXPORT FLUFFYVM_DECLARE(int, luaopen_channel, lua_State* L) {
+  fluffyvm_compat_lua54_lua_createtable(L, 0, 7);
+  if (!channel_install(L->owner, NULL, getValueAtStackIndex(L, -1)))
+    interpreter_error(L->owner, fluffyvm_get_errmsg(L->owner));
+  return 1;
+}
+
+EXPORT FLUFFYVM_DECLARE(void, lua_pushchannel, lua_State* L, struct fluffyvm_channel* channel) {
+  ensureStackFits(L, 1);
+  foxgc_root_reference_t* rootRef = NULL;
+  struct value val = channel_to_value(L->owner, channel, &rootRef);
+  if (val.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    interpreter_error(L->owner, fluffyvm_get_errmsg(L->owner));
+  interpreter_push(L->owner, L->currentCallState, val);
+  foxgc_api_remove_from_root2(L->owner->heap, fluffyvm_get_root(L->owner), rootRef);
+}
+
+EXPORT FLUFFYVM_DECLARE(struct fluffyvm_channel*, lua_tochannel, lua_State* L, int idx) {
+  return channel_from_value(L->owner, getValueAtStackIndex(L, idx));
+}
+
 
 
 
@@ -105,6 +105,7 @@ FLUFFYVM_DECLARE(void, lua_createtable, lua_State* L, int narr, int nrec);
 FLUFFYVM_DECLARE(void, lua_newtable, lua_State* L); 
 FLUFFYVM_DECLARE(lua_State*, lua_newthread, lua_State* L); 
 FLUFFYVM_DECLARE(int, lua_resume, lua_State* L, lua_State* from, int nargs, int* nresults); 
+FLUFFYVM_DECLARE(int, lua_yield, lua_State* L, int nresults); 
 FLUFFYVM_DECLARE(void, lua_pushlightuserdata, lua_State* L, void* ptr); 
 FLUFFYVM_DECLARE(void, lua_pushinteger, lua_State* L, lua_Integer integer); 
 FLUFFYVM_DECLARE(void, lua_pushnumber, lua_State* L, lua_Number integer); 
@@ -122,6 +123,19 @@ FLUFFYVM_DECLARE(void, lua_setglobal, lua_State* L, const char* name);
 FLUFFYVM_DECLARE(void, lua_setfield, lua_State* L, int tableIndex, const char* name);
 FLUFFYVM_DECLARE(void, lua_register, lua_State* L, const char* name, lua_CFunction cfunc);
 
+// FluffyVM extensions (not in Lua)
+struct fluffyvm_channel;
+
+// Push table with channel functions (see
+// `channel_install`), usable as opener for
+// `luaL_requiref`. Blocking ones yield the
+// coroutine if they can (resume it to try
+// again), else block the calling thread
+FLUFFYVM_DECLARE(int, luaopen_channel, lua_State* L);
+FLUFFYVM_DECLARE(void, lua_pushchannel, lua_State* L, struct fluffyvm_channel* channel);
+// NULL if value at `idx` is not channel
+FLUFFYVM_DECLARE(struct fluffyvm_channel*, lua_tochannel, lua_State* L, int idx);
+
 //FLUFFYVM_DECLARE(void, lua_callk, lua_State* L, int nargs, int nresults); 
 
 #ifdef FLUFFYVM_INTERNAL
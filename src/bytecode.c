@@ -1,3 +1,4 @@
+#include <Block.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,7 @@
 #include "value.h"
 #include "format/bytecode.pb-c.h"
 #include "config.h"
+#include "ref_counter.h"
 
 #define UNIQUE_KEY(name) static uintptr_t name = (uintptr_t) &name
 
@@ -17,6 +19,7 @@ UNIQUE_KEY(prototypeTypeKey);
 UNIQUE_KEY(prototypesArrayTypeKey);
 UNIQUE_KEY(instructionsArrayTypeKey);
 UNIQUE_KEY(lineInfoArrayTypeKey);
+UNIQUE_KEY(materializedArrayTypeKey);
 UNIQUE_KEY(constantsArrayTypeKey);
 UNIQUE_KEY(constantsObjectArrayTypeKey);
 
@@ -36,6 +39,7 @@ bool bytecode_init(struct fluffyvm* vm) {
   vm->bytecodeStaticData = malloc(sizeof(*vm->bytecodeStaticData));
   if (!vm->bytecodeStaticData)
     return false;
+  pthread_mutex_init(&vm->bytecodeStaticData->materializeLock, NULL);
 
   create_descriptor("net.fluffyfox.fluffyvm.bytecode.Bytecode", bytecodeTypeKey, desc_bytecode, struct fluffyvm_bytecode, {
     {"this", offsetof(struct fluffyvm_bytecode, gc_this)},
@@ -51,6 +55,7 @@ bool bytecode_init(struct fluffyvm* vm) {
     {"prototypes", offsetof(struct fluffyvm_prototype, gc_prototypes)},
     {"lineinfo", offsetof(struct fluffyvm_prototype, gc_lineInfo)},
     {"sourceFileObject", offsetof(struct fluffyvm_prototype, sourceFileObject)},
+    {"materialized", offsetof(struct fluffyvm_prototype, gc_materialized)},
   });
 
   return true;
@@ -62,6 +67,7 @@ void bytecode_cleanup(struct fluffyvm* vm) {
 
   free_descriptor(desc_bytecode);
   free_descriptor(desc_prototype);
+  pthread_mutex_destroy(&vm->bytecodeStaticData->materializeLock);
   free(vm->bytecodeStaticData);
 }
 
@@ -80,6 +86,16 @@ static inline void prototype_write_prototypes_array(struct fluffyvm_prototype* p
 
 static inline void prototype_write_prototype(struct fluffyvm_prototype* proto, int index, struct fluffyvm_prototype* proto2) {
   foxgc_api_write_array(proto->gc_prototypes, index, proto2->gc_this);
+
+  // Release pairs with acquire in
+  // `bytecode_prototype_get_child`
+  if (proto->materialized)
+    atomic_store_explicit(&proto->materialized[index], true, memory_order_release);
+}
+
+static inline void prototype_write_materialized_array(struct fluffyvm_prototype* proto, foxgc_object_t* obj) {
+  foxgc_api_write_field(proto->gc_this, 6, obj);
+  proto->materialized = obj ? foxgc_api_object_get_data(obj) : NULL;
 }
 
 static inline void prototype_write_instructions_array(struct fluffyvm_prototype* proto, foxgc_object_t* obj) {
@@ -116,7 +132,9 @@ static inline void prototype_write_source_file_name(struct fluffyvm_prototype* p
 
 ///////////////////////
 
-static struct fluffyvm_prototype* loadPrototype(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, FluffyVmFormat__Bytecode__Prototype* proto) {
+// Prototype with empty code and `prototypesCount`
+// unfilled children slots
+static struct fluffyvm_prototype* newPrototype(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, void* encoded, struct value sourceFile, size_t prototypesCount) {
   foxgc_object_t* obj = foxgc_api_new_object(vm->heap, NULL, fluffyvm_get_root(vm), rootRef, vm->bytecodeStaticData->desc_prototype, NULL);
   if (obj == NULL) {
     fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
@@ -128,67 +146,99 @@ static struct fluffyvm_prototype* loadPrototype(struct fluffyvm* vm, struct fluf
   // Write to this->gc_this
   foxgc_api_write_field(obj, 0, obj);
   prototype_write_bytecode(this, bytecode);
-
-  foxgc_root_reference_t* tmpRootRef = NULL;
-  int len = strlen(proto->sourcefile);
-  if (len == 0) 
-    len = -1;
-  
-  struct value sourceFilename = value_new_string2_constant(vm, proto->sourcefile, len + 1, &tmpRootRef);
-  prototype_write_source_file_name(this, sourceFilename);
-  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmpRootRef);
+  prototype_write_source_file_name(this, sourceFile);
+  prototype_write_instructions_array(this, NULL);
+  prototype_write_line_info_array(this, NULL);
+  prototype_write_materialized_array(this, NULL);
+  this->encoded = encoded;
 
   foxgc_root_reference_t* prototypesRef = NULL;
-  foxgc_object_t* prototypesArray = foxgc_api_new_array(vm->heap, fluffyvm_get_owner_key(), prototypesArrayTypeKey, NULL, fluffyvm_get_root(vm), &prototypesRef, proto->n_prototypes, NULL);
+  foxgc_object_t* prototypesArray = foxgc_api_new_array(vm->heap, fluffyvm_get_owner_key(), prototypesArrayTypeKey, NULL, fluffyvm_get_root(vm), &prototypesRef, prototypesCount, NULL);
   if (!prototypesArray)
     goto no_memory;
   prototype_write_prototypes_array(this, prototypesArray);
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), prototypesRef);
+
+  if (bytecode->materializer && prototypesCount > 0) {
+    foxgc_root_reference_t* materializedRef = NULL;
+    foxgc_object_t* materializedArray = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), materializedArrayTypeKey, NULL, fluffyvm_get_root(vm), &materializedRef, sizeof(atomic_bool), prototypesCount, NULL);
+    if (!materializedArray)
+      goto no_memory;
+    prototype_write_materialized_array(this, materializedArray);
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), materializedRef);
+
+    for (size_t i = 0; i < prototypesCount; i++)
+      atomic_init(&this->materialized[i], false);
+  }
+  return this;
+
+  no_memory:
+  fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
+  *rootRef = NULL;
+  return NULL;
+}
+
+// Instructions and line info copied
+// into the GC heap
+static struct fluffyvm_prototype* newPrototypeWithCode(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, void* encoded, struct value sourceFile, size_t prototypesCount, const fluffyvm_instruction_t* instructions, size_t instructionsLen, const int* lineInfo, size_t lineInfoLen) {
+  struct fluffyvm_prototype* this = newPrototype(vm, bytecode, rootRef, encoded, sourceFile, prototypesCount);
+  if (!this)
+    return NULL;
   
   foxgc_root_reference_t* instructionsRef = NULL;
-  foxgc_object_t* instructionsArray = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), instructionsArrayTypeKey, NULL, fluffyvm_get_root(vm), &instructionsRef, sizeof(fluffyvm_instruction_t), proto->n_instructions, NULL);
+  foxgc_object_t* instructionsArray = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), instructionsArrayTypeKey, NULL, fluffyvm_get_root(vm), &instructionsRef, sizeof(fluffyvm_instruction_t), instructionsLen, NULL);
   if (!instructionsArray)
     goto no_memory;
   prototype_write_instructions_array(this, instructionsArray);
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), instructionsRef);
   
-  prototype_write_line_info_array(this, NULL);
-  if (proto->n_lineinfo > 0) {
+  if (lineInfoLen > 0) {
     foxgc_root_reference_t* lineInfoRef = NULL;
-    foxgc_object_t* lineInfoArray = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), lineInfoArrayTypeKey, NULL, fluffyvm_get_root(vm), &lineInfoRef, sizeof(int), proto->n_lineinfo, NULL);
+    foxgc_object_t* lineInfoArray = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), lineInfoArrayTypeKey, NULL, fluffyvm_get_root(vm), &lineInfoRef, sizeof(int), lineInfoLen, NULL);
     if (!lineInfoArray)
       goto no_memory;
     prototype_write_line_info_array(this, lineInfoArray);
     foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), lineInfoRef);
   }
 
-  // Filling data
-  for (int i = 0; i < proto->n_prototypes; i++) {
-    foxgc_root_reference_t* tmpRootRef = NULL;
-    struct fluffyvm_prototype* tmp = loadPrototype(vm, bytecode, &tmpRootRef, proto->prototypes[i]);
-    if (!tmp)
-      goto error;
-    prototype_write_prototype(this, i, tmp);
-    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmpRootRef);
-  }
-
-  for (int i = 0; i < proto->n_instructions; i++)
-    this->instructions[i] = (fluffyvm_instruction_t) proto->instructions[i];
+  for (size_t i = 0; i < instructionsLen; i++)
+    this->instructions[i] = instructions[i];
   
-  for (int i = 0; i < proto->n_lineinfo; i++)
-    this->lineInfo[i] = proto->lineinfo[i];
+  for (size_t i = 0; i < lineInfoLen; i++)
+    this->lineInfo[i] = lineInfo[i];
 
   return this;
   
   no_memory:
   fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
-  
-  error:
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
   *rootRef = NULL;
   return NULL;
 } 
 
+// Children built by `materializePrototype`
+// when first loaded. Code borrowed from
+// the decoded message which the bytecode
+// keeps anyway so it exist only once
+static struct fluffyvm_prototype* loadPrototype(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, FluffyVmFormat__Bytecode__Prototype* proto) {
+  foxgc_root_reference_t* tmpRootRef = NULL;
+  int len = strlen(proto->sourcefile);
+  if (len == 0) 
+    len = -1;
+  
+  struct value sourceFilename = value_new_string2_constant(vm, proto->sourcefile, len + 1, &tmpRootRef);
+  struct fluffyvm_prototype* this = bytecode_prototype_new(vm, bytecode, rootRef, proto, sourceFilename, proto->n_prototypes, proto->instructions, proto->n_instructions, proto->lineinfo, proto->n_lineinfo);
+  if (tmpRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmpRootRef);
+  return this;
+}
+
+static struct fluffyvm_prototype* materializePrototype(struct fluffyvm* vm, struct fluffyvm_prototype* parent, int index, foxgc_root_reference_t** rootRef) {
+  FluffyVmFormat__Bytecode__Prototype* proto = parent->encoded;
+  return loadPrototype(vm, parent->bytecode, rootRef, proto->prototypes[index]);
+}
+
 // Bytecode setters //
 
 static inline void bytecode_write_constants_array(struct fluffyvm_bytecode* bytecode, foxgc_object_t* obj) {
@@ -226,42 +276,111 @@ static void bytecode_write_constant(struct fluffyvm* vm, struct fluffyvm_bytecod
 
 //////////////////////
 
-struct fluffyvm_bytecode* bytecode_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, void* data, size_t len) {
-  foxgc_object_t* obj = foxgc_api_new_object(vm->heap, NULL, fluffyvm_get_root(vm), rootRef, vm->bytecodeStaticData->desc_bytecode, NULL);
+struct fluffyvm_bytecode* bytecode_new(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, size_t constantsCount, struct ref_counter* backingStore, bytecode_materializer_t materializer) {
+  foxgc_object_t* obj = foxgc_api_new_object(vm->heap, NULL, fluffyvm_get_root(vm), rootRef, vm->bytecodeStaticData->desc_bytecode, ^void (foxgc_object_t* obj) {
+    struct fluffyvm_bytecode* this = foxgc_api_object_get_data(obj);
+    if (this->backingStore)
+      ref_counter_dec(this->backingStore);
+  });
   if (obj == NULL) {
     fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
     return NULL;
   }
   struct fluffyvm_bytecode* this = foxgc_api_object_get_data(obj);
+  this->backingStore = NULL;
+  this->materializer = materializer;
   // Write to this->gc_this
   foxgc_api_write_field(obj, 0, obj);
- 
-  // Decode
-  FluffyVmFormat__Bytecode__Bytecode* bytecode = fluffy_vm_format__bytecode__bytecode__unpack(NULL, len, data);
-  if (bytecode == NULL) {
-    fluffyvm_set_errmsg(vm, vm->staticStrings.protobufFailedToUnpackData);
-    goto error;
+  bytecode_write_main_prototype(this, NULL);
+  if (!bytecode_set_constants_count(vm, this, constantsCount)) {
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
+    *rootRef = NULL;
+    return NULL;
   }
 
-  if (bytecode->version != FLUFFYVM_RELEASE_NUM) {
-    fluffyvm_set_errmsg(vm, vm->staticStrings.unsupportedBytecode);
-    goto error;
-  }
-  
-  // Allocate resources
+  // Only now so failure above leave the
+  // caller's reference untouched
+  this->backingStore = backingStore;
+  return this;
+}
+
+bool bytecode_set_constants_count(struct fluffyvm* vm, struct fluffyvm_bytecode* this, size_t constantsCount) {
   foxgc_root_reference_t* constantsRef = NULL;
-  foxgc_object_t* constantsArray = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), constantsArrayTypeKey, NULL, fluffyvm_get_root(vm), &constantsRef, sizeof(struct value), bytecode->n_constants, NULL);
+  foxgc_object_t* constantsArray = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), constantsArrayTypeKey, NULL, fluffyvm_get_root(vm), &constantsRef, sizeof(struct value), constantsCount, NULL);
   if (!constantsArray)
     goto no_memory;
   bytecode_write_constants_array(this, constantsArray);
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), constantsRef);
   
   foxgc_root_reference_t* constantsObjectArrayRef = NULL;
-  foxgc_object_t* constantsObjectArray = foxgc_api_new_array(vm->heap, fluffyvm_get_owner_key(), constantsObjectArrayTypeKey, NULL, fluffyvm_get_root(vm), &constantsObjectArrayRef, bytecode->n_constants, NULL);
+  foxgc_object_t* constantsObjectArray = foxgc_api_new_array(vm->heap, fluffyvm_get_owner_key(), constantsObjectArrayTypeKey, NULL, fluffyvm_get_root(vm), &constantsObjectArrayRef, constantsCount, NULL);
   if (!constantsObjectArray)
     goto no_memory;
   bytecode_write_constants_object_array(this, constantsObjectArray);
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), constantsObjectArrayRef);
+  return true;
+  
+  no_memory:
+  fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+  return false;
+}
+
+void bytecode_set_constant(struct fluffyvm* vm, struct fluffyvm_bytecode* this, int index, struct value constant) {
+  bytecode_write_constant(vm, this, index, constant);
+}
+
+void bytecode_set_main_prototype(struct fluffyvm_bytecode* this, struct fluffyvm_prototype* prototype) {
+  bytecode_write_main_prototype(this, prototype);
+}
+
+struct fluffyvm_prototype* bytecode_prototype_new(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, void* encoded, struct value sourceFile, size_t prototypesCount, const fluffyvm_instruction_t* instructions, size_t instructionsLen, const int* lineInfo, size_t lineInfoLen) {
+  struct fluffyvm_prototype* this = newPrototype(vm, bytecode, rootRef, encoded, sourceFile, prototypesCount);
+  if (!this)
+    return NULL;
+
+  // Borrowed, never written through
+  this->instructions = (fluffyvm_instruction_t*) instructions;
+  this->instructions_len = instructionsLen;
+  this->lineInfo = lineInfoLen > 0 ? (int*) lineInfo : NULL;
+  this->lineInfo_len = lineInfoLen;
+  return this;
+}
+
+struct fluffyvm_prototype* bytecode_prototype_new_copy(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, void* encoded, struct value sourceFile, size_t prototypesCount, const fluffyvm_instruction_t* instructions, size_t instructionsLen, const int* lineInfo, size_t lineInfoLen) {
+  return newPrototypeWithCode(vm, bytecode, rootRef, encoded, sourceFile, prototypesCount, instructions, instructionsLen, lineInfo, lineInfoLen);
+}
+
+void bytecode_prototype_set_prototype(struct fluffyvm_prototype* this, int index, struct fluffyvm_prototype* child) {
+  prototype_write_prototype(this, index, child);
+}
+
+struct fluffyvm_bytecode* bytecode_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, void* data, size_t len) {
+  *rootRef = NULL;
+  struct fluffyvm_bytecode* this = NULL;
+ 
+  // Decode
+  FluffyVmFormat__Bytecode__Bytecode* bytecode = fluffy_vm_format__bytecode__bytecode__unpack(NULL, len, data);
+  if (bytecode == NULL) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.protobufFailedToUnpackData);
+    goto error;
+  }
+
+  if (bytecode->version != FLUFFYVM_RELEASE_NUM) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.unsupportedBytecode);
+    goto error;
+  }
+  
+  // Decoded form kept for building children
+  // later and executed in place, owned by
+  // bytecode from now
+  struct ref_counter* backingStore = ref_counter_new(bytecode, Block_copy(^void (struct ref_counter* counter) {
+    fluffy_vm_format__bytecode__bytecode__free_unpacked(counter->data, NULL);
+  }));
+  this = bytecode_new(vm, rootRef, bytecode->n_constants, backingStore, materializePrototype);
+  if (!this) {
+    ref_counter_dec(backingStore);
+    return NULL;
+  }
   
   // Filling data
   for (int i = 0; i < bytecode->n_constants; i++) {
@@ -313,18 +432,14 @@ struct fluffyvm_bytecode* bytecode_load(struct fluffyvm* vm, foxgc_root_referenc
     goto error;
   bytecode_write_main_prototype(this, mainPrototype);
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), mainPrototypeRef);
-
-  fluffy_vm_format__bytecode__bytecode__free_unpacked(bytecode, NULL);
   return this;
 
-  no_memory:
-  fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
-  
   error:
-  if (bytecode)
+  if (bytecode && !this)
     fluffy_vm_format__bytecode__bytecode__free_unpacked(bytecode, NULL);
 
-  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
+  if (*rootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
   *rootRef = NULL;
   return NULL;
 }
@@ -349,7 +464,39 @@ struct fluffyvm_prototype* bytecode_prototype_get_prototype(struct fluffyvm* vm,
     return NULL;
   }
 
-  foxgc_api_root_add(vm->heap, this->prototypes[index], fluffyvm_get_root(vm), rootRef);
+  struct fluffyvm_prototype* child = bytecode_prototype_get_child(vm, this, index);
+  if (!child)
+    return NULL;
+
+  foxgc_api_root_add(vm->heap, child->gc_this, fluffyvm_get_root(vm), rootRef);
+  return child;
+}
+
+struct fluffyvm_prototype* bytecode_prototype_peek_child(struct fluffyvm_prototype* this, int index) {
+  if (this->materialized && !atomic_load_explicit(&this->materialized[index], memory_order_acquire))
+    return NULL;
+  return foxgc_api_object_get_data(this->prototypes[index]);
+}
+
+struct fluffyvm_prototype* bytecode_prototype_get_child(struct fluffyvm* vm, struct fluffyvm_prototype* this, int index) {
+  if (!this->materialized || atomic_load_explicit(&this->materialized[index], memory_order_acquire))
+    return foxgc_api_object_get_data(this->prototypes[index]);
+
+  // Build outside the lock as it allocates,
+  // racing threads may build it twice but
+  // only first one published
+  foxgc_root_reference_t* rootRef = NULL;
+  struct fluffyvm_prototype* child = this->bytecode->materializer(vm, this, index, &rootRef);
+  if (!child)
+    return NULL;
+
+  pthread_mutex_t* lock = &vm->bytecodeStaticData->materializeLock;
+  pthread_mutex_lock(lock);
+  if (!atomic_load_explicit(&this->materialized[index], memory_order_relaxed))
+    prototype_write_prototype(this, index, child);
+  pthread_mutex_unlock(lock);
+
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), rootRef);
   return foxgc_api_object_get_data(this->prototypes[index]);
 }
 
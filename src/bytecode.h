@@ -1,6 +1,7 @@
 #ifndef header_1650890657_bytecode_h
 #define header_1650890657_bytecode_h
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -10,6 +11,12 @@
 // Each instruction is 64-bit
 typedef uint64_t fluffyvm_instruction_t;
 
+struct fluffyvm_prototype;
+
+// Build `index`th child of `parent` from
+// its encoded form (see `bytecode_prototype_get_child`)
+typedef struct fluffyvm_prototype* (*bytecode_materializer_t)(struct fluffyvm* vm, struct fluffyvm_prototype* parent, int index, foxgc_root_reference_t** rootRef);
+
 struct fluffyvm_prototype {
   struct fluffyvm_bytecode* bytecode;
   
@@ -18,7 +25,17 @@ struct fluffyvm_prototype {
   
   size_t prototypes_len;
   // struct fluffyvm_prototype*
+  // Use `bytecode_prototype_get_child` as
+  // children can be not materialized yet
   foxgc_object_t** prototypes;
+
+  // NULL if all children present, else
+  // set once child written to `prototypes`
+  atomic_bool* materialized;
+
+  // Loader's handle to this prototype's
+  // encoded form
+  void* encoded;
   
   // Debug info
   size_t lineInfo_len;
@@ -35,11 +52,22 @@ struct fluffyvm_prototype {
   foxgc_object_t* gc_bytecode;
   foxgc_object_t* gc_prototypes;
   foxgc_object_t* gc_lineInfo;
+  foxgc_object_t* gc_materialized;
 };
 
+struct ref_counter;
+
 struct fluffyvm_bytecode {
   struct fluffyvm_prototype* mainPrototype;
   
+  // Memory which prototypes' code borrowed
+  // from (see `bytecode_prototype_new`) or NULL
+  struct ref_counter* backingStore;
+
+  // Children prototypes built on first
+  // use if not NULL
+  bytecode_materializer_t materializer;
+  
   size_t constants_len;
   struct value* constants;
   foxgc_object_t** constantsObject;
@@ -57,10 +85,44 @@ void bytecode_cleanup(struct fluffyvm* vm);
 // containing ProtoBuf encoded `message Bytecode`
 struct fluffyvm_bytecode* bytecode_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, void* data, size_t len);
 
+// For loaders building bytecode without going
+// through ProtoBuf (e.g. loader/bytecode/image.h)
+//
+// On success bytecode takes `backingStore`'s
+// reference (can be NULL) and release it
+// when collected. `materializer` (can be
+// NULL) make children of prototypes lazy
+struct fluffyvm_bytecode* bytecode_new(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, size_t constantsCount, struct ref_counter* backingStore, bytecode_materializer_t materializer);
+// Replace constants with `constantsCount`
+// empty ones, for loaders only knowing the
+// count after creating bytecode
+bool bytecode_set_constants_count(struct fluffyvm* vm, struct fluffyvm_bytecode* this, size_t constantsCount);
+void bytecode_set_constant(struct fluffyvm* vm, struct fluffyvm_bytecode* this, int index, struct value constant);
+void bytecode_set_main_prototype(struct fluffyvm_bytecode* this, struct fluffyvm_prototype* prototype);
+
+// `instructions` and `lineInfo` are not copied
+// but executed in place so they must be aligned
+// and live in `bytecode`'s backing store
+struct fluffyvm_prototype* bytecode_prototype_new(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, void* encoded, struct value sourceFile, size_t prototypesCount, const fluffyvm_instruction_t* instructions, size_t instructionsLen, const int* lineInfo, size_t lineInfoLen);
+// Same but `instructions` and `lineInfo`
+// copied to GC heap instead
+struct fluffyvm_prototype* bytecode_prototype_new_copy(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, void* encoded, struct value sourceFile, size_t prototypesCount, const fluffyvm_instruction_t* instructions, size_t instructionsLen, const int* lineInfo, size_t lineInfoLen);
+void bytecode_prototype_set_prototype(struct fluffyvm_prototype* this, int index, struct fluffyvm_prototype* child);
+
 // Getters
 struct value bytecode_get_constant(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, foxgc_root_reference_t** rootRef, int index);
 struct fluffyvm_prototype* bytecode_prototype_get_prototype(struct fluffyvm* vm, struct fluffyvm_prototype* prototype, foxgc_root_reference_t** rootRef, int index);
 
+// Materialize child on first call, safe to
+// race. Result is reachable from `prototype`
+// so no rooting needed. Return NULL on
+// error (errmsg set), index is not checked
+struct fluffyvm_prototype* bytecode_prototype_get_child(struct fluffyvm* vm, struct fluffyvm_prototype* prototype, int index);
+
+// Child if already built else NULL, never
+// materialize it, index is not checked
+struct fluffyvm_prototype* bytecode_prototype_peek_child(struct fluffyvm_prototype* prototype, int index);
+
 #endif
 
 
@@ -0,0 +1,833 @@
+#define FLUFFYVM_INTERNAL
+
+#include <Block.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "channel.h"
+#include "closure.h"
+#include "config.h"
+#include "coroutine.h"
+#include "fluffyvm.h"
+#include "fluffyvm_types.h"
+#include "interpreter.h"
+#include "native_module.h"
+#include "scheduler/scheduler.h"
+#include "util/futex.h"
+#include "value.h"
+
+#define UNIQUE_KEY(name) static uintptr_t name = (uintptr_t) &name
+
+UNIQUE_KEY(channelTypeKey);
+UNIQUE_KEY(channelValuesArrayTypeKey);
+
+#define create_descriptor(name2, key, name, structure, ...) do { \
+  foxgc_descriptor_pointer_t offsets[] = __VA_ARGS__; \
+  vm->channelStaticData->name = foxgc_api_descriptor_new(vm->heap, fluffyvm_get_owner_key(), key, name2, sizeof(offsets) / sizeof(offsets[0]), offsets, sizeof(structure)); \
+  if (vm->channelStaticData->name == NULL) \
+    return false; \
+} while (0)
+
+#define free_descriptor(name) do { \
+  if (vm->channelStaticData->name) \
+    foxgc_api_descriptor_remove(vm->channelStaticData->name); \
+} while(0)
+
+#define CHANNEL_OFFSET_THIS (0)
+#define CHANNEL_OFFSET_VALUES (1)
+
+#define CHANNEL_TYPE_ID (1)
+
+// Shared by all waiters of one blocking
+// call (more than one on select)
+struct parker {
+  struct fluffyvm* vm;
+  struct scheduler* scheduler;
+  // NULL if not a scheduled coroutine
+  struct scheduler_task* task;
+  // Non NULL if coroutine on a fiber which
+  // isnt scheduled, nothing can wake it so
+  // it just yields to its resumer
+  struct fluffyvm_coroutine* co;
+  atomic_uint futexWord;
+
+  // Index of the waiter which got
+  // notified, -1 if none yet
+  atomic_int fired;
+};
+
+struct channel_waiter {
+  struct parker* parker;
+  int index;
+
+  bool isLinked;
+  struct channel_waiter* prev;
+  struct channel_waiter* next;
+};
+
+bool channel_init(struct fluffyvm* vm) {
+  vm->channelStaticData = malloc(sizeof(*vm->channelStaticData));
+  if (!vm->channelStaticData)
+    return false;
+
+  vm->channelStaticData->moduleID = value_get_module_id();
+  create_descriptor("net.fluffyfox.fluffyvm.channel.Channel", channelTypeKey, desc_channel, struct fluffyvm_channel, {
+    {"this", offsetof(struct fluffyvm_channel, gc_this)},
+    {"values", offsetof(struct fluffyvm_channel, gc_values)}
+  });
+
+  return true;
+}
+
+void channel_cleanup(struct fluffyvm* vm) {
+  if (!vm->channelStaticData)
+    return;
+
+  free_descriptor(desc_channel);
+  free(vm->channelStaticData);
+}
+
+struct fluffyvm_channel* channel_new(struct fluffyvm* vm, int capacity, foxgc_root_reference_t** rootRef) {
+  // Vyukov's queue need at least two cells
+  size_t size = 2;
+  while (size < (size_t) capacity)
+    size <<= 1;
+
+  struct channel_cell* cells = malloc(sizeof(*cells) * size);
+  if (!cells) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+
+  foxgc_object_t* obj = foxgc_api_new_object(vm->heap, NULL, fluffyvm_get_root(vm), rootRef, vm->channelStaticData->desc_channel, Block_copy(^void (foxgc_object_t* obj) {
+    struct fluffyvm_channel* this = foxgc_api_object_get_data(obj);
+    pthread_mutex_destroy(&this->waitersLock);
+    free(cells);
+  }));
+  if (!obj) {
+    free(cells);
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+
+  struct fluffyvm_channel* this = foxgc_api_object_get_data(obj);
+  foxgc_api_write_field(obj, CHANNEL_OFFSET_THIS, obj);
+  foxgc_api_write_field(obj, CHANNEL_OFFSET_VALUES, NULL);
+
+  this->capacity = size;
+  this->cells = cells;
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&cells[i].sequence, i);
+    cells[i].value = value_nil;
+  }
+
+  atomic_init(&this->enqueuePos, 0);
+  atomic_init(&this->dequeuePos, 0);
+  atomic_init(&this->closed, false);
+  atomic_init(&this->sendWaitersCount, 0);
+  atomic_init(&this->recvWaitersCount, 0);
+  this->sendWaiters = NULL;
+  this->recvWaiters = NULL;
+  pthread_mutex_init(&this->waitersLock, NULL);
+
+  foxgc_root_reference_t* tmp = NULL;
+  foxgc_object_t* valuesObj = foxgc_api_new_array(vm->heap, fluffyvm_get_owner_key(), channelValuesArrayTypeKey, NULL, fluffyvm_get_root(vm), &tmp, size, NULL);
+  if (!valuesObj) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
+    *rootRef = NULL;
+    return NULL;
+  }
+  foxgc_api_write_field(obj, CHANNEL_OFFSET_VALUES, valuesObj);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmp);
+  return this;
+}
+
+////////////////////////////////////////
+// Waiting                            //
+////////////////////////////////////////
+
+static void parkerInit(struct parker* parker, struct fluffyvm* vm, struct scheduler* scheduler) {
+  parker->vm = vm;
+  parker->scheduler = scheduler;
+  parker->task = scheduler_get_suspendable_task(scheduler);
+  parker->co = NULL;
+  atomic_init(&parker->futexWord, 0);
+  atomic_init(&parker->fired, -1);
+
+  struct fluffyvm_coroutine* co = fluffyvm_get_executing_coroutine(vm);
+  if (!parker->task && co && co->fiber && coroutine_can_yield(co))
+    parker->co = co;
+}
+
+// Only blocks the thread if the caller
+// isnt a coroutine which can yield
+static void parkerPark(struct parker* parker) {
+  if (parker->task) {
+    // Can be woken by something else
+    while (atomic_load(&parker->fired) == -1)
+      scheduler_suspend(parker->scheduler);
+    return;
+  }
+
+  // Resumer decide when to try again
+  if (parker->co) {
+    if (!coroutine_yield(parker->vm))
+      interpreter_error(parker->vm, fluffyvm_get_errmsg(parker->vm));
+    return;
+  }
+
+  while (atomic_load(&parker->futexWord) == 0)
+    futex_wait(&parker->futexWord, 0, NULL);
+}
+
+// Called with the channel lock held so
+// the waiter (and the task) still alive
+static void parkerUnpark(struct parker* parker) {
+  if (parker->task) {
+    scheduler_wake(parker->task);
+    return;
+  }
+
+  if (parker->co)
+    return;
+
+  atomic_store(&parker->futexWord, 1);
+  futex_wake(&parker->futexWord, 1);
+}
+
+static void linkWaiter(struct fluffyvm_channel* this, struct channel_waiter** list, atomic_int* count, struct channel_waiter* waiter) {
+  pthread_mutex_lock(&this->waitersLock);
+  waiter->prev = NULL;
+  waiter->next = *list;
+  if (*list)
+    (*list)->prev = waiter;
+  *list = waiter;
+  waiter->isLinked = true;
+  atomic_fetch_add(count, 1);
+  pthread_mutex_unlock(&this->waitersLock);
+}
+
+// Lock must be held
+static void removeWaiter(struct channel_waiter** list, atomic_int* count, struct channel_waiter* waiter) {
+  if (waiter->prev)
+    waiter->prev->next = waiter->next;
+  else
+    *list = waiter->next;
+  if (waiter->next)
+    waiter->next->prev = waiter->prev;
+
+  waiter->isLinked = false;
+  atomic_fetch_sub(count, 1);
+}
+
+static void unlinkWaiter(struct fluffyvm_channel* this, struct channel_waiter** list, atomic_int* count, struct channel_waiter* waiter) {
+  pthread_mutex_lock(&this->waitersLock);
+  if (waiter->isLinked)
+    removeWaiter(list, count, waiter);
+  pthread_mutex_unlock(&this->waitersLock);
+}
+
+static void notify(struct fluffyvm_channel* this, struct channel_waiter** list, atomic_int* count, bool all) {
+  // Pairs with fence after linking, either we
+  // see the waiter or it see our change
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(count, memory_order_relaxed) == 0)
+    return;
+
+  pthread_mutex_lock(&this->waitersLock);
+  while (*list) {
+    struct channel_waiter* waiter = *list;
+    removeWaiter(list, count, waiter);
+
+    // Fail if other channel of a select
+    // already notified it
+    int expect = -1;
+    if (atomic_compare_exchange_strong(&waiter->parker->fired, &expect, waiter->index)) {
+      parkerUnpark(waiter->parker);
+      if (!all)
+        break;
+    }
+  }
+  pthread_mutex_unlock(&this->waitersLock);
+}
+
+////////////////////////////////////////
+// Operations                         //
+////////////////////////////////////////
+
+channel_status_t channel_try_send(struct fluffyvm* vm, struct fluffyvm_channel* this, struct value value) {
+  if (atomic_load(&this->closed))
+    return CHANNEL_CLOSED;
+
+  size_t mask = this->capacity - 1;
+  size_t pos = atomic_load_explicit(&this->enqueuePos, memory_order_relaxed);
+  struct channel_cell* cell;
+  while (true) {
+    cell = &this->cells[pos & mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&this->enqueuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return CHANNEL_WOULD_BLOCK;
+    } else {
+      pos = atomic_load_explicit(&this->enqueuePos, memory_order_relaxed);
+    }
+  }
+
+  cell->value = value;
+  foxgc_api_write_array(this->gc_values, pos & mask, value_get_object_ptr(value));
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+  notify(this, &this->recvWaiters, &this->recvWaitersCount, false);
+  return CHANNEL_OK;
+}
+
+channel_status_t channel_try_recv(struct fluffyvm* vm, struct fluffyvm_channel* this, struct value* result, foxgc_root_reference_t** rootRef) {
+  size_t mask = this->capacity - 1;
+  size_t pos = atomic_load_explicit(&this->dequeuePos, memory_order_relaxed);
+  struct channel_cell* cell;
+  while (true) {
+    cell = &this->cells[pos & mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&this->dequeuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return atomic_load(&this->closed) ? CHANNEL_CLOSED : CHANNEL_WOULD_BLOCK;
+    } else {
+      pos = atomic_load_explicit(&this->dequeuePos, memory_order_relaxed);
+    }
+  }
+
+  struct value value = cell->value;
+
+  // Root it before the channel let go
+  foxgc_object_t* ptr;
+  if (rootRef)
+    *rootRef = NULL;
+  if (rootRef && (ptr = value_get_object_ptr(value)))
+    foxgc_api_root_add(vm->heap, ptr, fluffyvm_get_root(vm), rootRef);
+
+  if (result)
+    *result = value;
+
+  cell->value = value_nil;
+  foxgc_api_write_array(this->gc_values, pos & mask, NULL);
+  atomic_store_explicit(&cell->sequence, pos + mask + 1, memory_order_release);
+
+  notify(this, &this->sendWaiters, &this->sendWaitersCount, false);
+  return CHANNEL_OK;
+}
+
+channel_status_t channel_send(struct fluffyvm* vm, struct fluffyvm_channel* this, struct scheduler* scheduler, struct value value) {
+  while (true) {
+    channel_status_t status = channel_try_send(vm, this, value);
+    if (status != CHANNEL_WOULD_BLOCK)
+      return status;
+
+    struct parker parker;
+    parkerInit(&parker, vm, scheduler);
+    struct channel_waiter waiter = {
+      .parker = &parker,
+      .index = 0
+    };
+    linkWaiter(this, &this->sendWaiters, &this->sendWaitersCount, &waiter);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Receiver may took something before we
+    // were linked
+    status = channel_try_send(vm, this, value);
+    if (status == CHANNEL_WOULD_BLOCK)
+      parkerPark(&parker);
+    unlinkWaiter(this, &this->sendWaiters, &this->sendWaitersCount, &waiter);
+
+    if (status == CHANNEL_WOULD_BLOCK)
+      continue;
+
+    // Got notified but didnt need it
+    // pass it to other sender
+    if (atomic_load(&parker.fired) != -1)
+      notify(this, &this->sendWaiters, &this->sendWaitersCount, false);
+    return status;
+  }
+}
+
+channel_status_t channel_recv(struct fluffyvm* vm, struct fluffyvm_channel* this, struct scheduler* scheduler, struct value* result, foxgc_root_reference_t** rootRef) {
+  if (channel_select(vm, &this, 1, scheduler, result, rootRef) < 0)
+    return CHANNEL_CLOSED;
+  return CHANNEL_OK;
+}
+
+// Try receive from any, return its
+// index or -1 (`allClosed` set if
+// all channels closed)
+static int tryRecvAny(struct fluffyvm* vm, struct fluffyvm_channel** channels, int count, struct value* result, foxgc_root_reference_t** rootRef, bool* allClosed) {
+  int closedCount = 0;
+  for (int i = 0; i < count; i++) {
+    channel_status_t status = channel_try_recv(vm, channels[i], result, rootRef);
+    if (status == CHANNEL_OK)
+      return i;
+    if (status == CHANNEL_CLOSED)
+      closedCount++;
+  }
+
+  *allClosed = closedCount == count;
+  return -1;
+}
+
+int channel_select(struct fluffyvm* vm, struct fluffyvm_channel** channels, int count, struct scheduler* scheduler, struct value* result, foxgc_root_reference_t** rootRef) {
+  struct channel_waiter stackWaiters[8];
+  struct channel_waiter* waiters = stackWaiters;
+  int index = -1;
+
+  while (true) {
+    bool allClosed = false;
+    if ((index = tryRecvAny(vm, channels, count, result, rootRef, &allClosed)) >= 0 || allClosed)
+      break;
+
+    if (waiters == stackWaiters && count > (int) (sizeof(stackWaiters) / sizeof(stackWaiters[0]))) {
+      waiters = malloc(sizeof(*waiters) * count);
+      if (!waiters) {
+        fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+        return -1;
+      }
+    }
+
+    struct parker parker;
+    parkerInit(&parker, vm, scheduler);
+    for (int i = 0; i < count; i++) {
+      waiters[i].parker = &parker;
+      waiters[i].index = i;
+      linkWaiter(channels[i], &channels[i]->recvWaiters, &channels[i]->recvWaitersCount, &waiters[i]);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Sender may put something before
+    // we were linked
+    index = tryRecvAny(vm, channels, count, result, rootRef, &allClosed);
+    if (index < 0 && !allClosed)
+      parkerPark(&parker);
+
+    for (int i = 0; i < count; i++)
+      unlinkWaiter(channels[i], &channels[i]->recvWaiters, &channels[i]->recvWaitersCount, &waiters[i]);
+
+    if (index < 0 && !allClosed)
+      continue;
+
+    // Got notified but didnt need it
+    // pass it to other receiver
+    int fired = atomic_load(&parker.fired);
+    if (fired != -1)
+      notify(channels[fired], &channels[fired]->recvWaiters, &channels[fired]->recvWaitersCount, false);
+    break;
+  }
+
+  if (waiters != stackWaiters)
+    free(waiters);
+  return index;
+}
+
+void channel_close(struct fluffyvm_channel* this) {
+  atomic_store(&this->closed, true);
+  notify(this, &this->sendWaiters, &this->sendWaitersCount, true);
+  notify(this, &this->recvWaiters, &this->recvWaitersCount, true);
+}
+
+struct value channel_to_value(struct fluffyvm* vm, struct fluffyvm_channel* this, foxgc_root_reference_t** rootRef) {
+  return value_new_garbage_collectable_userdata(vm, vm->channelStaticData->moduleID, CHANNEL_TYPE_ID, this->gc_this, rootRef);
+}
+
+struct fluffyvm_channel* channel_from_value(struct fluffyvm* vm, struct value value) {
+  if (value.type != FLUFFYVM_TVALUE_GARBAGE_COLLECTABLE_USERDATA ||
+      value.data.userdata->moduleID != vm->channelStaticData->moduleID ||
+      value.data.userdata->typeID != CHANNEL_TYPE_ID)
+    return NULL;
+
+  return foxgc_api_object_get_data(value.data.userdata->userGarbageCollectableData);
+}
+
+////////////////////////////////////////
+// Script functions                   //
+////////////////////////////////////////
+
+static struct fluffyvm_channel* checkChannel(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index) {
+  struct value val;
+  if (!interpreter_peek(vm, callState, index, &val))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+
+  struct fluffyvm_channel* channel = channel_from_value(vm, val);
+  if (!channel)
+    interpreter_error(vm, vm->staticStrings.expectChannel);
+  return channel;
+}
+
+static void push(struct fluffyvm* vm, struct fluffyvm_call_state* callState, struct value value) {
+  if (!interpreter_push(vm, callState, value))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+}
+
+// Push value and remove it from root
+static void pushRooted(struct fluffyvm* vm, struct fluffyvm_call_state* callState, struct value value, foxgc_root_reference_t* rootRef) {
+  bool res = interpreter_push(vm, callState, value);
+  if (rootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), rootRef);
+  if (!res)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+}
+
+// new([capacity])
+static int scriptNew(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  int capacity = FLUFFYVM_CHANNEL_DEFAULT_CAPACITY;
+  if (interpreter_get_top(vm, callState) >= 0) {
+    struct value val = native_module_check_value(vm, callState, 0);
+    if (val.type == FLUFFYVM_TVALUE_LONG) {
+      // Check before narrowing so huge one
+      // cant wrap into small valid one
+      if (val.data.longNum <= 0 || val.data.longNum > INT_MAX)
+        interpreter_error(vm, vm->staticStrings.invalidCapacity);
+      capacity = (int) val.data.longNum;
+    } else if (val.type != FLUFFYVM_TVALUE_NIL) {
+      interpreter_error(vm, vm->staticStrings.expectInteger);
+    }
+  }
+
+  foxgc_root_reference_t* channelRootRef = NULL;
+  struct fluffyvm_channel* channel = channel_new(vm, capacity, &channelRootRef);
+  if (!channel)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+
+  foxgc_root_reference_t* valueRootRef = NULL;
+  struct value val = channel_to_value(vm, channel, &valueRootRef);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), channelRootRef);
+  if (val.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+
+  pushRooted(vm, callState, val, valueRootRef);
+  return 1;
+}
+
+// Push value and true or nil and false
+static int pushReceived(struct fluffyvm* vm, struct fluffyvm_call_state* callState, bool ok, struct value val, foxgc_root_reference_t* rootRef) {
+  if (!ok) {
+    push(vm, callState, value_nil);
+    push(vm, callState, value_new_bool(vm, false));
+    return 2;
+  }
+
+  pushRooted(vm, callState, val, rootRef);
+  push(vm, callState, value_new_bool(vm, true));
+  return 2;
+}
+
+////////////////////////////////////////
+// Blocking script functions          //
+////////////////////////////////////////
+
+// Blocking calls from script suspend the
+// coroutine without needing a fiber. A
+// scheduled coroutine is woken by the
+// channel, any other yields nothing to its
+// resumer which should resume it again
+// later. Only if the coroutine cant yield
+// it blocks (see `channel_send`)
+
+typedef enum {
+  SCRIPT_OP_SEND,
+  SCRIPT_OP_RECV,
+  SCRIPT_OP_SELECT
+} script_op_type_t;
+
+// Channels are the first `count` arguments
+// and read again each time the call
+// continue (they stay on the stack)
+struct script_op {
+  script_op_type_t type;
+  int count;
+  struct fluffyvm_channel** channels;
+  struct value sendValue;
+
+  channel_status_t status;
+  int index;
+  struct value value;
+  foxgc_root_reference_t* rootRef;
+};
+
+// Waiters of a suspended scheduled coroutine
+// they must outlive the native's C frame
+struct script_wait {
+  script_op_type_t type;
+  int count;
+  struct parker parker;
+  struct {
+    struct fluffyvm_channel* channel;
+    struct channel_waiter waiter;
+  } entries[];
+};
+
+static int continueOp(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata);
+static int continueWait(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata);
+
+// Return false if it would block
+static bool tryOp(struct fluffyvm* vm, struct script_op* op) {
+  if (op->type == SCRIPT_OP_SEND) {
+    op->status = channel_try_send(vm, op->channels[0], op->sendValue);
+    return op->status != CHANNEL_WOULD_BLOCK;
+  }
+
+  bool allClosed = false;
+  op->index = tryRecvAny(vm, op->channels, op->count, &op->value, &op->rootRef, &allClosed);
+  op->status = op->index >= 0 ? CHANNEL_OK : CHANNEL_CLOSED;
+  return op->index >= 0 || allClosed;
+}
+
+// Caller cant yield so block the thread
+static void blockOp(struct fluffyvm* vm, struct scheduler* scheduler, struct script_op* op) {
+  if (op->type == SCRIPT_OP_SEND) {
+    op->status = channel_send(vm, op->channels[0], scheduler, op->sendValue);
+    return;
+  }
+
+  op->index = channel_select(vm, op->channels, op->count, scheduler, &op->value, &op->rootRef);
+  op->status = op->index >= 0 ? CHANNEL_OK : CHANNEL_CLOSED;
+}
+
+static void waitLists(struct script_wait* wait, int i, struct channel_waiter*** list, atomic_int** count) {
+  struct fluffyvm_channel* channel = wait->entries[i].channel;
+  if (wait->type == SCRIPT_OP_SEND) {
+    *list = &channel->sendWaiters;
+    *count = &channel->sendWaitersCount;
+  } else {
+    *list = &channel->recvWaiters;
+    *count = &channel->recvWaitersCount;
+  }
+}
+
+static void unlinkWait(struct script_wait* wait) {
+  struct channel_waiter** list;
+  atomic_int* count;
+  for (int i = 0; i < wait->count; i++) {
+    waitLists(wait, i, &list, &count);
+    unlinkWaiter(wait->entries[i].channel, list, count, &wait->entries[i].waiter);
+  }
+
+  // Got notified but didnt need it
+  // pass it to other waiter
+  int fired = atomic_load(&wait->parker.fired);
+  if (fired != -1) {
+    waitLists(wait, fired, &list, &count);
+    notify(wait->entries[fired].channel, list, count, false);
+  }
+}
+
+// Return NULL if out of memory
+static struct script_wait* linkWait(struct fluffyvm* vm, struct scheduler* scheduler, struct scheduler_task* task, struct script_op* op) {
+  struct script_wait* wait = malloc(sizeof(*wait) + sizeof(wait->entries[0]) * op->count);
+  if (!wait)
+    return NULL;
+
+  wait->type = op->type;
+  wait->count = op->count;
+  wait->parker.vm = vm;
+  wait->parker.scheduler = scheduler;
+  wait->parker.task = task;
+  wait->parker.co = NULL;
+  atomic_init(&wait->parker.futexWord, 0);
+  atomic_init(&wait->parker.fired, -1);
+
+  struct channel_waiter** list;
+  atomic_int* count;
+  for (int i = 0; i < op->count; i++) {
+    wait->entries[i].channel = op->channels[i];
+    wait->entries[i].waiter.parker = &wait->parker;
+    wait->entries[i].waiter.index = i;
+    waitLists(wait, i, &list, &count);
+    linkWaiter(op->channels[i], list, count, &wait->entries[i].waiter);
+  }
+  return wait;
+}
+
+static void freeChannels(struct script_op* op, struct fluffyvm_channel** stackChannels) {
+  if (op->channels != stackChannels)
+    free(op->channels);
+}
+
+// Push results, `op` is done
+static int finishOp(struct fluffyvm* vm, struct fluffyvm_call_state* callState, struct script_op* op) {
+  switch (op->type) {
+    case SCRIPT_OP_SEND:
+      push(vm, callState, value_new_bool(vm, op->status == CHANNEL_OK));
+      return 1;
+    case SCRIPT_OP_RECV:
+      return pushReceived(vm, callState, op->status == CHANNEL_OK, op->value, op->rootRef);
+    case SCRIPT_OP_SELECT:
+      break;
+  }
+
+  if (op->status != CHANNEL_OK) {
+    if (fluffyvm_is_errmsg_present(vm))
+      interpreter_error(vm, fluffyvm_get_errmsg(vm));
+    push(vm, callState, value_nil);
+    return 1;
+  }
+
+  push(vm, callState, value_new_long(vm, op->index + 1));
+  pushRooted(vm, callState, op->value, op->rootRef);
+  return 2;
+}
+
+static int runOp(struct fluffyvm* vm, struct fluffyvm_call_state* callState, script_op_type_t type, int count) {
+  struct scheduler* scheduler = callState->closure->udata;
+  struct fluffyvm_channel* stackChannels[8];
+  struct script_op op = {
+    .type = type,
+    .count = count,
+    .channels = stackChannels,
+    .sendValue = value_nil,
+    .index = -1,
+    .value = value_nil,
+    .rootRef = NULL
+  };
+
+  if (type == SCRIPT_OP_SEND)
+    op.sendValue = native_module_check_value(vm, callState, 1);
+
+  if (count > (int) (sizeof(stackChannels) / sizeof(stackChannels[0])) &&
+      !(op.channels = malloc(sizeof(*op.channels) * count)))
+    interpreter_error(vm, vm->staticStrings.outOfMemory);
+
+  for (int i = 0; i < count; i++) {
+    struct value val;
+    if (!interpreter_peek(vm, callState, i, &val) || !(op.channels[i] = channel_from_value(vm, val))) {
+      freeChannels(&op, stackChannels);
+      interpreter_error(vm, vm->staticStrings.expectChannel);
+    }
+  }
+
+  fluffyvm_clear_errmsg(vm);
+  if (tryOp(vm, &op))
+    goto done;
+
+  struct fluffyvm_coroutine* co = fluffyvm_get_executing_coroutine(vm);
+  if (!co || !coroutine_can_yield(co)) {
+    blockOp(vm, scheduler, &op);
+    goto done;
+  }
+
+  // Nothing can wake a coroutine which
+  // isnt scheduled
+  struct scheduler_task* task = scheduler ? scheduler_get_executing_task(scheduler) : NULL;
+  if (!task) {
+    freeChannels(&op, stackChannels);
+    return coroutine_yield_stackless_k(vm, 0, continueOp, (void*) (intptr_t) (count * 4 + type));
+  }
+
+  struct script_wait* wait = linkWait(vm, scheduler, task, &op);
+  if (!wait) {
+    freeChannels(&op, stackChannels);
+    interpreter_error(vm, vm->staticStrings.outOfMemory);
+  }
+  atomic_thread_fence(memory_order_seq_cst);
+
+  // Other side may did something before
+  // we were linked
+  if (tryOp(vm, &op)) {
+    unlinkWait(wait);
+    free(wait);
+    goto done;
+  }
+
+  freeChannels(&op, stackChannels);
+  return coroutine_yield_stackless_k(vm, 0, continueWait, wait);
+
+  done:
+  freeChannels(&op, stackChannels);
+  return finishOp(vm, callState, &op);
+}
+
+// Resumed by something else than the channel
+// (`udata` is count * 4 + type)
+static int continueOp(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  intptr_t packed = (intptr_t) udata;
+  return runOp(vm, callState, packed % 4, packed / 4);
+}
+
+// Woken by the channel (or spuriously)
+static int continueWait(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  struct script_wait* wait = udata;
+  script_op_type_t type = wait->type;
+  int count = wait->count;
+
+  unlinkWait(wait);
+  free(wait);
+  return runOp(vm, callState, type, count);
+}
+
+// send(channel, value), false if closed
+static int scriptSend(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  checkChannel(vm, callState, 0);
+  return runOp(vm, callState, SCRIPT_OP_SEND, 1);
+}
+
+// recv(channel), nil and false if closed
+static int scriptRecv(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  checkChannel(vm, callState, 0);
+  return runOp(vm, callState, SCRIPT_OP_RECV, 1);
+}
+
+// select(channel, ...), return index (start
+// from 1) and value or nil if all closed
+static int scriptSelect(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  int count = interpreter_get_top(vm, callState) + 1;
+  if (count <= 0)
+    interpreter_error(vm, vm->staticStrings.expectChannel);
+  return runOp(vm, callState, SCRIPT_OP_SELECT, count);
+}
+
+////////////////////////////////////////
+// Non blocking script functions      //
+////////////////////////////////////////
+
+// trysend(channel, value), false if full or closed
+static int scriptTrySend(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  struct fluffyvm_channel* channel = checkChannel(vm, callState, 0);
+  struct value val = native_module_check_value(vm, callState, 1);
+
+  push(vm, callState, value_new_bool(vm, channel_try_send(vm, channel, val) == CHANNEL_OK));
+  return 1;
+}
+
+// tryrecv(channel), nil and false if empty
+// or closed
+static int scriptTryRecv(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  struct fluffyvm_channel* channel = checkChannel(vm, callState, 0);
+
+  struct value val;
+  foxgc_root_reference_t* rootRef = NULL;
+  bool ok = channel_try_recv(vm, channel, &val, &rootRef) == CHANNEL_OK;
+  return pushReceived(vm, callState, ok, val, rootRef);
+}
+
+// close(channel)
+static int scriptClose(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  channel_close(checkChannel(vm, callState, 0));
+  return 0;
+}
+
+bool channel_install(struct fluffyvm* vm, struct scheduler* scheduler, struct value table) {
+  return native_module_add_function(vm, table, "channel", "new", scriptNew, scheduler) &&
+         native_module_add_function(vm, table, "channel", "send", scriptSend, scheduler) &&
+         native_module_add_function(vm, table, "channel", "trysend", scriptTrySend, scheduler) &&
+         native_module_add_function(vm, table, "channel", "recv", scriptRecv, scheduler) &&
+         native_module_add_function(vm, table, "channel", "tryrecv", scriptTryRecv, scheduler) &&
+         native_module_add_function(vm, table, "channel", "close", scriptClose, scheduler) &&
+         native_module_add_function(vm, table, "channel", "select", scriptSelect, scheduler);
+}
+
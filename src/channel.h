@@ -0,0 +1,107 @@
+#ifndef header_1655372960_channel_h
+#define header_1655372960_channel_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fluffyvm.h"
+#include "foxgc.h"
+#include "value.h"
+
+// Bounded MPMC channel for passing values
+// between coroutines and threads
+//
+// Fast path is lock free (Vyukov's bounded
+// MPMC queue), the lock only taken when
+// there someone to wake or to go to sleep
+//
+// Blocking operations called from script
+// suspend the coroutine (no fiber needed)
+// and only block the thread if it cant
+// yield. A coroutine which isnt scheduled
+// yields nothing to its resumer and tries
+// again when resumed, so with NULL scheduler
+// scheduled coroutines must not use them
+//
+// Called from C they suspend the coroutine
+// only if its on a fiber, else they block
+// the thread on a futex
+
+struct scheduler;
+struct channel_waiter;
+
+typedef enum {
+  CHANNEL_OK,
+  // Full for send or empty for receive
+  CHANNEL_WOULD_BLOCK,
+  CHANNEL_CLOSED
+} channel_status_t;
+
+struct channel_cell {
+  atomic_size_t sequence;
+  struct value value;
+};
+
+struct fluffyvm_channel {
+  size_t capacity;
+  struct channel_cell* cells;
+
+  // Padded so producers and consumers
+  // dont fight over same cache line
+  char pad0[64];
+  atomic_size_t enqueuePos;
+  char pad1[64];
+  atomic_size_t dequeuePos;
+  char pad2[64];
+
+  volatile atomic_bool closed;
+
+  pthread_mutex_t waitersLock;
+  atomic_int sendWaitersCount;
+  atomic_int recvWaitersCount;
+  struct channel_waiter* sendWaiters;
+  struct channel_waiter* recvWaiters;
+
+  foxgc_object_t* gc_this;
+
+  // Objects referenced by values in cells
+  foxgc_object_t* gc_values;
+};
+
+bool channel_init(struct fluffyvm* vm);
+void channel_cleanup(struct fluffyvm* vm);
+
+// Capacity rounded up to power of two
+struct fluffyvm_channel* channel_new(struct fluffyvm* vm, int capacity, foxgc_root_reference_t** rootRef);
+
+channel_status_t channel_try_send(struct fluffyvm* vm, struct fluffyvm_channel* this, struct value value);
+channel_status_t channel_try_recv(struct fluffyvm* vm, struct fluffyvm_channel* this, struct value* result, foxgc_root_reference_t** rootRef);
+
+// Block until done or channel closed. `scheduler`
+// is the one caller may be running in (can be NULL)
+// Never return CHANNEL_WOULD_BLOCK
+channel_status_t channel_send(struct fluffyvm* vm, struct fluffyvm_channel* this, struct scheduler* scheduler, struct value value);
+channel_status_t channel_recv(struct fluffyvm* vm, struct fluffyvm_channel* this, struct scheduler* scheduler, struct value* result, foxgc_root_reference_t** rootRef);
+
+// Receive from whichever channel has value first
+// Return its index or -1 if all are closed (or
+// on error, errmsg set)
+int channel_select(struct fluffyvm* vm, struct fluffyvm_channel** channels, int count, struct scheduler* scheduler, struct value* result, foxgc_root_reference_t** rootRef);
+
+// Wakes everyone waiting, remaining values
+// can still be received
+void channel_close(struct fluffyvm_channel* this);
+
+struct value channel_to_value(struct fluffyvm* vm, struct fluffyvm_channel* this, foxgc_root_reference_t** rootRef);
+
+// NULL if `value` is not a channel
+struct fluffyvm_channel* channel_from_value(struct fluffyvm* vm, struct value value);
+
+// Add `new`, `send`, `recv`, `trysend`, `tryrecv`,
+// `close` and `select` to `table` for scripts
+bool channel_install(struct fluffyvm* vm, struct scheduler* scheduler, struct value table);
+
+#endif
+
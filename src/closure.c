@@ -63,6 +63,7 @@ static struct fluffyvm_closure* closure_new_common(struct fluffyvm* vm, foxgc_ro
   this->func = NULL;
   this->finalizer = NULL;
   this->luaCFunction = NULL;
+  this->needFiber = false;
   this->asValue = value_new_closure(vm, this);
 
   this->env = env;
@@ -96,12 +97,17 @@ struct fluffyvm_closure* closure_from_cfunction(struct fluffyvm* vm, foxgc_root_
   this->udata= udata;
   this->finalizer = finalizer;
   this->isNative = true;
+  this->needFiber = false;
   foxgc_api_write_field(this->gc_this, CLOSURE_OFFSET_PROTOTYPE, NULL);
   return this;
 }
 
+void closure_set_need_fiber(struct fluffyvm_closure* this, bool needFiber) {
+  this->needFiber = needFiber;
+}
 
-
-
-
+void closure_set_env(struct fluffyvm* vm, struct fluffyvm_closure* this, struct value env) {
+  this->env = env;
+  foxgc_api_write_field(this->gc_this, CLOSURE_OFFSET_ENV, value_get_object_ptr(env));
+}
 
@@ -26,6 +26,12 @@ struct fluffyvm_closure {
   void* udata;
   closure_udata_finalizer_t finalizer;
   bool isNative;
+  
+  // Native function which may yield
+  // across its own C frames so it has 
+  // to be run on a fiber (default false,
+  // see `closure_set_need_fiber`)
+  bool needFiber;
 
   // _ENV table
   struct value env;
@@ -44,5 +50,14 @@ void closure_cleanup(struct fluffyvm* vm);
 struct fluffyvm_closure* closure_new(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, struct fluffyvm_prototype* prototype, struct value env);
 struct fluffyvm_closure* closure_from_cfunction(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, closure_cfunction_t func, void* udata, closure_udata_finalizer_t finalizer, struct value env);
 
+void closure_set_env(struct fluffyvm* vm, struct fluffyvm_closure* this, struct value env);
+
+// Only for natives which yield through their
+// own C frames (`coroutine_yield` or fiber
+// based blocking calls), others only yield
+// with `return coroutine_yield_stackless(...)`
+// and dont pay for a fiber
+void closure_set_need_fiber(struct fluffyvm_closure* this, bool needFiber);
+
 #endif
 
@@ -1,90 +1,205 @@
-#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <assert.h>
-#include <stdio.h>
 
-#include "list.h"
+#include "../util/futex.h"
 #include "queue.h"
 
-struct queue* queue_new(int size) {
+static struct queue* newQueue(int size, queue_type_t type) {
   struct queue* this = malloc(sizeof(*this));
-  pthread_mutex_init(&this->lock, NULL);
-  pthread_cond_init(&this->readySignal, NULL);
-  pthread_cond_init(&this->taskArriveSignal, NULL);
-  
-  this->queue = list_new();
-  this->itemsInQueue = 0;
-  this->queueSize = size;
+  if (!this)
+    return NULL;
+
+  size_t ringSize = 2;
+  while (ringSize < (size_t) size)
+    ringSize <<= 1;
+
+  this->cells = malloc(sizeof(*this->cells) * ringSize);
+  if (!this->cells) {
+    free(this);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < ringSize; i++) {
+    atomic_init(&this->cells[i].sequence, i);
+    this->cells[i].data = NULL;
+  }
+
+  this->type = type;
+  this->size = ringSize;
+  atomic_init(&this->enqueuePos, 0);
+  atomic_init(&this->dequeuePos, 0);
+  atomic_init(&this->itemArrivedFutex, 0);
+  atomic_init(&this->spaceFreedFutex, 0);
   return this;
 }
 
+struct queue* queue_new(int size) {
+  return newQueue(size, QUEUE_MPMC);
+}
+
+struct queue* queue_new_spsc(int size) {
+  return newQueue(size, QUEUE_SPSC);
+}
+
 void queue_destroy(struct queue* this) {
-  list_destroy(this->queue);
-  pthread_cond_destroy(&this->readySignal);
-  pthread_cond_destroy(&this->taskArriveSignal);
-  pthread_mutex_destroy(&this->lock);
+  free(this->cells);
   free(this);
 }
 
-void queue_enqueue(struct queue* this, void* data) {
-  pthread_mutex_lock(&this->lock);
-  if (this->itemsInQueue >= this->queueSize) 
-    pthread_cond_wait(&this->readySignal, &this->lock);
-  
-  list_rpush(this->queue, list_node_new(data));
-  this->itemsInQueue++;
-  
-  pthread_mutex_unlock(&this->lock);
-  pthread_cond_signal(&this->taskArriveSignal);
+static bool mpmcEnqueue(struct queue* this, void* data) {
+  size_t mask = this->size - 1;
+  size_t pos = atomic_load_explicit(&this->enqueuePos, memory_order_relaxed);
+  struct queue_cell* cell;
+  while (true) {
+    cell = &this->cells[pos & mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&this->enqueuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&this->enqueuePos, memory_order_relaxed);
+    }
+  }
+
+  cell->data = data;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+  return true;
 }
 
-bool queue_enqueue_nonblocking(struct queue* this, void* data) {
-  pthread_mutex_lock(&this->lock);
-  if (this->itemsInQueue >= this->queueSize) {
-    pthread_mutex_unlock(&this->lock);
-    return false;
+static bool mpmcRemove(struct queue* this, void** data) {
+  size_t mask = this->size - 1;
+  size_t pos = atomic_load_explicit(&this->dequeuePos, memory_order_relaxed);
+  struct queue_cell* cell;
+  while (true) {
+    cell = &this->cells[pos & mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&this->dequeuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&this->dequeuePos, memory_order_relaxed);
+    }
   }
-  
-  list_rpush(this->queue, list_node_new(data));
-  this->itemsInQueue++;
-  
-  pthread_mutex_unlock(&this->lock);
-  pthread_cond_signal(&this->taskArriveSignal);
+
+  *data = cell->data;
+  atomic_store_explicit(&cell->sequence, pos + mask + 1, memory_order_release);
   return true;
 }
 
-void queue_remove(struct queue* this, void** data) {
-  pthread_mutex_lock(&this->lock);
-  
-  if (this->itemsInQueue <= 0) 
-    pthread_cond_wait(&this->taskArriveSignal, &this->lock);
-  
-  list_node_t* node = list_at(this->queue, 0);
-  this->itemsInQueue--;
-  *data = node->val;
-  list_remove(this->queue, node); 
-  
-  pthread_mutex_unlock(&this->lock);
-  pthread_cond_signal(&this->readySignal);
+// Lamport's ring, each index only
+// written by one side
+static bool spscEnqueue(struct queue* this, void* data) {
+  size_t pos = atomic_load_explicit(&this->enqueuePos, memory_order_relaxed);
+  size_t dequeuePos = atomic_load_explicit(&this->dequeuePos, memory_order_acquire);
+  if (pos - dequeuePos >= this->size)
+    return false;
+
+  this->cells[pos & (this->size - 1)].data = data;
+  atomic_store_explicit(&this->enqueuePos, pos + 1, memory_order_release);
+  return true;
 }
 
-bool queue_remove_nonblocking(struct queue* this, void** data) {
-  pthread_mutex_lock(&this->lock);
-  
-  if (this->itemsInQueue <= 0) {
-    pthread_mutex_unlock(&this->lock);
+static bool spscRemove(struct queue* this, void** data) {
+  size_t pos = atomic_load_explicit(&this->dequeuePos, memory_order_relaxed);
+  size_t enqueuePos = atomic_load_explicit(&this->enqueuePos, memory_order_acquire);
+  if (pos == enqueuePos)
     return false;
-  }
-  
-  list_node_t* node = list_at(this->queue, 0);
-  this->itemsInQueue--;
-  *data = node->val;
-  list_remove(this->queue, node); 
-  
-  pthread_mutex_unlock(&this->lock);
-  pthread_cond_signal(&this->readySignal);
-  
+
+  *data = this->cells[pos & (this->size - 1)].data;
+  atomic_store_explicit(&this->dequeuePos, pos + 1, memory_order_release);
   return true;
 }
 
+static void wakeIfWaiting(atomic_uint* futex) {
+  // Pairs with store in `waitFor`, either
+  // we see the sleeper or it see our change
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(futex, memory_order_relaxed) == 0)
+    return;
 
+  // Wake all because they all cleared
+  // together, the losers sleep again
+  if (atomic_exchange(futex, 0) == 1)
+    futex_wake(futex, INT_MAX);
+}
+
+bool queue_enqueue_nonblocking(struct queue* this, void* data) {
+  bool res = this->type == QUEUE_SPSC ? spscEnqueue(this, data) : mpmcEnqueue(this, data);
+  if (res)
+    wakeIfWaiting(&this->itemArrivedFutex);
+  return res;
+}
+
+bool queue_remove_nonblocking(struct queue* this, void** data) {
+  bool res = this->type == QUEUE_SPSC ? spscRemove(this, data) : mpmcRemove(this, data);
+  if (res)
+    wakeIfWaiting(&this->spaceFreedFutex);
+  return res;
+}
+
+// Return false if `deadline` passed
+static bool remainingTime(struct timespec* deadline, struct timespec* remaining) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  remaining->tv_sec = deadline->tv_sec - now.tv_sec;
+  remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+  if (remaining->tv_nsec < 0) {
+    remaining->tv_sec--;
+    remaining->tv_nsec += 1000000000;
+  }
+  return remaining->tv_sec >= 0;
+}
+
+static bool tryOperation(struct queue* this, bool isEnqueue, void** data) {
+  if (isEnqueue)
+    return queue_enqueue_nonblocking(this, *data);
+  return queue_remove_nonblocking(this, data);
+}
+
+// Retry the operation sleeping on futex
+// between attempts, `deadline` can be NULL
+static bool waitFor(struct queue* this, bool isEnqueue, void** data, struct timespec* deadline) {
+  atomic_uint* futex = isEnqueue ? &this->spaceFreedFutex : &this->itemArrivedFutex;
+
+  while (true) {
+    if (tryOperation(this, isEnqueue, data))
+      return true;
+
+    // Announce before recheck, so anyone
+    // changing the queue after it wakes us
+    atomic_store(futex, 1);
+    if (tryOperation(this, isEnqueue, data))
+      return true;
+
+    struct timespec remaining;
+    if (deadline && !remainingTime(deadline, &remaining))
+      return false;
+    futex_wait(futex, 1, deadline ? &remaining : NULL);
+  }
+}
+
+bool queue_timed_enqueue(struct queue* this, void* data, struct timespec* timeout) {
+  return waitFor(this, true, &data, timeout);
+}
+
+bool queue_timed_remove(struct queue* this, void** data, struct timespec* timeout) {
+  return waitFor(this, false, data, timeout);
+}
+
+void queue_enqueue(struct queue* this, void* data) {
+  waitFor(this, true, &data, NULL);
+}
+
+void queue_remove(struct queue* this, void** data) {
+  waitFor(this, false, data, NULL);
+}
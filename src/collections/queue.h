@@ -1,26 +1,53 @@
 #ifndef _headers_1643029318_FGGC_v2_queue
 #define _headers_1643029318_FGGC_v2_queue
 
-#include <bits/types/struct_timespec.h>
-#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
-#include "list.h"
+// Bounded ring buffer queue
+//
+// `queue_new` create Vyukov's MPMC queue
+// and `queue_new_spsc` create a faster one
+// for exactly one producer and one consumer
+// thread. Both are lock free and only sleep
+// (on a futex) when full or empty
+//
+// Size is rounded up to power of two
+
+typedef enum {
+  QUEUE_MPMC,
+  QUEUE_SPSC
+} queue_type_t;
+
+struct queue_cell {
+  // Unused for SPSC
+  atomic_size_t sequence;
+  void* data;
+};
 
 typedef struct queue {
-  pthread_mutex_t lock;
-  pthread_cond_t readySignal;
-  pthread_cond_t taskArriveSignal;
-  
-  // Size of the queue
-  int queueSize;
-  int itemsInQueue;
-  
-  // void*
-  list_t* queue;
+  queue_type_t type;
+  size_t size;
+  struct queue_cell* cells;
+
+  // Padded so producers and consumers
+  // dont fight over same cache line
+  char pad0[64];
+  atomic_size_t enqueuePos;
+  char pad1[64];
+  atomic_size_t dequeuePos;
+  char pad2[64];
+
+  // 1 if someone sleeping on it, the waker
+  // reset it so only one syscall per sleep
+  atomic_uint itemArrivedFutex;
+  atomic_uint spaceFreedFutex;
 } queue_t;
 
-struct queue* queue_new(int size); 
+struct queue* queue_new(int size);
+struct queue* queue_new_spsc(int size);
 void queue_destroy(struct queue* queue);
 
 void queue_enqueue(struct queue* queue, void* data);
@@ -29,6 +56,9 @@ void queue_remove(struct queue* queue, void** data);
 bool queue_enqueue_nonblocking(struct queue* queue, void* data);
 bool queue_remove_nonblocking(struct queue* this, void** data);
 
+// `timeout` is absolute CLOCK_REALTIME time
+// (like `pthread_cond_timedwait`)
+// Return false if timed out
 bool queue_timed_enqueue(struct queue* queue, void* data, struct timespec* timeout);
 bool queue_timed_remove(struct queue* queue, void** data, struct timespec* timeout);
 
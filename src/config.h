@@ -25,6 +25,48 @@
 // entry queue
 #define FLUFFYVM_STRING_CACHE_QUEUE_SIZE 512
 
+// Usable size of fiber's stack (the C stack
+// for coroutines). Its only reserved address
+// space, pages committed lazily by the kernel
+#define FLUFFYVM_FIBER_STACK_SIZE (1024 * 1024)
+
+// Number of guard pages below fiber's stack
+#define FLUFFYVM_FIBER_STACK_GUARD_PAGES (1)
+
+// Maximum number of unused fiber stacks
+// cached for each thread
+#define FLUFFYVM_FIBER_STACK_POOL_SIZE (64)
+
+// Maximum number of dead coroutines kept
+// for reuse for each thread
+#define FLUFFYVM_COROUTINE_POOL_SIZE (128)
+
+// Capacity of channels created by scripts
+// when not specified
+#define FLUFFYVM_CHANNEL_DEFAULT_CAPACITY (64)
+
+// Approximate number of instructions scheduled
+// coroutine can run before it put back to the
+// queue so others get a turn (0 to disable)
+#define FLUFFYVM_SCHEDULER_INSTRUCTION_BUDGET (10000)
+
+// Every this many picks scheduler's worker
+// look for the lowest priority class first
+#define FLUFFYVM_SCHEDULER_STARVATION_INTERVAL (8)
+
+// Number of threads in VM's thread pool
+// 0 for number of online CPUs
+#define FLUFFYVM_THREAD_POOL_SIZE (0)
+
+// Jobs waiting in the thread pool before
+// `fluffyvm_submit` blocks (or fails if
+// called from pool's thread)
+#define FLUFFYVM_THREAD_POOL_QUEUE_SIZE (1024)
+
+// Where `bytecode_cache_load` keep the
+// loaded bytecode as images by default
+#define FLUFFYVM_BYTECODE_CACHE_DIR "./.fluffyvm-cache"
+
 ////////////////////////////////////////
 // Compiler config                    //
 ////////////////////////////////////////
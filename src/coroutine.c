@@ -19,6 +19,7 @@
 #include "config.h"
 #include "interpreter.h"
 #include "stack.h"
+#include "util/cycles.h"
 #include "util/util.h"
 #include "value.h"
 
@@ -122,6 +123,8 @@ struct fluffyvm_call_state* coroutine_function_prolog(struct fluffyvm* vm, struc
   pthread_mutex_unlock(&co->callStackLock);
 
   callState->sp = 0;
+  callState->pc = 0;
+  callState->expectedRetCount = -1;
   foxgc_api_write_field(obj, 0, obj);
   foxgc_api_write_field(obj, 2, func->gc_this);
   foxgc_api_write_field(obj, 3, co->gc_this);
@@ -183,7 +186,102 @@ struct fluffyvm_call_state* coroutine_function_prolog(struct fluffyvm* vm, struc
   return NULL;
 }
 
-struct fluffyvm_coroutine* coroutine_new(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, struct fluffyvm_closure* func) {
+struct coroutine_pool_entry {
+  struct fluffyvm_coroutine* co;
+  foxgc_root_reference_t* rootRef;
+};
+
+struct coroutine_pool {
+  struct coroutine_pool_stats stats;
+  struct coroutine_pool_entry entries[FLUFFYVM_COROUTINE_POOL_SIZE];
+};
+
+// Approximate memory kept alive by
+// pooled coroutine
+static const size_t pooledCoroutineSize = 
+  sizeof(struct fluffyvm_coroutine) + 
+  sizeof(struct fluffyvm_stack) + 
+  sizeof(foxgc_object_t*) * FLUFFYVM_CALL_STACK_SIZE;
+
+static struct coroutine_pool* getPool(struct fluffyvm* vm) {
+  struct coroutine_pool* pool = pthread_getspecific(vm->coroutinePoolKey);
+  if (pool)
+    return pool;
+
+  pool = malloc(sizeof(*pool));
+  if (!pool)
+    return NULL;
+  memset(&pool->stats, 0, sizeof(pool->stats));
+  pthread_setspecific(vm->coroutinePoolKey, pool);
+  return pool;
+}
+
+void coroutine_thread_cleanup(struct fluffyvm* vm) {
+  struct coroutine_pool* pool = pthread_getspecific(vm->coroutinePoolKey);
+  if (!pool)
+    return;
+
+  for (int i = 0; i < pool->stats.count; i++)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), pool->entries[i].rootRef);
+  free(pool);
+  pthread_setspecific(vm->coroutinePoolKey, NULL);
+}
+
+void coroutine_get_pool_stats(struct fluffyvm* vm, struct coroutine_pool_stats* stats) {
+  struct coroutine_pool* pool = pthread_getspecific(vm->coroutinePoolKey);
+  if (!pool) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  *stats = pool->stats;
+}
+
+bool coroutine_recycle(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
+  if (co->state != COROUTINE_DEAD || co->isNativeThread || co->isExposed || co->fiber)
+    return false;
+
+  struct coroutine_pool* pool = getPool(vm);
+  if (!pool || pool->stats.count >= FLUFFYVM_COROUTINE_POOL_SIZE)
+    return false;
+  
+  // Remove frames left by error
+  pthread_mutex_lock(&co->callStackLock);
+  while (co->callStack->sp > 0)
+    internal_function_epilog(vm, co);
+  pthread_mutex_unlock(&co->callStackLock);
+  co->currentCallState = NULL;
+  
+  co->hasError = false;
+  co->thrownedError = value_nil;
+  foxgc_api_write_field(co->gc_this, 2, NULL);
+
+  struct coroutine_pool_entry* entry = &pool->entries[pool->stats.count];
+  entry->co = co;
+  foxgc_api_root_add(vm->heap, co->gc_this, fluffyvm_get_root(vm), &entry->rootRef);
+  
+  pool->stats.count++;
+  pool->stats.bytes += pooledCoroutineSize;
+  pool->stats.recycled++;
+  return true;
+}
+
+static struct fluffyvm_coroutine* takeFromPool(struct fluffyvm* vm, foxgc_root_reference_t** rootRef) {
+  struct coroutine_pool* pool = pthread_getspecific(vm->coroutinePoolKey);
+  if (!pool || pool->stats.count == 0)
+    return NULL;
+
+  pool->stats.count--;
+  pool->stats.bytes -= pooledCoroutineSize;
+  pool->stats.reused++;
+
+  // Its rooted in current thread's root
+  // so just give the reference to caller
+  struct coroutine_pool_entry* entry = &pool->entries[pool->stats.count];
+  *rootRef = entry->rootRef;
+  return entry->co;
+}
+
+static struct fluffyvm_coroutine* allocCoroutine(struct fluffyvm* vm, foxgc_root_reference_t** rootRef) {
   foxgc_object_t* obj = foxgc_api_new_object(vm->heap, NULL, fluffyvm_get_root(vm), rootRef, vm->coroutineStaticData->desc_coroutine, ^void (foxgc_object_t* obj) {
     struct fluffyvm_coroutine* this = foxgc_api_object_get_data(obj);
     // I have no clue how this->fiber be null
@@ -197,16 +295,29 @@ struct fluffyvm_coroutine* coroutine_new(struct fluffyvm* vm, foxgc_root_referen
     return NULL;
   }
   struct fluffyvm_coroutine* this = foxgc_api_object_get_data(obj);
+  this->fiber = NULL;
   foxgc_api_write_field(obj, 0, obj);
   pthread_mutex_init(&this->callStackLock, NULL);
 
   foxgc_root_reference_t* stackRootRef = NULL;
   this->callStack = stack_new(vm, &stackRootRef, FLUFFYVM_CALL_STACK_SIZE);
   this->owner = vm;
-  if (!this->callStack)
-    goto error;
+  if (!this->callStack) {
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
+    *rootRef = NULL;
+    return NULL;
+  }
   foxgc_api_write_field(obj, 1, this->callStack->gc_this);
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), stackRootRef);
+  return this;
+}
+
+struct fluffyvm_coroutine* coroutine_new(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, struct fluffyvm_closure* func) {
+  struct fluffyvm_coroutine* this = takeFromPool(vm, rootRef);
+  if (!this)
+    this = allocCoroutine(vm, rootRef);
+  if (!this)
+    return NULL;
 
   fluffyvm_push_current_coroutine(vm, this);
   if (!coroutine_function_prolog(vm, func)) {
@@ -217,72 +328,80 @@ struct fluffyvm_coroutine* coroutine_new(struct fluffyvm* vm, foxgc_root_referen
 
   this->isYieldable = true;
   this->isNativeThread = false;
+  this->isExposed = false;
   this->hasError = false;
   this->errorHandler = NULL;
-  this->fiber = fiber_new(Block_copy(^void () {
-    jmp_buf buf;
-    if (setjmp(buf)) {
-      struct value errMsg = fluffyvm_get_errmsg(vm);
-      this->thrownedError = errMsg;
-      foxgc_api_write_field(this->gc_this, 1, value_get_object_ptr(errMsg));
-      this->hasError = true;
-  
-      this->errorHandler = NULL;
-      return;
-    }
-  
-    this->errorHandler = &buf;
-    interpreter_exec(vm, this);
-    coroutine_function_epilog(vm); 
-    this->errorHandler = NULL;
-  }));
+  this->state = COROUTINE_SUSPENDED;
+  this->started = false;
+  this->nativeDepth = 0;
+  this->nativeHasError = false;
+  this->nativeRetCount = 0;
+  this->yieldPending = false;
+  this->continuation = NULL;
+  this->continuationData = NULL;
+  this->transferCount = 0;
+  this->instructionBudget = 0;
+  this->budgetRemaining = 0;
+  this->preempted = false;
+  this->deadline = 0;
 
   return this;
  
   error:
-  /*
-  struct fluffyvm_coroutine* callState = NULL;
-  stack_peek(vm, this->callStack, (void**) &callState);
-  
-  // UvU
-  if (callState == this) 
-    coroutine_function_epilog(vm, this);
-  */
-
   foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
   *rootRef = NULL;
   return NULL;
 }
 
 bool coroutine_resume(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
-  if (!fluffyvm_push_current_coroutine(vm, co)) 
-    return false;
-  
-  fiber_state_t prevState;
-  bool res = fiber_resume(co->fiber, &prevState);
-  
-  if (!res) {
+  coroutine_state_t prevState = COROUTINE_SUSPENDED;
+  if (!atomic_compare_exchange_strong(&co->state, (int*) &prevState, COROUTINE_RUNNING)) {
     switch (prevState) {
-      case FIBER_RUNNING: 
+      case COROUTINE_RUNNING: 
         fluffyvm_set_errmsg(vm, vm->staticStrings.cannotResumeRunningCoroutine);
         break;
-      case FIBER_DEAD: 
+      case COROUTINE_DEAD: 
         fluffyvm_set_errmsg(vm, vm->staticStrings.cannotResumeDeadCoroutine);
         break;
-      case FIBER_SUSPENDED:
+      case COROUTINE_SUSPENDED:
         abort();
     }
-
-    fluffyvm_pop_current_coroutine(vm);
     return false;
   }
-
+  
+  if (!fluffyvm_push_current_coroutine(vm, co)) {
+    co->state = COROUTINE_SUSPENDED;
+    return false;
+  }
+  
+  // The coroutine runs on our C stack
+  // so error handler is here too
+  jmp_buf buf;
+  if (setjmp(buf)) {
+    struct value errMsg = fluffyvm_get_errmsg(vm);
+    co->thrownedError = errMsg;
+    foxgc_api_write_field(co->gc_this, 2, value_get_object_ptr(errMsg));
+    co->hasError = true;
+    co->state = COROUTINE_DEAD;
+    goto done;
+  }
+  
+  co->errorHandler = &buf;
+  if (interpreter_resume(vm, co) == FLUFFYVM_INTERPRETER_YIELDED) {
+    co->yieldPending = false;
+    co->state = COROUTINE_SUSPENDED;
+  } else {
+    coroutine_function_epilog(vm); 
+    co->state = COROUTINE_DEAD;
+  }
+  
+  done:
+  co->errorHandler = NULL;
   fluffyvm_pop_current_coroutine(vm);
   return !co->hasError;
 }
 
-bool coroutine_yield(struct fluffyvm* vm) {
-  struct fluffyvm_coroutine* co = fluffyvm_get_executing_coroutine(vm);
+static bool checkCanYield(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
   if (!co) {
     fluffyvm_set_errmsg(vm, vm->staticStrings.notInCoroutine);
     return false;
@@ -297,8 +416,54 @@ bool coroutine_yield(struct fluffyvm* vm) {
     fluffyvm_set_errmsg(vm, vm->staticStrings.nativeFunctionExplicitlyDisabledYieldingForThisCoroutine);
     return false;
   }
+  return true;
+}
 
-  return fiber_yield(co->fiber);
+bool coroutine_yield(struct fluffyvm* vm) {
+  struct fluffyvm_coroutine* co = fluffyvm_get_executing_coroutine(vm);
+  if (!checkCanYield(vm, co))
+    return false;
+  
+  if (!co->fiber) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.attemptToYieldAcrossCCallBoundary);
+    return false;
+  }
+  
+  // Error handler is stack allocated on the 
+  // fiber so restore it when resumed
+  jmp_buf* errorHandler = co->errorHandler;
+  bool res = fiber_yield(co->fiber);
+  co->errorHandler = errorHandler;
+  return res;
+}
+
+int coroutine_yield_stackless(struct fluffyvm* vm, int nresults) {
+  return coroutine_yield_stackless_k(vm, nresults, NULL, NULL);
+}
+
+int coroutine_yield_stackless_k(struct fluffyvm* vm, int nresults, closure_cfunction_t k, void* kdata) {
+  struct fluffyvm_coroutine* co = fluffyvm_get_executing_coroutine(vm);
+  if (!checkCanYield(vm, co))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  
+  co->transferCount = nresults;
+  if (co->fiber) {
+    if (!coroutine_yield(vm))
+      interpreter_error(vm, fluffyvm_get_errmsg(vm));
+    if (k)
+      return k(vm, co->currentCallState, kdata);
+    return co->currentCallState->sp;
+  }
+  
+  // Only possible if there no other native
+  // function under the caller
+  if (co->nativeDepth != 1)
+    interpreter_error(vm, vm->staticStrings.attemptToYieldAcrossCCallBoundary);
+  
+  co->yieldPending = true;
+  co->continuation = k;
+  co->continuationData = kdata;
+  return nresults;
 }
 
 void coroutine_disallow_yield(struct fluffyvm* vm) {
@@ -310,7 +475,29 @@ void coroutine_disallow_yield(struct fluffyvm* vm) {
 }
 
 bool coroutine_can_yield(struct fluffyvm_coroutine* co) {
-  return co->isYieldable && !co->isNativeThread;
+  if (!co->isYieldable || co->isNativeThread)
+    return false;
+  return co->fiber || co->nativeDepth <= 1;
+}
+
+void coroutine_set_instruction_budget(struct fluffyvm_coroutine* co, int budget) {
+  co->instructionBudget = budget > 0 ? budget : 0;
+  co->budgetRemaining = co->instructionBudget;
+}
+
+bool coroutine_was_preempted(struct fluffyvm_coroutine* co) {
+  return co->preempted;
+}
+
+void coroutine_set_deadline(struct fluffyvm_coroutine* co, uint64_t milisecs) {
+  if (milisecs == 0) {
+    co->deadline = 0;
+    return;
+  }
+
+  uint64_t ticks = cycles_from_ns(milisecs * 1000000);
+  uint64_t now = cycles_now();
+  co->deadline = ticks > UINT64_MAX - now ? UINT64_MAX : now + ticks;
 }
 
 void coroutine_allow_yield(struct fluffyvm* vm) {
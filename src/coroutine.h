@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <setjmp.h>
+#include <stdint.h>
 
 #include "api_layer/types.h"
 #include "closure.h"
@@ -14,6 +15,7 @@
 #include "stack.h"
 #include "config.h"
 #include "fiber.h"
+#include "util/cycles.h"
 
 // Currently executing function
 struct fluffyvm_call_state {
@@ -29,6 +31,10 @@ struct fluffyvm_call_state {
   int pc;
   int sp;
 
+  // Number of values the caller expect
+  // when this function returns (-1 for all)
+  int expectedRetCount;
+
   struct {
     const char* source;
     const char* funcName;
@@ -45,13 +51,69 @@ struct fluffyvm_call_state {
   foxgc_object_t* gc_registerArray;
 };
 
+typedef enum {
+  COROUTINE_RUNNING,
+  COROUTINE_SUSPENDED,
+  COROUTINE_DEAD
+} coroutine_state_t;
+
 struct fluffyvm_coroutine {
   struct fluffyvm* owner;
   
   bool isNativeThread;
   bool isYieldable;
 
+  // Made into a value after creation (by
+  // `value_new_coroutine2`) so something
+  // else may still reference it
+  bool isExposed;
+  
+  volatile atomic_int state;
+  bool started;
+
+  // Coroutines are stackless (frames only 
+  // live in `callStack`) and this only non 
+  // NULL while a native function which may
+  // yield through its own C frames is 
+  // running (see `closure->needFiber`)
   struct fiber* fiber;
+  int nativeRetCount;
+  bool nativeHasError;
+
+  // Number of native frames currently
+  // on the C stack for this coroutine
+  int nativeDepth;
+  
+  // Set by `coroutine_yield_stackless`
+  bool yieldPending;
+
+  // Called in place of the suspended native
+  // function when resumed, NULL if none (see
+  // `coroutine_yield_stackless_k`)
+  closure_cfunction_t continuation;
+  void* continuationData;
+
+  // Number of values passed by the resumer
+  // and after it suspend number of values it
+  // yielded (`coroutine_yield_stackless`) so
+  // no need to push the count as value
+  int transferCount;
+
+  // Approximate number of instructions the
+  // coroutine may run before it forced to
+  // yield (0 to never preempt). Only charged
+  // at backward jumps and calls
+  int instructionBudget;
+  int budgetRemaining;
+
+  // Last suspend was forced by running out
+  // of `instructionBudget`
+  bool preempted;
+
+  // In `cycles_now` ticks, 0 if none. Checked
+  // at same places as instruction budget
+  uint64_t deadline;
+
   struct fluffyvm_call_state* currentCallState;
   jmp_buf* errorHandler;
 
@@ -84,11 +146,62 @@ struct fluffyvm_call_frame {
 bool coroutine_init(struct fluffyvm* vm);
 void coroutine_cleanup(struct fluffyvm* vm);
 
+// Reuse coroutine from current thread's pool
+// if there any
 struct fluffyvm_coroutine* coroutine_new(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, struct fluffyvm_closure* func);
 
+// Put dead coroutine into current thread's pool
+// for `coroutine_new` to reuse. Only call this 
+// if nothing else can reference `co` anymore
+// (the scheduler does for finished tasks)
+//
+// Return false if `co` not dead, was exposed
+// as value or the pool is full (`co` left
+// untouched)
+bool coroutine_recycle(struct fluffyvm* vm, struct fluffyvm_coroutine* co);
+
+struct coroutine_pool_stats {
+  // Coroutines currently in the pool
+  int count;
+  // Approximate memory held by pool
+  size_t bytes;
+  
+  uint64_t recycled;
+  uint64_t reused;
+};
+
+// Stats of current thread's pool
+void coroutine_get_pool_stats(struct fluffyvm* vm, struct coroutine_pool_stats* stats);
+
+// Called when managed thread exiting
+void coroutine_thread_cleanup(struct fluffyvm* vm);
+
+// Yield from anywhere in a native function
+// but only possible if the native function
+// is running on a fiber
 bool coroutine_yield(struct fluffyvm* vm);
 bool coroutine_resume(struct fluffyvm* vm, struct fluffyvm_coroutine* coroutine);
 
+// Must be used as `return coroutine_yield_stackless(vm, n)`
+// in native function. When the native function
+// directly called by bytecode it suspend without
+// needing any C stack, falls back to fiber yield 
+// if possible else error is thrown (attempt to 
+// yield across C-call boundary)
+//
+// When resumed, values on the native function's 
+// stack become its return values
+int coroutine_yield_stackless(struct fluffyvm* vm, int nresults);
+
+// Same as `coroutine_yield_stackless` but when
+// resumed `k` is called as if it were the
+// native function and its result is used (like
+// Lua's lua_yieldk). For natives which need to
+// do something after resumed. Arguments are
+// still on the stack for `k`, values passed by
+// the resumer are on top of them
+int coroutine_yield_stackless_k(struct fluffyvm* vm, int nresults, closure_cfunction_t k, void* kdata);
+
 struct fluffyvm_call_state* coroutine_function_prolog(struct fluffyvm* vm, struct fluffyvm_closure* func);
 void coroutine_function_epilog(struct fluffyvm* vm);
 void coroutine_function_epilog_no_lock(struct fluffyvm* vm);
@@ -97,6 +210,28 @@ void coroutine_disallow_yield(struct fluffyvm* vm);
 void coroutine_allow_yield(struct fluffyvm* vm);
 bool coroutine_can_yield(struct fluffyvm_coroutine* co);
 
+// When budget runs out the coroutine suspend
+// as if it yielded nothing, only allowed where
+// normal yield is (no native frames under it)
+// Resumer should check `coroutine_was_preempted`
+// and resume it again later. Disabled by default
+// because script's resumer cant tell the difference
+void coroutine_set_instruction_budget(struct fluffyvm_coroutine* co, int budget);
+bool coroutine_was_preempted(struct fluffyvm_coroutine* co);
+
+// Raise "deadline exceeded" error in the coroutine
+// at its next backward jump or call once `milisecs`
+// passed (0 to remove). Catching the error dont
+// help as it raised again at every check after
+// until the deadline removed
+void coroutine_set_deadline(struct fluffyvm_coroutine* co, uint64_t milisecs);
+
+// Inline as interpreter checks it on
+// every backward jump and call
+static inline bool coroutine_deadline_passed(struct fluffyvm_coroutine* co) {
+  return co->deadline != 0 && cycles_now() >= co->deadline;
+}
+
 // Iterates the call stack
 // Note: Do not store pointer of the call frame
 //       it is stack allocated
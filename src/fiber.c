@@ -3,7 +3,6 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdlib.h>
-#include <ucontext.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -13,34 +12,39 @@
 #endif
 
 #include "fiber.h"
+#include "fiber_stack.h"
+#include "fiber_context.h"
 
-// VERY CRONGED
-// SIGSTKSZ IS UNDEFINED
-#define SIGSTKSZ (1024 * 1024 * 8)
-
-static inline void sanitizer_start_switch_fiber(void* bottom, size_t size) {
+// `fakeStackSave` NULL means the current
+// stack is dying and ASan can free its
+// fake stack
+static inline void sanitizer_start_switch_fiber(void** fakeStackSave, const void* bottom, size_t size) {
 # ifdef FLUFFYVM_ASAN_ENABLED
-  __sanitizer_start_switch_fiber(NULL, bottom, size);
+  __sanitizer_start_switch_fiber(fakeStackSave, bottom, size);
 # endif
 }
 
-static inline void sanitizer_finish_switch_fiber() {
+static inline void sanitizer_finish_switch_fiber(void* fakeStack, const void** prevBottom, size_t* prevSize) {
 # ifdef FLUFFYVM_ASAN_ENABLED
-   __sanitizer_finish_switch_fiber(NULL, NULL, NULL);
+   __sanitizer_finish_switch_fiber(fakeStack, prevBottom, prevSize);
 # endif
 }
 
-static void entryPoint(struct fiber* fiber, runnable_t task) {
-  sanitizer_finish_switch_fiber();
+static void entryPoint(void* _fiber) {
+  struct fiber* fiber = _fiber;
+  
+  // Remember resumer's stack so we can
+  // tell ASan when switching back
+  sanitizer_finish_switch_fiber(NULL, &fiber->callerStackBottom, &fiber->callerStackSize);
   
+  runnable_t task = fiber->task;
   task();
   Block_release(task);
   fiber->task = NULL;
 
   fiber->state = FIBER_DEAD;
-  sanitizer_start_switch_fiber(fiber->suspendContext.uc_stack.ss_sp, 
-                               fiber->suspendContext.uc_stack.ss_size);
-  swapcontext(&fiber->resumeContext, &fiber->suspendContext);
+  sanitizer_start_switch_fiber(NULL, fiber->callerStackBottom, fiber->callerStackSize);
+  fiber_context_switch(&fiber->resumeContext, &fiber->suspendContext);
   
   // Its illegal to reach here
   abort();
@@ -48,23 +52,27 @@ static void entryPoint(struct fiber* fiber, runnable_t task) {
 
 struct fiber* fiber_new(runnable_t task) {
   struct fiber* fiber = malloc(sizeof(struct fiber));
+  if (!fiber)
+    return NULL;
   
+  fiber->stack = fiber_stack_get();
+  if (!fiber->stack) {
+    free(fiber);
+    return NULL;
+  }
+
   fiber->state = FIBER_SUSPENDED;
-  
-  fiber->resumeContext.uc_stack.ss_sp = malloc(SIGSTKSZ);
-  fiber->resumeContext.uc_stack.ss_flags = 0;
-  fiber->resumeContext.uc_stack.ss_size = SIGSTKSZ;
-  fiber->resumeContext.uc_link = NULL;
   fiber->task = task;
-
-  getcontext(&fiber->resumeContext);
-  makecontext(&fiber->resumeContext, (void(*)()) entryPoint, 2, fiber, task);
-
+  fiber->callerStackBottom = NULL;
+  fiber->callerStackSize = 0;
+  fiber->fakeStack = NULL;
+  
+  fiber_context_init(&fiber->resumeContext, fiber->stack->bottom, fiber->stack->size, entryPoint, fiber);
   return fiber;
 }
 
 void fiber_free(struct fiber* fiber) {
-  free(fiber->resumeContext.uc_stack.ss_sp);
+  fiber_stack_release(fiber->stack);
   if (fiber->task)
     Block_release(fiber->task);
   free(fiber);
@@ -77,18 +85,19 @@ bool fiber_resume(struct fiber* fiber, fiber_state_t* prevState) {
   fiber_state_t expect = FIBER_SUSPENDED;
   if (!atomic_compare_exchange_strong(&fiber->state, (int*) &expect, FIBER_RUNNING))
     return false;
-   
-  sanitizer_start_switch_fiber(&fiber->resumeContext.uc_stack.ss_sp, 
-                                fiber->resumeContext.uc_stack.ss_size);
-  swapcontext(&fiber->suspendContext, &fiber->resumeContext);
-  sanitizer_finish_switch_fiber();
+  
+  void* fakeStack = NULL;
+  sanitizer_start_switch_fiber(&fakeStack, fiber->stack->bottom, fiber->stack->size);
+  fiber_context_switch(&fiber->suspendContext, &fiber->resumeContext);
+  sanitizer_finish_switch_fiber(fakeStack, NULL, NULL);
 
   if (fiber->state == FIBER_DEAD) {
     // At here we are sure that stack wont be 
     // used anymore because the fiber is done
-    // executing the code
-    free(fiber->resumeContext.uc_stack.ss_sp);
-    fiber->resumeContext.uc_stack.ss_sp = NULL;
+    // executing the code so give it back
+    // to the pool for next fiber
+    fiber_stack_release(fiber->stack);
+    fiber->stack = NULL;
   }
   return true;
 }
@@ -105,10 +114,12 @@ bool fiber_yield(struct fiber* fiber) {
     return false;
   }
 
-  sanitizer_start_switch_fiber(fiber->suspendContext.uc_stack.ss_sp, 
-                               fiber->suspendContext.uc_stack.ss_size);
-  swapcontext(&fiber->resumeContext, &fiber->suspendContext);
-  sanitizer_finish_switch_fiber();
+  sanitizer_start_switch_fiber(&fiber->fakeStack, fiber->callerStackBottom, fiber->callerStackSize);
+  fiber_context_switch(&fiber->resumeContext, &fiber->suspendContext);
+  
+  // Resumer may be on different stack 
+  // than the last time
+  sanitizer_finish_switch_fiber(fiber->fakeStack, &fiber->callerStackBottom, &fiber->callerStackSize);
   
   return true;
 }
@@ -3,10 +3,11 @@
 
 #include <stdbool.h>
 #include <stdatomic.h>
-#include <ucontext.h>
 #include <pthread.h>
 
 #include "util/functional/functional.h"
+#include "fiber_stack.h"
+#include "fiber_context.h"
 
 typedef enum {
   FIBER_RUNNING,
@@ -18,13 +19,22 @@ struct fiber {
   volatile atomic_int state;
   runnable_t task;
 
-  ucontext_t resumeContext;
-  ucontext_t suspendContext;
+  // NULL when the fiber is dead
+  struct fiber_stack* stack;
+
+  struct fiber_context resumeContext;
+  struct fiber_context suspendContext;
+
+  // For ASan's fiber annotations
+  const void* callerStackBottom;
+  size_t callerStackSize;
+  void* fakeStack;
 };
 
 bool fiber_yield(struct fiber* fiber);
 bool fiber_resume(struct fiber* fiber, fiber_state_t* prevState);
 
+// Return NULL if cant get stack
 struct fiber* fiber_new(runnable_t task);
 void fiber_free(struct fiber* fiber);
 
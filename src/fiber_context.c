@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fiber_context.h"
+
+#ifdef FLUFFYVM_FIBER_CONTEXT_ASM
+
+// Implemented in assembly below
+void fluffyvm_fiber_context_switch(struct fiber_context* from, struct fiber_context* to);
+void fluffyvm_fiber_context_trampoline();
+
+#if defined(__x86_64__)
+// Saved frame (lowest address first)
+// mxcsr + x87 control word, r15, r14,
+// r13, r12, rbx, rbp, return address
+//
+// First switch "returns" into trampoline
+// which call r12 (entry) with r13 (arg)
+__asm__ (
+  ".text\n"
+  ".globl fluffyvm_fiber_context_switch\n"
+  ".type fluffyvm_fiber_context_switch, @function\n"
+  ".p2align 4\n"
+  "fluffyvm_fiber_context_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq (%rsi), %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size fluffyvm_fiber_context_switch, .-fluffyvm_fiber_context_switch\n"
+
+  ".globl fluffyvm_fiber_context_trampoline\n"
+  ".type fluffyvm_fiber_context_trampoline, @function\n"
+  ".p2align 4\n"
+  "fluffyvm_fiber_context_trampoline:\n"
+  "  movq %r13, %rdi\n"
+  "  callq *%r12\n"
+  "  ud2\n"
+  ".size fluffyvm_fiber_context_trampoline, .-fluffyvm_fiber_context_trampoline\n"
+);
+
+# define FRAME_WORDS 8
+
+static void initFrame(uintptr_t* frame, fiber_context_entry_t entry, void* arg) {
+  // Default MXCSR and x87 control word
+  frame[0] = 0x1F80 | ((uintptr_t) 0x037F << 32);
+  frame[1] = 0; // r15
+  frame[2] = 0; // r14
+  frame[3] = (uintptr_t) arg; // r13
+  frame[4] = (uintptr_t) entry; // r12
+  frame[5] = 0; // rbx
+  frame[6] = 0; // rbp (terminate frame chain)
+  frame[7] = (uintptr_t) fluffyvm_fiber_context_trampoline;
+}
+#elif defined(__aarch64__)
+// Saved frame (lowest address first)
+// x19-x28, x29 (fp), x30 (lr), d8-d15
+//
+// First switch "returns" into trampoline
+// which call x19 (entry) with x20 (arg)
+__asm__ (
+  ".text\n"
+  ".globl fluffyvm_fiber_context_switch\n"
+  ".type fluffyvm_fiber_context_switch, %function\n"
+  ".p2align 4\n"
+  "fluffyvm_fiber_context_switch:\n"
+  "  sub sp, sp, #160\n"
+  "  stp x19, x20, [sp, #0]\n"
+  "  stp x21, x22, [sp, #16]\n"
+  "  stp x23, x24, [sp, #32]\n"
+  "  stp x25, x26, [sp, #48]\n"
+  "  stp x27, x28, [sp, #64]\n"
+  "  stp x29, x30, [sp, #80]\n"
+  "  stp d8, d9, [sp, #96]\n"
+  "  stp d10, d11, [sp, #112]\n"
+  "  stp d12, d13, [sp, #128]\n"
+  "  stp d14, d15, [sp, #144]\n"
+  "  mov x9, sp\n"
+  "  str x9, [x0]\n"
+  "  ldr x9, [x1]\n"
+  "  mov sp, x9\n"
+  "  ldp x19, x20, [sp, #0]\n"
+  "  ldp x21, x22, [sp, #16]\n"
+  "  ldp x23, x24, [sp, #32]\n"
+  "  ldp x25, x26, [sp, #48]\n"
+  "  ldp x27, x28, [sp, #64]\n"
+  "  ldp x29, x30, [sp, #80]\n"
+  "  ldp d8, d9, [sp, #96]\n"
+  "  ldp d10, d11, [sp, #112]\n"
+  "  ldp d12, d13, [sp, #128]\n"
+  "  ldp d14, d15, [sp, #144]\n"
+  "  add sp, sp, #160\n"
+  "  ret\n"
+  ".size fluffyvm_fiber_context_switch, .-fluffyvm_fiber_context_switch\n"
+
+  ".globl fluffyvm_fiber_context_trampoline\n"
+  ".type fluffyvm_fiber_context_trampoline, %function\n"
+  ".p2align 4\n"
+  "fluffyvm_fiber_context_trampoline:\n"
+  "  mov x0, x20\n"
+  "  blr x19\n"
+  "  brk #0\n"
+  ".size fluffyvm_fiber_context_trampoline, .-fluffyvm_fiber_context_trampoline\n"
+);
+
+# define FRAME_WORDS 20
+
+static void initFrame(uintptr_t* frame, fiber_context_entry_t entry, void* arg) {
+  for (int i = 0; i < FRAME_WORDS; i++)
+    frame[i] = 0;
+  frame[0] = (uintptr_t) entry; // x19
+  frame[1] = (uintptr_t) arg; // x20
+  frame[10] = 0; // x29 (terminate frame chain)
+  frame[11] = (uintptr_t) fluffyvm_fiber_context_trampoline; // x30
+}
+#endif
+
+void fiber_context_init(struct fiber_context* ctx, void* stackBottom, size_t stackSize, fiber_context_entry_t entry, void* arg) {
+  // Both ABI wants 16 bytes aligned stack
+  uintptr_t top = ((uintptr_t) stackBottom + stackSize) & ~((uintptr_t) 15);
+  uintptr_t* frame = (uintptr_t*) (top - FRAME_WORDS * sizeof(uintptr_t));
+  initFrame(frame, entry, arg);
+  ctx->sp = frame;
+}
+
+void fiber_context_switch(struct fiber_context* from, struct fiber_context* to) {
+  fluffyvm_fiber_context_switch(from, to);
+}
+
+#else
+
+// makecontext only accept int arguments
+// but every platform we care pass pointers
+// fine (previous code relied on it too)
+static void ucontextEntry(fiber_context_entry_t entry, void* arg) {
+  entry(arg);
+  abort();
+}
+
+void fiber_context_init(struct fiber_context* ctx, void* stackBottom, size_t stackSize, fiber_context_entry_t entry, void* arg) {
+  getcontext(&ctx->uc);
+  ctx->uc.uc_stack.ss_sp = stackBottom;
+  ctx->uc.uc_stack.ss_flags = 0;
+  ctx->uc.uc_stack.ss_size = stackSize;
+  ctx->uc.uc_link = NULL;
+  makecontext(&ctx->uc, (void(*)()) ucontextEntry, 2, entry, arg);
+}
+
+void fiber_context_switch(struct fiber_context* from, struct fiber_context* to) {
+  swapcontext(&from->uc, &to->uc);
+}
+
+#endif
+
@@ -0,0 +1,47 @@
+#ifndef header_1655104317_fiber_context_h
+#define header_1655104317_fiber_context_h
+
+#include <stddef.h>
+
+// Minimal context switching for fibers
+//
+// On x86-64 and aarch64 its hand written
+// assembly which only saves callee saved
+// registers and the stack pointer (no
+// signal mask so no syscall unlike
+// swapcontext). Other platforms fallback
+// to ucontext
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__)
+# define FLUFFYVM_FIBER_CONTEXT_ASM
+#endif
+
+#ifdef FLUFFYVM_FIBER_CONTEXT_ASM
+struct fiber_context {
+  // Saved stack pointer, the registers
+  // are saved on the stack it points to
+  // (must be first field the assembly
+  // relies on it)
+  void* sp;
+};
+#else
+# include <ucontext.h>
+
+struct fiber_context {
+  ucontext_t uc;
+};
+#endif
+
+typedef void (*fiber_context_entry_t)(void* arg);
+
+// Prepare `ctx` so the first switch to it
+// calls `entry(arg)` on the given stack.
+// `entry` must never return
+void fiber_context_init(struct fiber_context* ctx, void* stackBottom, size_t stackSize, fiber_context_entry_t entry, void* arg);
+
+// Save current context into `from` and
+// continue execution from `to`
+void fiber_context_switch(struct fiber_context* from, struct fiber_context* to);
+
+#endif
+
@@ -0,0 +1,138 @@
+// For MAP_ANONYMOUS and madvise()
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "fiber_stack.h"
+
+#ifndef MAP_NORESERVE
+# define MAP_NORESERVE 0
+#endif
+
+#ifndef MAP_STACK
+# define MAP_STACK 0
+#endif
+
+struct stack_pool {
+  int count;
+  struct fiber_stack* head;
+};
+
+static pthread_key_t poolKey;
+static pthread_once_t poolKeyOnce = PTHREAD_ONCE_INIT;
+
+static void unmapStack(struct fiber_stack* stack) {
+  // The struct lives in the mapping so
+  // copy before unmapping
+  void* mapping = stack->mapping;
+  size_t size = stack->mappingSize;
+  munmap(mapping, size);
+}
+
+static void poolDestructor(void* _pool) {
+  struct stack_pool* pool = _pool;
+  struct fiber_stack* current = pool->head;
+  while (current) {
+    struct fiber_stack* next = current->next;
+    unmapStack(current);
+    current = next;
+  }
+  free(pool);
+}
+
+static void createPoolKey() {
+  pthread_key_create(&poolKey, poolDestructor);
+}
+
+static struct stack_pool* getPool() {
+  pthread_once(&poolKeyOnce, createPoolKey);
+  struct stack_pool* pool = pthread_getspecific(poolKey);
+  if (pool)
+    return pool;
+
+  pool = malloc(sizeof(*pool));
+  if (!pool)
+    return NULL;
+
+  pool->count = 0;
+  pool->head = NULL;
+  pthread_setspecific(poolKey, pool);
+  return pool;
+}
+
+static size_t roundToPage(size_t size) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+static struct fiber_stack* mapStack() {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t guardSize = pageSize * FLUFFYVM_FIBER_STACK_GUARD_PAGES;
+
+  // Extra space at the top for the `struct fiber_stack`
+  // so no need separate malloc for it
+  size_t mappingSize = guardSize + roundToPage(FLUFFYVM_FIBER_STACK_SIZE + sizeof(struct fiber_stack));
+
+  void* mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  if (guardSize > 0 && mprotect(mapping, guardSize, PROT_NONE) != 0) {
+    munmap(mapping, mappingSize);
+    return NULL;
+  }
+
+  // Place it at the top and keep the
+  // stack top 16 bytes aligned
+  uintptr_t structAddr = ((uintptr_t) mapping + mappingSize - sizeof(struct fiber_stack)) & ~((uintptr_t) 15);
+  struct fiber_stack* stack = (struct fiber_stack*) structAddr;
+
+  stack->mapping = mapping;
+  stack->mappingSize = mappingSize;
+  stack->bottom = (char*) mapping + guardSize;
+  stack->size = structAddr - (uintptr_t) stack->bottom;
+  stack->next = NULL;
+  return stack;
+}
+
+struct fiber_stack* fiber_stack_get() {
+  struct stack_pool* pool = getPool();
+  if (pool && pool->head) {
+    struct fiber_stack* stack = pool->head;
+    pool->head = stack->next;
+    pool->count--;
+    stack->next = NULL;
+    return stack;
+  }
+
+  return mapStack();
+}
+
+void fiber_stack_release(struct fiber_stack* stack) {
+  if (!stack)
+    return;
+
+  struct stack_pool* pool = getPool();
+  if (!pool || pool->count >= FLUFFYVM_FIBER_STACK_POOL_SIZE) {
+    unmapStack(stack);
+    return;
+  }
+
+  // Give back pages the fiber dirtied so
+  // pooled stacks cost nothing, the page
+  // with this struct stays as its in use
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  uintptr_t structPage = (uintptr_t) stack & ~((uintptr_t) pageSize - 1);
+  if (structPage > (uintptr_t) stack->bottom)
+    madvise(stack->bottom, structPage - (uintptr_t) stack->bottom, MADV_DONTNEED);
+
+  stack->next = pool->head;
+  pool->head = stack;
+  pool->count++;
+}
+
@@ -0,0 +1,48 @@
+#ifndef header_1655012481_fiber_stack_h
+#define header_1655012481_fiber_stack_h
+
+#include <stddef.h>
+
+// Stack for fibers backed by mmap with
+// guard page below it. Pages are only
+// committed when the fiber touches them
+// so an idle fiber cost only few pages
+//
+// Released stacks are cached in per thread
+// free list (up to FLUFFYVM_FIBER_STACK_POOL_SIZE)
+// so creating fiber doesn't need mmap, their
+// pages given back to the kernel on release
+//
+// Note: each stack is two mappings (guard and
+//       the usable part) keep vm.max_map_count
+//       in mind when having lots of fibers
+
+struct fiber_stack {
+  // Lowest usable address
+  void* bottom;
+  // Usable size (the guard page and this
+  // struct not included)
+  size_t size;
+
+  // The whole mapping
+  void* mapping;
+  size_t mappingSize;
+
+  // Next free stack in the pool
+  struct fiber_stack* next;
+};
+
+// Return NULL on failure
+struct fiber_stack* fiber_stack_get();
+
+// Return stack to current thread's pool
+// or unmap it if the pool is full
+void fiber_stack_release(struct fiber_stack* stack);
+
+// Highest usable address (stack grows down)
+static inline void* fiber_stack_top(struct fiber_stack* stack) {
+  return (char*) stack->bottom + stack->size;
+}
+
+#endif
+
@@ -9,8 +9,11 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include "config.h"
 #include "fiber.h"
@@ -19,6 +22,7 @@
 #include "hashtable.h"
 #include "util/util.h"
 #include "loader/bytecode/json.h"
+#include "loader/bytecode/image.h"
 #include "value.h"
 #include "fluffyvm_types.h"
 #include "bytecode.h"
@@ -26,6 +30,10 @@
 #include "closure.h"
 #include "stack.h"
 #include "string_cache.h"
+#include "channel.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include "interpreter.h"
 #include "api_layer/lua54.h"
 
 #define COMPONENTS \
@@ -38,10 +46,13 @@
   X(caches) \
   X(bytecode) \
   X(bytecode_loader_json) \
+  X(bytecode_loader_image) \
   X(closure) \
   X(coroutine) \
-  X(fluffyvm_compat_layer_lua54) \
-  X(cache_poller)
+  X(channel) \
+  X(thread_pool) \
+  X(snapshot) \
+  X(fluffyvm_compat_layer_lua54)
 
 static bool global_table_init(struct fluffyvm* this) {
   // Create global table
@@ -50,21 +61,21 @@ static bool global_table_init(struct fluffyvm* this) {
   
   if (globalTable.type == FLUFFYVM_TVALUE_NOT_PRESENT)
     return false;
-  fluffyvm_set_global(this, globalTable);
+  fluffyvm_replace_global(this, globalTable);
   foxgc_api_remove_from_root2(this->heap, fluffyvm_get_root(this), globalTableRootRef);
   return true; 
 }
 
 static void global_table_cleanup(struct fluffyvm* this) {}
 
-static bool cache_poller_init(struct fluffyvm* this) {
+static bool startCachePoller(struct fluffyvm* this) {
   fluffyvm_thread_routine_t tmp = ^void* (void* args) {
     prctl(PR_SET_NAME, "String-Cache Cleaner");
     struct timespec timeout = {
       .tv_nsec = 1000000 * 500,
       .tv_sec = 0
     };
-    while (!this->shuttingDown) {
+    while (!this->shuttingDown && !this->stopCachePoller) {
       string_cache_poll(this, this->stringCache, &timeout);
       nanosleep(&timeout, NULL);
     }
@@ -76,13 +87,41 @@ static bool cache_poller_init(struct fluffyvm* this) {
   if (!res)
     return false;
   
-  this->hasCachePollerStarted = true;
+  atomic_store(&this->hasCachePollerStarted, true);
   return true;
 }
 
-static void cache_poller_cleanup(struct fluffyvm* this) {
-  if (this->hasCachePollerStarted)
+bool fluffyvm_start_cache_poller(struct fluffyvm* this) {
+  if (atomic_load(&this->hasCachePollerStarted))
+    return true;
+
+  // Callers use this on the side, keep
+  // whatever error they already have
+  struct value prevErrmsg = fluffyvm_get_errmsg(this);
+  foxgc_root_reference_t* prevErrmsgRootRef = NULL;
+  if (prevErrmsg.type != FLUFFYVM_TVALUE_NOT_PRESENT && value_get_object_ptr(prevErrmsg))
+    foxgc_api_root_add(this->heap, value_get_object_ptr(prevErrmsg), fluffyvm_get_root(this), &prevErrmsgRootRef);
+
+  pthread_mutex_lock(&this->cachePollerLock);
+  bool res = this->hasCachePollerStarted || this->shuttingDown || startCachePoller(this);
+  pthread_mutex_unlock(&this->cachePollerLock);
+
+  if (!res)
+    fluffyvm_set_errmsg(this, prevErrmsg);
+  if (prevErrmsgRootRef)
+    foxgc_api_remove_from_root2(this->heap, fluffyvm_get_root(this), prevErrmsgRootRef);
+  return res;
+}
+
+static void stopCachePoller(struct fluffyvm* this) {
+  pthread_mutex_lock(&this->cachePollerLock);
+  if (this->hasCachePollerStarted) {
+    atomic_store(&this->stopCachePoller, true);
     pthread_join(this->stringCachePoller, NULL);
+    atomic_store(&this->hasCachePollerStarted, false);
+    atomic_store(&this->stopCachePoller, false);
+  }
+  pthread_mutex_unlock(&this->cachePollerLock);
 }
 
 // Initialize caching related stuffs
@@ -135,6 +174,7 @@ static void initThread(struct fluffyvm* this, int* threadIdStorage, foxgc_root_t
   pthread_setspecific(this->errMsgKey, NULL);
   pthread_setspecific(this->errMsgRootRefKey, NULL);
   pthread_setspecific(this->coroutinesStack, coroutineStack);
+  pthread_setspecific(this->coroutinePoolKey, NULL);
 
   int id = atomic_fetch_add(&this->currentAvailableThreadID, 1);
   *threadIdStorage = id;
@@ -162,7 +202,8 @@ static bool lateInit(struct fluffyvm* this) {
   foxgc_api_remove_from_root2(this->heap, fluffyvm_get_root(this), closureRootRef);
   foxgc_api_remove_from_root2(this->heap, fluffyvm_get_root(this), coroutineRootRef);
 
-  mainThread->fiber->state = FIBER_RUNNING;
+  mainThread->state = COROUTINE_RUNNING;
+  mainThread->started = true;
   mainThread->isNativeThread = true;
   this->mainThread = mainThread;
   
@@ -190,6 +231,8 @@ int fluffyvm_get_thread_id(struct fluffyvm* this) {
 
 // Cleanup resources allocated for current thread
 static void cleanThread(struct fluffyvm* this) {
+  if (this->hasInit)
+    coroutine_thread_cleanup(this);
   free(pthread_getspecific(this->errMsgKey));
   free(pthread_getspecific(this->currentThreadID));
 
@@ -209,6 +252,8 @@ static void commonCleanup(struct fluffyvm* this, int initCounts) {
   // and in correct order
   
   atomic_exchange(&this->shuttingDown, true); 
+  stopCachePoller(this);
+
   cleanup_call calls[] = {
 # define X(name, ...) name ## _cleanup,
   COMPONENTS
@@ -229,10 +274,53 @@ static void commonCleanup(struct fluffyvm* this, int initCounts) {
   pthread_key_delete(this->errMsgRootRefKey);
   pthread_key_delete(this->currentThreadID);
   pthread_key_delete(this->coroutinesStack);
+  pthread_key_delete(this->coroutinePoolKey);
   pthread_rwlock_destroy(&this->globalTableLock);
+  pthread_mutex_destroy(&this->cachePollerLock);
+  if (this->gcQuiesce)
+    Block_release(this->gcQuiesce);
+  if (this->gcRestart)
+    Block_release(this->gcRestart);
+  free(this->startupTrace);
   free(this);
 }
 
+static uint64_t getMonotonicTime() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// GC may run in middle of init making
+// usage smaller, count that as zero
+static size_t usageDelta(size_t before, size_t after) {
+  return after > before ? after - before : 0;
+}
+
+// Entry holds the starting point until
+// `traceEnd` turn it into deltas
+static void traceBegin(struct fluffyvm* this, struct fluffyvm_startup_trace_entry* entry) {
+  entry->nanoseconds = getMonotonicTime();
+  entry->heapBytes = foxgc_api_get_heap_usage(this->heap);
+  entry->metaspaceBytes = foxgc_api_get_metaspace_usage(this->heap);
+}
+
+static void traceEnd(struct fluffyvm* this, struct fluffyvm_startup_trace_entry* entry, const char* component) {
+  if (!this->startupTrace)
+    return;
+
+  struct fluffyvm_startup_trace_entry* result = &this->startupTrace[this->startupTraceCount++];
+  result->component = component;
+  result->nanoseconds = getMonotonicTime() - entry->nanoseconds;
+  result->heapBytes = usageDelta(entry->heapBytes, foxgc_api_get_heap_usage(this->heap));
+  result->metaspaceBytes = usageDelta(entry->metaspaceBytes, foxgc_api_get_metaspace_usage(this->heap));
+}
+
+const struct fluffyvm_startup_trace_entry* fluffyvm_get_startup_trace(struct fluffyvm* this, int* count) {
+  *count = this->startupTraceCount;
+  return this->startupTrace;
+}
+
 struct fluffyvm* fluffyvm_new(struct foxgc_heap* heap) {
   struct fluffyvm* this = malloc(sizeof(*this));
   if (this == NULL)
@@ -240,22 +328,33 @@ struct fluffyvm* fluffyvm_new(struct foxgc_heap* heap) {
   
   this->heap = heap;
   this->numberOfManagedThreads = 0;
+  this->liveSchedulers = 0;
   this->currentAvailableThreadID = 0;
   this->hasInit = false;
   this->stringCache = NULL;
   this->hasCachePollerStarted = false;
   this->shuttingDown = false;
+  this->stopCachePoller = false;
   this->globalTableRootRef = NULL;
+  this->threadPool = NULL;
+  this->mainThread = NULL;
+  this->gcQuiesce = NULL;
+  this->gcRestart = NULL;
+  this->startupTrace = NULL;
+  this->startupTraceCount = 0;
 
   pthread_key_create(&this->currentThreadRootKey, NULL);
   pthread_key_create(&this->errMsgKey, NULL);
   pthread_key_create(&this->errMsgRootRefKey, NULL);
   pthread_key_create(&this->currentThreadID, NULL);
   pthread_key_create(&this->coroutinesStack, NULL);
+  pthread_key_create(&this->coroutinePoolKey, NULL);
   pthread_rwlock_init(&this->globalTableLock, NULL);
+  pthread_mutex_init(&this->cachePollerLock, NULL);
   
   int* tidStorage = malloc(sizeof(int));
   int initCounts = 0;
+  struct fluffyvm_startup_trace_entry trace;
  
   // Stack component needed to bootstrap
   // other components (its kinda chicken
@@ -281,11 +380,21 @@ struct fluffyvm* fluffyvm_new(struct foxgc_heap* heap) {
 
   this->staticDataRoot = foxgc_api_new_root(heap);
 
+  // Trace is optional, VM works without it
+  static const char* componentNames[] = {
+# define X(name, ...) #name,
+  COMPONENTS
+# undef X
+  };
+  this->startupTrace = calloc(sizeof(componentNames) / sizeof(componentNames[0]), sizeof(*this->startupTrace));
+
   // Start initializing stuffs
 # define X(name, ...) \
+  traceBegin(this, &trace); \
   initCounts++; \
   if (!name ## _init(this)) \
-    goto error;
+    goto error; \
+  traceEnd(this, &trace, componentNames[initCounts - 1]);
   COMPONENTS
 # undef X
 
@@ -317,6 +426,15 @@ void fluffyvm_set_global(struct fluffyvm* this, struct value val) {
   pthread_rwlock_unlock(&this->globalTableLock);
 }
 
+void fluffyvm_replace_global(struct fluffyvm* this, struct value val) {
+  fluffyvm_set_global(this, val);
+
+  // Main thread's closure is what native
+  // calls on it see as their _ENV
+  if (this->mainThread)
+    closure_set_env(this, this->mainThread->currentCallState->closure, val);
+}
+
 struct value fluffyvm_get_global(struct fluffyvm* this) {
   pthread_rwlock_rdlock(&this->globalTableLock);
   
@@ -378,10 +496,12 @@ struct value fluffyvm_get_errmsg(struct fluffyvm* vm) {
 
 void fluffyvm_free(struct fluffyvm* this) {
   validateThisThread(this);
+  thread_pool_shutdown(this);
 
   // There still other thread running
   // 2 threads because it accounts current
   // thread and VM's string cache poller
+  // if it were started
   if (this->numberOfManagedThreads > 2)
     abort();
   
@@ -506,6 +626,11 @@ bool fluffyvm_start_thread(struct fluffyvm* this, pthread_t* newthread, pthread_
   return false;
 }
 
+struct fluffyvm_future* fluffyvm_submit(struct fluffyvm* this, struct fluffyvm_closure* closure, int nargs, struct value* args) {
+  validateThisThread(this);
+  return thread_pool_submit(this, closure, nargs, args);
+}
+
 foxgc_root_t* fluffyvm_get_root(struct fluffyvm* this) {
   validateThisThread(this);
   return pthread_getspecific(this->currentThreadRootKey);
@@ -555,7 +680,99 @@ void fluffyvm_set_errmsg_vprintf(struct fluffyvm* vm, const char* fmt, va_list l
   free(msg);
 }
 
+// Stop threads VM started on its own
+// both start again on first use
+static void quiesce(struct fluffyvm* this) {
+  stopCachePoller(this);
+  thread_pool_quiesce(this);
+}
 
+void fluffyvm_set_gc_fork_hooks(struct fluffyvm* this, fluffyvm_gc_quiesce_t quiesce, fluffyvm_gc_restart_t restart) {
+  if (this->gcQuiesce)
+    Block_release(this->gcQuiesce);
+  if (this->gcRestart)
+    Block_release(this->gcRestart);
+  this->gcQuiesce = quiesce ? Block_copy(quiesce) : NULL;
+  this->gcRestart = restart ? Block_copy(restart) : NULL;
+}
 
+bool fluffyvm_prefork(struct fluffyvm* this, int count, pid_t* pids, int* workerID) {
+  validateThisThread(this);
+  *workerID = 0;
+  for (int i = 0; i < count; i++)
+    pids[i] = -1;
+
+  quiesce(this);
+  if (this->gcQuiesce)
+    this->gcQuiesce(this->heap);
+
+  bool res = true;
+  for (int i = 0; i < count; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      fluffyvm_set_errmsg_printf(this, "fork: %s", strerror(errno));
+      res = false;
+      break;
+    }
 
+    if (pid == 0) {
+      *workerID = i + 1;
+      if (this->gcRestart)
+        this->gcRestart(this->heap, true);
+      return true;
+    }
+    pids[i] = pid;
+  }
 
+  // All or nothing, dont leave some
+  // workers running behind caller's back
+  if (!res) {
+    for (int i = 0; i < count && pids[i] != -1; i++) {
+      kill(pids[i], SIGKILL);
+      while (waitpid(pids[i], NULL, 0) < 0 && errno == EINTR)
+        ;
+      pids[i] = -1;
+    }
+  }
+
+  if (this->gcRestart)
+    this->gcRestart(this->heap, false);
+  return res;
+}
+
+bool fluffyvm_reset(struct fluffyvm* this) {
+  validateThisThread(this);
+
+  // Their workers still run coroutines
+  // on this VM
+  if (atomic_load(&this->liveSchedulers) > 0) {
+    fluffyvm_set_errmsg(this, this->staticStrings.cannotResetWithLiveScheduler);
+    return false;
+  }
+
+  thread_pool_quiesce(this);
+  coroutine_thread_cleanup(this);
+  fluffyvm_clear_errmsg(this);
+
+  // Error previous user left on main thread
+  struct fluffyvm_coroutine* mainThread = this->mainThread;
+  mainThread->hasError = false;
+  mainThread->thrownedError = value_nil;
+  foxgc_api_write_field(mainThread->gc_this, 2, NULL);
+  mainThread->nativeHasError = false;
+  mainThread->yieldPending = false;
+  mainThread->continuation = NULL;
+  mainThread->continuationData = NULL;
+
+  // Drop what previous user left on
+  // main thread's stack
+  struct fluffyvm_call_state* callState = this->mainThread->currentCallState;
+  while (callState->sp > 0)
+    interpreter_pop(this, callState, NULL, NULL);
+
+  if (!global_table_init(this))
+    return false;
+
+  foxgc_api_do_full_gc(this->heap);
+  return true;
+}
@@ -3,7 +3,9 @@
 
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 #include "config.h"
 #include "value.h"
@@ -47,7 +49,21 @@
   X(bool_false, "false") \
   X(nativeFunctionExplicitlyDisabledYieldingForThisCoroutine, "A native function explicitly disabled yielding for this coroutine") \
   X(attemptToXmoveOnRunningCoroutine, "attempt to xmove on running coroutine") \
-  X(attemptToXmoveOnDeadCoroutine, "attempt to xmove on dead coroutine")
+  X(attemptToXmoveOnDeadCoroutine, "attempt to xmove on dead coroutine") \
+  X(attemptToYieldAcrossCCallBoundary, "attempt to yield across a C-call boundary") \
+  X(notInScheduledCoroutine, "not in scheduled coroutine") \
+  X(cannotBlockSchedulerWorker, "cannot block scheduler worker") \
+  X(expectInteger, "expect integer") \
+  X(expectString, "expect string") \
+  X(expectNonNegative, "expect non negative") \
+  X(expectChannel, "expect channel") \
+  X(threadPoolShutDown, "thread pool already shut down") \
+  X(threadPoolStopping, "thread pool is stopping") \
+  X(threadPoolQueueFull, "thread pool queue is full") \
+  X(expectTable, "expect table") \
+  X(expectFunction, "expect function") \
+  X(deadlineExceeded, "deadline exceeded") \
+  X(cannotResetWithLiveScheduler, "cannot reset VM while scheduler or reactor alive")
   
 /*
   X(illegalInstruction, "illegal instruction") \
@@ -58,6 +74,16 @@
   X(expectLongOrDoubleOrString, "expect long or double or string") \
 */
 
+// Cost of one component's init in
+// `fluffyvm_new`, allocations counted
+// as growth of heap and metaspace usage
+struct fluffyvm_startup_trace_entry {
+  const char* component;
+  uint64_t nanoseconds;
+  size_t heapBytes;
+  size_t metaspaceBytes;
+};
+
 struct fluffyvm {
   foxgc_heap_t* heap;
   
@@ -68,6 +94,10 @@ struct fluffyvm {
   pthread_key_t currentThreadRootKey;
   
   atomic_int numberOfManagedThreads;
+
+  // Schedulers and reactors not freed yet,
+  // `fluffyvm_reset` refuse if any
+  atomic_int liveSchedulers;
   
   // Static data for each component
   struct hashtable_static_data* hashTableStaticData;
@@ -77,6 +107,11 @@ struct fluffyvm {
   struct stack_static_data* stackStaticData;
   struct compat_layer_lua54_static_data* compatLayerLua54StaticData;
   struct string_cache_static_data* stringCacheStaticData;
+  struct channel_static_data* channelStaticData;
+  struct snapshot_static_data* snapshotStaticData;
+
+  // Started lazily by `fluffyvm_submit`
+  struct thread_pool* threadPool;
   
   foxgc_root_t* staticDataRoot;
 
@@ -87,6 +122,9 @@ struct fluffyvm {
   // Keep track of coroutine nesting
   pthread_key_t coroutinesStack;
 
+  // Dead coroutines for reuse
+  pthread_key_t coroutinePoolKey;
+
   atomic_int currentAvailableThreadID;
   pthread_key_t currentThreadID;
 
@@ -99,10 +137,23 @@ struct fluffyvm {
   bool hasInit;
   struct string_cache* stringCache;
 
-  bool hasCachePollerStarted;
+  // Started lazily by first cached string
+  // (see `fluffyvm_start_cache_poller`)
+  pthread_mutex_t cachePollerLock;
+  volatile atomic_bool hasCachePollerStarted;
   volatile atomic_bool shuttingDown;
+  // Stop only the poller (see `fluffyvm_prefork`)
+  volatile atomic_bool stopCachePoller;
   pthread_t stringCachePoller;
 
+  // See `fluffyvm_set_gc_fork_hooks`
+  void (^gcQuiesce)(foxgc_heap_t* heap);
+  void (^gcRestart)(foxgc_heap_t* heap, bool isWorker);
+
+  // One entry per component in init order
+  // NULL if there were no memory for it
+  struct fluffyvm_startup_trace_entry* startupTrace;
+  int startupTraceCount;
  
   struct {
     struct {
@@ -144,9 +195,20 @@ struct fluffyvm* fluffyvm_new(struct foxgc_heap* heap);
 
 bool fluffyvm_is_managed(struct fluffyvm* this);
 
+// Time and allocations spent on each
+// component when the VM were created
+// Return NULL and zero `count` if not
+// traced. Valid until VM freed
+const struct fluffyvm_startup_trace_entry* fluffyvm_get_startup_trace(struct fluffyvm* this, int* count);
+
 void fluffyvm_set_global(struct fluffyvm* this, struct value val);
 struct value fluffyvm_get_global(struct fluffyvm* this);
 
+// Set global table and make main thread
+// see it as _ENV too, for swapping whole
+// global state (reset, snapshot restore)
+void fluffyvm_replace_global(struct fluffyvm* this, struct value val);
+
 uintptr_t fluffyvm_get_owner_key();
 
 ATTRIBUTE((format(printf, 2, 3)))
@@ -163,8 +225,75 @@ void fluffyvm_set_errmsg_vprintf(struct fluffyvm* vm, const char* fmt, va_list l
 // VM API calls
 bool fluffyvm_start_thread(struct fluffyvm* this, pthread_t* newthread, pthread_attr_t* attr, fluffyvm_thread_routine_t routine, void* args);
 foxgc_root_t* fluffyvm_get_root(struct fluffyvm* this);
+
+// Run `closure` with `args` on VM's pool of
+// managed threads (see thread_pool.h) so no
+// thread creation and init on every call
+// Release returned future with `future_release`
+// before freeing the VM
+// Return NULL on error (errmsg set)
+struct fluffyvm_future* fluffyvm_submit(struct fluffyvm* this, struct fluffyvm_closure* closure, int nargs, struct value* args);
+
 int fluffyvm_get_thread_id(struct fluffyvm* this);
 
+// Start string cache poller if not yet
+// Return false on error, errmsg untouched
+bool fluffyvm_start_cache_poller(struct fluffyvm* this);
+
+// Bring VM back to the state right after
+// `fluffyvm_new` for reuse (see vm_pool.h)
+//
+// Global table replaced with empty one, main
+// thread's stack emptied, caller's pooled
+// coroutines and thread pool's threads
+// dropped and full GC ran. Caller must be
+// the thread created the VM with nothing
+// running on it and no other thread using
+// the VM
+//
+// Coroutines pooled by other managed threads
+// host started are not dropped (pools are
+// per thread), end those threads before
+// reset so nothing outlives the reset
+//
+// Schedulers and reactors must be freed
+// before too, reset fails while any alive
+// Return false on error (errmsg set)
+bool fluffyvm_reset(struct fluffyvm* this);
+
+typedef void (^fluffyvm_gc_quiesce_t)(foxgc_heap_t* heap);
+typedef void (^fluffyvm_gc_restart_t)(foxgc_heap_t* heap, bool isWorker);
+
+// FoxGC has no API to stop and start its
+// threads so the host owning the heap
+// give them. `quiesce` called before
+// `fluffyvm_prefork` forks and `restart`
+// after it in parent and in every worker
+// Either can be NULL, replaces old ones
+void fluffyvm_set_gc_fork_hooks(struct fluffyvm* this, fluffyvm_gc_quiesce_t quiesce, fluffyvm_gc_restart_t restart);
+
+// Fork `count` worker processes sharing the
+// VM's already initialized heap copy on write
+//
+// VM's own threads (string cache poller and
+// thread pool) stopped before forking and
+// started again on first use in the parent
+// and in every worker. Heap's GC threads
+// only handled by the hooks given with
+// `fluffyvm_set_gc_fork_hooks`, without
+// them worker's heap has no GC threads.
+// Caller must be the only thread using the
+// VM and make sure nothing else (host's
+// threads) holds locks meanwhile
+//
+// In worker `*workerID` is its number from 1
+// to `count`, in parent its 0 and `pids` has
+// the workers. If a fork fails the already
+// forked workers are killed and reaped, all
+// `pids` stay -1
+// Return false on error (errmsg set)
+bool fluffyvm_prefork(struct fluffyvm* this, int count, pid_t* pids, int* workerID);
+
 struct fluffyvm_coroutine* fluffyvm_get_executing_coroutine(struct fluffyvm* this);
 
 void fluffyvm_pop_current_coroutine(struct fluffyvm* this);
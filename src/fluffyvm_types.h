@@ -1,6 +1,8 @@
 #ifndef header_1650878691_fluffyvm_types_h
 #define header_1650878691_fluffyvm_types_h
 
+#include <pthread.h>
+
 #include "foxgc.h"
 
 struct hashtable_static_data { 
@@ -11,6 +13,9 @@ struct hashtable_static_data {
 struct bytecode_static_data { 
   foxgc_descriptor_t* desc_bytecode;
   foxgc_descriptor_t* desc_prototype;
+
+  // Publishing lazily built prototypes
+  pthread_mutex_t materializeLock;
 };
 
 struct coroutine_static_data {
@@ -27,7 +32,10 @@ struct stack_static_data {
 };
 
 struct compat_layer_lua54_static_data {
-  struct fluffyvm_closure* coroutineTrampoline;
+  // Created on first `lua_newthread`
+  pthread_mutex_t trampolineLock;
+  struct fluffyvm_closure* _Atomic coroutineTrampoline;
+  foxgc_root_reference_t* trampolineRootRef;
 };
 
 struct string_cache_static_data {
@@ -35,5 +43,19 @@ struct string_cache_static_data {
   foxgc_descriptor_t* desc_string_cache_entry;
 };
 
+struct channel_static_data {
+  foxgc_descriptor_t* desc_channel;
+  int moduleID;
+};
+
+struct snapshot_native;
+struct snapshot_static_data {
+  // Natives closures can be saved as
+  pthread_mutex_t nativesLock;
+  int nativesCount;
+  int nativesCapacity;
+  struct snapshot_native* natives;
+};
+
 #endif
 
@@ -343,12 +343,7 @@ struct value hashtable_get2(struct fluffyvm* vm, struct hashtable* this, const c
   uint64_t hash = hashing_hash_default(key, len); 
 
   return internal_get(vm, this, hash, rootRef, ^bool (struct value op2) {
-    if (op2.type != FLUFFYVM_TVALUE_STRING)
-      return false;
-    size_t compareLen = foxgc_api_get_array_length(op2.data.str->str);
-    if (compareLen > len)
-      compareLen = len;
-    return memcmp(key, foxgc_api_object_get_data(op2.data.str->str), compareLen);
+    return value_equals_cstring(op2, key, len);
   });
 }
 
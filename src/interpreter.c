@@ -5,12 +5,14 @@
 #include <stdio.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <Block.h>
 
 #include "bytecode.h"
 #include "interpreter.h"
 #include "closure.h"
 #include "config.h"
 #include "coroutine.h"
+#include "fiber.h"
 #include "fluffyvm.h"
 #include "util/functional/functional.h"
 #include "util/util.h"
@@ -116,6 +118,35 @@ bool interpreter_push(struct fluffyvm* vm, struct fluffyvm_call_state* callState
   return true;
 }
 
+bool interpreter_xmove(struct fluffyvm* vm, struct fluffyvm_call_state* from, struct fluffyvm_call_state* to, int count) {
+  int start = from->sp - count;
+  if (count < 0 || start < 0) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.stackUnderflow);
+    return false;
+  }
+
+  if (to->sp + count > FLUFFYVM_GENERAL_STACK_SIZE) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.stackOverflow);
+    return false;
+  }
+
+  // Write destination first so the values
+  // are always reachable from one of them
+  for (int i = 0; i < count; i++) {
+    struct value val = from->generalStack[start + i];
+    to->generalStack[to->sp + i] = val;
+    foxgc_api_write_array(to->gc_generalObjectStack, to->sp + i, value_get_object_ptr(val));
+  }
+  to->sp += count;
+
+  for (int i = start; i < from->sp; i++) {
+    from->generalStack[i] = value_not_present;
+    foxgc_api_write_array(from->gc_generalObjectStack, i, NULL);
+  }
+  from->sp = start;
+  return true;
+}
+
 void interpreter_function_epilog(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
 }
 
@@ -144,6 +175,132 @@ static struct instruction decode(fluffyvm_instruction_t instruction) {
   return ins;
 }
 
+static inline int instructionSize(fluffyvm_opcode_t opcode) {
+  int incrementCount = 0;
+  incrementCount += instructionFieldUsed[opcode] / 3;
+  incrementCount += instructionFieldUsed[opcode] % 3 > 0 ? 1 : 0;
+  
+  if (incrementCount == 0)
+    incrementCount = 1;
+  return incrementCount;
+}
+
+static struct fluffyvm_call_state* getCallerState(struct fluffyvm_coroutine* co) {
+  assert(co->callStack->sp >= 2);
+  return foxgc_api_object_get_data(co->callStack->stack[co->callStack->sp - 2]);
+}
+
+// Copy return values of current function to 
+// the caller then pop it from call stack
+static bool finishCall(struct fluffyvm* vm, struct fluffyvm_coroutine* co, int actualRetCount) {
+  struct fluffyvm_call_state* callState = co->currentCallState;
+  struct fluffyvm_call_state* callerState = getCallerState(co);
+  
+  int returnCount = callState->expectedRetCount;
+  
+  // vararg return
+  if (returnCount == -1)
+    returnCount = actualRetCount;
+
+  int startPos = callState->sp - actualRetCount;
+  if (startPos < 0)
+    startPos = 0;
+  
+  for (int i = 0; i < returnCount; i++) {
+    struct value val = value_nil;
+
+    // Copy only if current pos is valid
+    if (startPos + i <= callState->sp - 1)
+      val = callState->generalStack[startPos + i];
+    
+    if (!interpreter_push(vm, callerState, val))
+      return false;
+  }
+  
+  coroutine_function_epilog(vm);
+  return true;
+}
+
+// Continue native function suspended in fiber
+static int resumeNativeFiber(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
+  jmp_buf* errorHandler = co->errorHandler;
+  co->nativeHasError = false;
+  fiber_resume(co->fiber, NULL);
+  co->errorHandler = errorHandler;
+
+  if (co->fiber->state != FIBER_DEAD)
+    return FLUFFYVM_INTERPRETER_YIELDED;
+
+  fiber_free(co->fiber);
+  co->fiber = NULL;
+
+  // Rethrow here as its not possible to
+  // longjmp out from fiber
+  if (co->nativeHasError)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return co->nativeRetCount;
+}
+
+static int callNativeOnFiber(struct fluffyvm* vm, struct fluffyvm_coroutine* co, struct fluffyvm_call_state* callState) {
+  struct fluffyvm_closure* closure = callState->closure;
+  runnable_t task = Block_copy(^void () {
+    jmp_buf buf;
+    if (setjmp(buf)) {
+      co->nativeHasError = true;
+      co->nativeDepth = 0;
+      return;
+    }
+    
+    co->errorHandler = &buf;
+    co->nativeDepth++;
+    co->nativeRetCount = closure->func(vm, callState, closure->udata);
+    co->nativeDepth--;
+  });
+  
+  co->fiber = fiber_new(task);
+  if (!co->fiber) {
+    Block_release(task);
+    interpreter_error(vm, vm->staticStrings.outOfMemory);
+  }
+  
+  return resumeNativeFiber(vm, co);
+}
+
+static int callNative(struct fluffyvm* vm, struct fluffyvm_coroutine* co, struct fluffyvm_call_state* callState) {
+  struct fluffyvm_closure* closure = callState->closure;
+  
+  // Only the outermost native function need
+  // a fiber, natives called under it already
+  // on the fiber or cant yield anyway
+  if (closure->needFiber && co->nativeDepth == 0 && !co->isNativeThread && !co->fiber)
+    return callNativeOnFiber(vm, co, callState);
+  
+  co->nativeDepth++;
+  int retCount = closure->func(vm, callState, closure->udata);
+  co->nativeDepth--;
+  
+  if (co->yieldPending)
+    return FLUFFYVM_INTERPRETER_YIELDED;
+  return retCount;
+}
+
+// Continue native function suspended by
+// `coroutine_yield_stackless_k`
+static int callContinuation(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
+  closure_cfunction_t k = co->continuation;
+  co->continuation = NULL;
+  
+  co->nativeDepth++;
+  int retCount = k(vm, co->currentCallState, co->continuationData);
+  co->nativeDepth--;
+  
+  if (co->yieldPending)
+    return FLUFFYVM_INTERPRETER_YIELDED;
+  return retCount;
+}
+
+static int execute(struct fluffyvm* vm, struct fluffyvm_coroutine* co, struct fluffyvm_call_state* base, bool skipCall);
+
 void interpreter_call(struct fluffyvm* F, struct value func, int nargs, int nret) {
   struct fluffyvm_coroutine* co = fluffyvm_get_executing_coroutine(F);
   assert(co);
@@ -158,50 +315,35 @@ void interpreter_call(struct fluffyvm* F, struct value func, int nargs, int nret
   
   if (!coroutine_function_prolog(F, closure))
     goto error;
+  co->currentCallState->expectedRetCount = nret;
 
   // Copy args
   argsEnd = argsStart + nargs - 1;
   
   // varargs
   if (nargs == -1)
-    argsEnd = co->currentCallState->sp - 1;
+    argsEnd = callerState->sp - 1;
 
   for (int i = argsStart; i <= argsEnd; i++)
     if (!interpreter_push(F, co->currentCallState, callerState->generalStack[i]))
-      goto error;
+      goto call_error;
 
   // Remove from caller stack
   for (int i = argsStart; i <= argsEnd; i++)
     interpreter_pop(F, callerState, NULL, NULL); 
 
-  int actualRetCount = interpreter_exec(F, co);
+  int actualRetCount = execute(F, co, co->currentCallState, false);
   
-  // Copy return values
-  int returnCount = nret;
-
-  // vararg return
-  if (nret == -1)
-    returnCount = co->currentCallState->sp;
-
-  int startPos = co->currentCallState->sp - actualRetCount;
-  if (startPos < 0)
-    startPos = 0;
+  // Can't yield here as there native 
+  // function under us
+  assert(actualRetCount != FLUFFYVM_INTERPRETER_YIELDED);
   
-  for (int i = 0; i < returnCount; i++) {
-    struct value val = value_nil;
-
-    // Copy only if current pos is valid
-    if (startPos + i <= co->currentCallState->sp - 1)
-      val = co->currentCallState->generalStack[startPos + i];
-    
-    // Error here
-    if (!interpreter_push(F, callerState, val))
-      goto error;
-  }
-
-  coroutine_function_epilog(F);  
+  if (!finishCall(F, co, actualRetCount))
+    goto error;
   return;
- 
+  
+  call_error:
+  coroutine_function_epilog(F);
   error:
   interpreter_error(F, fluffyvm_get_errmsg(F));
   abort();
@@ -214,6 +356,7 @@ bool interpreter_xpcall(struct fluffyvm* vm, runnable_t thingToExecute, runnable
   jmp_buf env;
   jmp_buf* prevErrorHandler = co->errorHandler;
   struct fluffyvm_call_state* callerState = co->currentCallState;
+  int nativeDepth = co->nativeDepth;
 
   co->errorHandler = &env; 
   if (setjmp(env)) {
@@ -226,6 +369,7 @@ bool interpreter_xpcall(struct fluffyvm* vm, runnable_t thingToExecute, runnable
       coroutine_function_epilog_no_lock(vm);
     pthread_mutex_unlock(&co->callStackLock);
     
+    co->nativeDepth = nativeDepth;
     co->errorHandler = prevErrorHandler;
     return false;
   }
@@ -235,18 +379,98 @@ bool interpreter_xpcall(struct fluffyvm* vm, runnable_t thingToExecute, runnable
   return true;
 }
 
+// Charge `cost` to coroutine's instruction budget
+// Return true if it must be preempted now
+static inline bool chargeBudget(struct fluffyvm_coroutine* co, int cost) {
+  if (co->instructionBudget == 0)
+    return false;
+
+  co->budgetRemaining -= cost;
+  if (co->budgetRemaining > 0)
+    return false;
+
+  // Cant suspend with native frames under
+  // us, try again at next check
+  if (co->nativeDepth > 0 || co->isNativeThread || !co->isYieldable) {
+    co->budgetRemaining = 0;
+    return false;
+  }
+
+  co->budgetRemaining = co->instructionBudget;
+  co->preempted = true;
+  return true;
+}
+
 int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
-  if (co->currentCallState->closure->prototype == NULL)
-    return co->currentCallState->closure->func(vm, co->currentCallState, co->currentCallState->closure->udata);
-  int pc = 0;
-  struct fluffyvm_call_state* callState = co->currentCallState;
+  return execute(vm, co, co->currentCallState, false);
+}
 
-  int instructionsLen = co->currentCallState->closure->prototype->instructions_len;
-  assert(instructionsLen >= pc);
-  int retCount = 0;
+int interpreter_resume(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
+  struct fluffyvm_call_state* base = foxgc_api_object_get_data(co->callStack->stack[0]);
+  if (!co->started) {
+    co->started = true;
+    return execute(vm, co, base, false);
+  }
+
+  // Preempted between instructions, `pc` of
+  // current function already point to where
+  // to continue
+  if (co->preempted) {
+    co->preempted = false;
+    return execute(vm, co, base, false);
+  }
+
+  // Its suspended in native function
+  int retCount;
+  if (co->fiber) {
+    retCount = resumeNativeFiber(vm, co);
+    if (retCount == FLUFFYVM_INTERPRETER_YIELDED)
+      return FLUFFYVM_INTERPRETER_YIELDED;
+  } else if (co->continuation) {
+    retCount = callContinuation(vm, co);
+    if (retCount == FLUFFYVM_INTERPRETER_YIELDED)
+      return FLUFFYVM_INTERPRETER_YIELDED;
+  } else {
+    retCount = co->currentCallState->sp;
+  }
+
+  if (co->currentCallState == base)
+    return retCount;
+  
+  if (!finishCall(vm, co, retCount))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return execute(vm, co, base, true);
+}
 
-  const fluffyvm_instruction_t* instructionsArray = co->currentCallState->closure->prototype->instructions;
+// Run until `base` returns, functions called
+// by it are executed here too without recursing
+//
+// `skipCall` is for continuing current function
+// after the function it called already finished
+static int execute(struct fluffyvm* vm, struct fluffyvm_coroutine* co, struct fluffyvm_call_state* base, bool skipCall) {
+  if (base->closure->prototype == NULL)
+    return callNative(vm, co, base);
+  
+  int pc;
+  struct fluffyvm_call_state* callState;
+  int instructionsLen;
+  int retCount;
+  const fluffyvm_instruction_t* instructionsArray;
   struct instruction ins;
+
+  load_function:
+  callState = co->currentCallState;
+  instructionsLen = callState->closure->prototype->instructions_len;
+  instructionsArray = callState->closure->prototype->instructions;
+  retCount = 0;
+  
+  pc = callState->pc;
+  if (skipCall) {
+    pc += instructionSize(decode(instructionsArray[pc]).opcode);
+    skipCall = false;
+  }
+  assert(instructionsLen >= pc);
+  
   while (pc < instructionsLen) {
     ins = decode(instructionsArray[pc]);
     
@@ -277,12 +501,7 @@ int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
  
     // Calculate amount of instructions to increment
     // due some instruction take more than one instruction
-    int incrementCount = 0;
-    incrementCount += instructionFieldUsed[ins.opcode] / 3;
-    incrementCount += instructionFieldUsed[ins.opcode] % 3 > 0 ? 1 : 0;
-    
-    if (incrementCount == 0)
-      incrementCount = 1;
+    int incrementCount = instructionSize(ins.opcode);
 
     // Fetch additional fields
     if (incrementCount > 1) {
@@ -396,13 +615,31 @@ int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
           fluffyvm_set_errmsg_printf(vm, "Attempting to backward jump to %d", pc);
           goto error;
         }
+        if (coroutine_deadline_passed(co)) {
+          fluffyvm_set_errmsg(vm, vm->staticStrings.deadlineExceeded);
+          goto error;
+        }
         pc -= ins.A;
+
+        // Loop body size as its cost
+        if (chargeBudget(co, ins.A)) {
+          callState->pc = pc + incrementCount;
+          return FLUFFYVM_INTERPRETER_YIELDED;
+        }
         break;
       case FLUFFYVM_OPCODE_LOAD_PROTOTYPE:
       {
         //printf("0x%08X: R(%d) = Proto[%d]\n", pc, ins.A, ins.B);
+        if (ins.B >= callState->closure->prototype->prototypes_len)
+          goto illegal_instruction;
+
+        // Child may be built here on first use
+        struct fluffyvm_prototype* prototype = bytecode_prototype_get_child(vm, callState->closure->prototype, ins.B);
+        if (!prototype)
+          goto error;
+
         foxgc_root_reference_t* rootRef = NULL;
-        struct fluffyvm_closure* closure = closure_new(vm, &rootRef, foxgc_api_object_get_data(callState->closure->prototype->prototypes[ins.B]), getRegister(vm, callState, FLUFFYVM_INTERPRETER_REGISTER_ENV));
+        struct fluffyvm_closure* closure = closure_new(vm, &rootRef, prototype, getRegister(vm, callState, FLUFFYVM_INTERPRETER_REGISTER_ENV));
         setRegister(vm, callState, ins.A, value_new_closure(vm, closure)); 
         foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), rootRef);
         break;
@@ -450,6 +687,11 @@ int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
         break;
       case FLUFFYVM_OPCODE_CALL: 
         {
+          if (coroutine_deadline_passed(co)) {
+            fluffyvm_set_errmsg(vm, vm->staticStrings.deadlineExceeded);
+            goto error;
+          }
+
           int B = ins.B;
           
           int C = 0;
@@ -488,42 +730,38 @@ int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
           if (!coroutine_function_prolog(vm, closure))
             goto error;
           
+          struct fluffyvm_call_state* newCallState = co->currentCallState;
+          newCallState->expectedRetCount = B == 1 ? -1 : returnCount;
+
           // Copying the arguments
           if (D == 1)
             argsEnd = callState->sp - 1;
 
           for (int i = argsStart; i <= argsEnd; i++)
-            if (!interpreter_push(vm, co->currentCallState, callState->generalStack[i]))
+            if (!interpreter_push(vm, newCallState, callState->generalStack[i]))
               goto call_error;
-
-          // Actually executing
-          callState->pc = pc;
-          int actualRetCount = interpreter_exec(vm, co);
           
           for (int i = argsStart; i <= argsEnd; i++)
             if (!interpreter_pop(vm, callState, NULL, NULL))
               abort();
           
-          // Copying the return values
-          if (B == 1)
-            returnCount = co->currentCallState->sp;
-          
-          int startPos = co->currentCallState->sp - actualRetCount;
-          if (startPos < 0)
-            startPos = 0;
+          callState->pc = pc;
           
-          for (int i = 0; i < returnCount; i++) {
-            struct value val = value_nil;
-
-            // Copy only if current pos is valid
-            if (startPos + i <= co->currentCallState->sp - 1)
-              val = co->currentCallState->generalStack[startPos + i];
-
-            if (!interpreter_push(vm, callState, val))
-              goto call_error;
+          // Bytecode function run in this loop
+          // Preempting here continue from the
+          // callee's first instruction
+          if (!closure->isNative) {
+            if (chargeBudget(co, 1))
+              return FLUFFYVM_INTERPRETER_YIELDED;
+            goto load_function;
           }
 
-          coroutine_function_epilog(vm);
+          int actualRetCount = callNative(vm, co, newCallState);
+          if (actualRetCount == FLUFFYVM_INTERPRETER_YIELDED)
+            return FLUFFYVM_INTERPRETER_YIELDED;
+          
+          if (!finishCall(vm, co, actualRetCount))
+            goto error;
           break;
 
           call_error:
@@ -564,7 +802,14 @@ int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
 
   done_function:
   callState->pc = pc;
-  return retCount;
+  if (callState == base)
+    return retCount;
+  
+  // Return to the caller which is in this loop
+  if (!finishCall(vm, co, retCount))
+    goto error_no_pc;
+  skipCall = true;
+  goto load_function;
 
   illegal_instruction:
   if (ins.opcode < FLUFFYVM_OPCODE_LAST) 
@@ -573,6 +818,7 @@ int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
     fluffyvm_set_errmsg_printf(vm, "illegal instruction 0x%016" PRIX64 " (Op: 0x%02X  Cond: 0x%02X  A: 0x%04X  B: 0x%04X  C: 0x%04X)", instructionsArray[pc], ins.opcode, ins.condFlags, ins.A, ins.B, ins.C);
   error:
   callState->pc = pc;
+  error_no_pc:
   interpreter_error(vm, fluffyvm_get_errmsg(vm));
   
   // Can't be reached
@@ -21,9 +21,22 @@
 #define FLUFFYVM_INTERPRETER_FLAG_EQUAL     (1 << 0)
 #define FLUFFYVM_INTERPRETER_FLAG_LESS      (1 << 1)
 
+// Returned when coroutine yielded
+#define FLUFFYVM_INTERPRETER_YIELDED (-1)
+
+// Execute current function of the coroutine
+// Calls from bytecode to bytecode dont recurse 
+// on C stack, only native functions does
+//
 // Number of values returned
 int interpreter_exec(struct fluffyvm* vm, struct fluffyvm_coroutine* co);
 
+// Start or continue coroutine from where it 
+// was suspended. Return number of values 
+// returned by coroutine's function or 
+// FLUFFYVM_INTERPRETER_YIELDED
+int interpreter_resume(struct fluffyvm* vm, struct fluffyvm_coroutine* co);
+
 void interpreter_function_epilog(struct fluffyvm* vm, struct fluffyvm_coroutine* co);
 
 // Sets errmsg on error
@@ -31,6 +44,12 @@ bool interpreter_pop(struct fluffyvm* vm, struct fluffyvm_call_state* callState,
 bool interpreter_push(struct fluffyvm* vm, struct fluffyvm_call_state* callState, struct value value);
 bool interpreter_peek(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index, struct value* result); 
 
+// Move top `count` values of `from` onto `to`
+// keeping their order, in one go without
+// rooting each value. For passing values
+// between coroutines (e.g. resume and yield)
+bool interpreter_xmove(struct fluffyvm* vm, struct fluffyvm_call_state* from, struct fluffyvm_call_state* to, int count);
+
 // Remove at `index` until `index - (count - 1)`
 // Very broken do not use
 //bool interpreter_remove(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index, int count);
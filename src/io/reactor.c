@@ -0,0 +1,429 @@
+#define FLUFFYVM_INTERNAL
+
+#include <Block.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "../closure.h"
+#include "../coroutine.h"
+#include "../interpreter.h"
+#include "../native_module.h"
+#include "../scheduler/scheduler.h"
+#include "reactor.h"
+
+#define MAX_EVENTS (64)
+
+typedef enum {
+  WAITER_WAITING,
+  WAITER_FIRED,
+  WAITER_CANCELLED
+} waiter_state_t;
+
+// Freed by waiting coroutine once fired, if it
+// cancelled (timed out) the reactor free it
+// because an event may already be in flight
+struct waiter {
+  struct scheduler_task* task;
+  volatile atomic_int state;
+  struct waiter* nextRetired;
+};
+
+static void freeRetired(struct reactor* this) {
+  pthread_mutex_lock(&this->retiredLock);
+  struct waiter* waiter = this->retired;
+  this->retired = NULL;
+  pthread_mutex_unlock(&this->retiredLock);
+
+  while (waiter) {
+    struct waiter* next = waiter->nextRetired;
+    free(waiter);
+    waiter = next;
+  }
+}
+
+static void reactorLoop(struct reactor* this) {
+  struct epoll_event events[MAX_EVENTS];
+
+  while (!this->shuttingDown) {
+    // Safe here, their fd already removed from
+    // epoll and previous batch fully processed
+    freeRetired(this);
+
+    int count = epoll_wait(this->epollFd, events, MAX_EVENTS, -1);
+    if (count < 0)
+      continue;
+
+    for (int i = 0; i < count; i++) {
+      struct waiter* waiter = events[i].data.ptr;
+      if (!waiter) {
+        uint64_t tmp;
+        read(this->wakeFd, &tmp, sizeof(tmp));
+        continue;
+      }
+
+      // Read the task first, the waiter may
+      // be gone as soon its fired
+      struct scheduler_task* task = waiter->task;
+      int expect = WAITER_WAITING;
+      if (atomic_compare_exchange_strong(&waiter->state, &expect, WAITER_FIRED)) {
+        scheduler_wake(task);
+        scheduler_task_release(task);
+      }
+    }
+  }
+}
+
+struct reactor* reactor_new(struct fluffyvm* vm, struct scheduler* scheduler) {
+  struct reactor* this = malloc(sizeof(*this));
+  if (!this) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+
+  this->vm = vm;
+  atomic_fetch_add(&vm->liveSchedulers, 1);
+  this->scheduler = scheduler;
+  this->hasStarted = false;
+  this->shuttingDown = false;
+  this->retired = NULL;
+  pthread_mutex_init(&this->retiredLock, NULL);
+  this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  this->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (this->epollFd < 0 || this->wakeFd < 0)
+    goto error;
+
+  struct epoll_event event = {
+    .events = EPOLLIN,
+    .data.ptr = NULL
+  };
+  if (epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->wakeFd, &event) < 0)
+    goto error;
+
+  fluffyvm_thread_routine_t routine = ^void* (void* args) {
+    reactorLoop(this);
+    return NULL;
+  };
+
+  if (!fluffyvm_start_thread(vm, &this->thread, NULL, Block_copy(routine), NULL))
+    goto error_errmsg_set;
+  this->hasStarted = true;
+  return this;
+
+  error:
+  fluffyvm_set_errmsg_printf(vm, "reactor: %s", strerror(errno));
+  error_errmsg_set:
+  reactor_free(this);
+  return NULL;
+}
+
+void reactor_free(struct reactor* this) {
+  if (this->hasStarted) {
+    this->shuttingDown = true;
+    uint64_t one = 1;
+    write(this->wakeFd, &one, sizeof(one));
+    pthread_join(this->thread, NULL);
+  }
+
+  if (this->epollFd >= 0)
+    close(this->epollFd);
+  if (this->wakeFd >= 0)
+    close(this->wakeFd);
+
+  freeRetired(this);
+  pthread_mutex_destroy(&this->retiredLock);
+  atomic_fetch_sub(&this->vm->liveSchedulers, 1);
+  free(this);
+}
+
+bool reactor_set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0)
+    return false;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+// Wait until `fd` ready for `events` or `timeout`
+// miliseconds passed (negative for no timeout)
+// Return false on error (errno set, ETIMEDOUT
+// on timeout)
+static bool waitFd(struct reactor* this, int fd, uint32_t events, int timeout) {
+  struct scheduler_task* task = scheduler_get_suspendable_task(this->scheduler);
+  if (!task) {
+    struct pollfd pollFd = {
+      .fd = fd,
+      .events = (events & EPOLLIN ? POLLIN : 0) | (events & EPOLLOUT ? POLLOUT : 0)
+    };
+
+    int res;
+    while ((res = poll(&pollFd, 1, timeout)) < 0 && errno == EINTR)
+      ;
+    if (res == 0)
+      errno = ETIMEDOUT;
+    return res > 0;
+  }
+
+  struct waiter* waiter = malloc(sizeof(*waiter));
+  if (!waiter) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  waiter->task = task;
+  waiter->nextRetired = NULL;
+  atomic_init(&waiter->state, WAITER_WAITING);
+
+  // Released by reactor thread when fired
+  atomic_fetch_add(&task->refCount, 1);
+
+  struct epoll_event event = {
+    .events = events | EPOLLONESHOT,
+    .data.ptr = waiter
+  };
+  if (epoll_ctl(this->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    int err = errno;
+    scheduler_task_release(task);
+    free(waiter);
+    errno = err;
+
+    // Regular files cant be polled and
+    // are always ready anyway
+    return err == EPERM;
+  }
+
+  struct scheduler_timer* timer = NULL;
+  int err = ETIMEDOUT;
+  if (timeout >= 0 && !(timer = scheduler_timer_start(this->scheduler, timeout))) {
+    err = ENOMEM;
+    goto cancel;
+  }
+
+  // Can be woken by something else
+  while (atomic_load(&waiter->state) == WAITER_WAITING && !(timer && scheduler_timer_has_fired(timer)))
+    scheduler_suspend(this->scheduler);
+
+  if (timer)
+    scheduler_timer_stop(timer);
+
+  cancel:;
+  int expect = WAITER_WAITING;
+  bool cancelled = atomic_compare_exchange_strong(&waiter->state, &expect, WAITER_CANCELLED);
+  epoll_ctl(this->epollFd, EPOLL_CTL_DEL, fd, NULL);
+
+  if (!cancelled) {
+    free(waiter);
+    return true;
+  }
+
+  scheduler_task_release(task);
+  pthread_mutex_lock(&this->retiredLock);
+  waiter->nextRetired = this->retired;
+  this->retired = waiter;
+  pthread_mutex_unlock(&this->retiredLock);
+
+  errno = err;
+  return false;
+}
+
+static bool shouldWait(int err) {
+  return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+ssize_t reactor_read(struct reactor* this, int fd, void* buffer, size_t len, int timeout) {
+  while (true) {
+    ssize_t res = read(fd, buffer, len);
+    if (res >= 0)
+      return res;
+
+    if (errno == EINTR)
+      continue;
+    if (!shouldWait(errno) || !waitFd(this, fd, EPOLLIN, timeout))
+      return -1;
+  }
+}
+
+ssize_t reactor_write(struct reactor* this, int fd, const void* buffer, size_t len, int timeout) {
+  while (true) {
+    ssize_t res = write(fd, buffer, len);
+    if (res >= 0)
+      return res;
+
+    if (errno == EINTR)
+      continue;
+    if (!shouldWait(errno) || !waitFd(this, fd, EPOLLOUT, timeout))
+      return -1;
+  }
+}
+
+int reactor_accept(struct reactor* this, int fd, int timeout) {
+  while (true) {
+    int res = accept(fd, NULL, NULL);
+    if (res >= 0) {
+      fcntl(res, F_SETFD, FD_CLOEXEC);
+      if (!reactor_set_nonblocking(res)) {
+        int err = errno;
+        close(res);
+        errno = err;
+        return -1;
+      }
+      return res;
+    }
+
+    if (errno == EINTR || errno == ECONNABORTED)
+      continue;
+    if (!shouldWait(errno) || !waitFd(this, fd, EPOLLIN, timeout))
+      return -1;
+  }
+}
+
+bool reactor_sleep(struct reactor* this, uint64_t milisecs) {
+  if (!scheduler_get_suspendable_task(this->scheduler)) {
+    struct timespec duration = {
+      .tv_sec = milisecs / 1000,
+      .tv_nsec = (milisecs % 1000) * 1000000
+    };
+
+    while (nanosleep(&duration, &duration) < 0)
+      if (errno != EINTR)
+        return false;
+    return true;
+  }
+
+  struct scheduler_timer* timer = scheduler_timer_start(this->scheduler, milisecs);
+  if (!timer) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  while (!scheduler_timer_has_fired(timer))
+    scheduler_suspend(this->scheduler);
+  scheduler_timer_stop(timer);
+  return true;
+}
+
+////////////////////////////////////////
+// Script functions                   //
+////////////////////////////////////////
+
+static int optTimeout(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index) {
+  if (index > interpreter_get_top(vm, callState))
+    return -1;
+
+  struct value val;
+  interpreter_peek(vm, callState, index, &val);
+  if (val.type == FLUFFYVM_TVALUE_NIL)
+    return -1;
+  return native_module_check_integer(vm, callState, index);
+}
+
+// Push nil and strerror(errno)
+static int pushErrno(struct fluffyvm* vm, struct fluffyvm_call_state* callState) {
+  const char* msg = strerror(errno);
+
+  foxgc_root_reference_t* tmpRootRef = NULL;
+  struct value string = value_new_string(vm, msg, &tmpRootRef);
+  if (string.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+
+  bool res = interpreter_push(vm, callState, value_nil) &&
+             interpreter_push(vm, callState, string);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmpRootRef);
+  if (!res)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return 2;
+}
+
+static int pushInteger(struct fluffyvm* vm, struct fluffyvm_call_state* callState, fluffyvm_integer integer) {
+  if (!interpreter_push(vm, callState, value_new_long(vm, integer)))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return 1;
+}
+
+// read(fd, maxLen, [timeout])
+static int scriptRead(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  int fd = native_module_check_integer(vm, callState, 0);
+  fluffyvm_integer len = native_module_check_integer(vm, callState, 1);
+  int timeout = optTimeout(vm, callState, 2);
+  if (len < 0)
+    interpreter_error(vm, vm->staticStrings.expectNonNegative);
+
+  char* buffer = malloc(len > 0 ? len : 1);
+  if (!buffer)
+    interpreter_error(vm, vm->staticStrings.outOfMemory);
+
+  ssize_t res = reactor_read(udata, fd, buffer, len, timeout);
+  if (res < 0) {
+    free(buffer);
+    return pushErrno(vm, callState);
+  }
+
+  foxgc_root_reference_t* tmpRootRef = NULL;
+  struct value string = value_new_string2(vm, buffer, res, &tmpRootRef);
+  free(buffer);
+  if (string.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+
+  bool pushed = interpreter_push(vm, callState, string);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmpRootRef);
+  if (!pushed)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return 1;
+}
+
+// write(fd, string, [timeout])
+static int scriptWrite(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  int fd = native_module_check_integer(vm, callState, 0);
+  struct value string = native_module_check_string(vm, callState, 1);
+  int timeout = optTimeout(vm, callState, 2);
+
+  // The string is referenced by the stack
+  // so it stays alive while suspended
+  ssize_t res = reactor_write(udata, fd, value_get_string(string), value_get_len(string), timeout);
+  if (res < 0)
+    return pushErrno(vm, callState);
+  return pushInteger(vm, callState, res);
+}
+
+// accept(fd, [timeout])
+static int scriptAccept(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  int res = reactor_accept(udata, native_module_check_integer(vm, callState, 0), optTimeout(vm, callState, 1));
+  if (res < 0)
+    return pushErrno(vm, callState);
+  return pushInteger(vm, callState, res);
+}
+
+// sleep(milisecs)
+static int scriptSleep(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  fluffyvm_integer milisecs = native_module_check_integer(vm, callState, 0);
+  if (milisecs < 0)
+    interpreter_error(vm, vm->staticStrings.expectNonNegative);
+
+  if (!reactor_sleep(udata, milisecs))
+    return pushErrno(vm, callState);
+  return 0;
+}
+
+// setnonblocking(fd)
+static int scriptSetNonblocking(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  if (!reactor_set_nonblocking(native_module_check_integer(vm, callState, 0)))
+    return pushErrno(vm, callState);
+  return 0;
+}
+
+// Waiting ones suspend in the middle of
+// their C frames so need a fiber
+bool reactor_install(struct reactor* this, struct value table) {
+  return native_module_add_function2(this->vm, table, "reactor", "read", scriptRead, this, true) &&
+         native_module_add_function2(this->vm, table, "reactor", "write", scriptWrite, this, true) &&
+         native_module_add_function2(this->vm, table, "reactor", "accept", scriptAccept, this, true) &&
+         native_module_add_function2(this->vm, table, "reactor", "sleep", scriptSleep, this, true) &&
+         native_module_add_function(this->vm, table, "reactor", "setnonblocking", scriptSetNonblocking, this);
+}
+
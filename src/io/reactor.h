@@ -0,0 +1,79 @@
+#ifndef header_1655201432_io_reactor_h
+#define header_1655201432_io_reactor_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../fluffyvm.h"
+#include "../value.h"
+
+// Epoll based reactor which suspend
+// scheduled coroutines on I/O instead
+// of blocking the worker thread
+//
+// The suspending functions must be called
+// from native function running on a fiber
+// (see `closure_set_need_fiber`) inside
+// a scheduled coroutine. Everywhere
+// else they simply block the caller thread
+//
+// Readiness based so the fds should be
+// nonblocking. Regular files are always
+// "ready" for epoll so those still block
+
+struct scheduler;
+struct waiter;
+
+struct reactor {
+  struct fluffyvm* vm;
+  struct scheduler* scheduler;
+
+  int epollFd;
+  // eventfd to wake reactor thread
+  int wakeFd;
+
+  // Cancelled waiters to be freed
+  pthread_mutex_t retiredLock;
+  struct waiter* retired;
+
+  pthread_t thread;
+  bool hasStarted;
+  volatile atomic_bool shuttingDown;
+};
+
+// Return NULL on error (errmsg set)
+struct reactor* reactor_new(struct fluffyvm* vm, struct scheduler* scheduler);
+
+// Coroutines still waiting wont be woken
+// so free the scheduler first
+void reactor_free(struct reactor* this);
+
+// These behave like their syscall
+// counterpart (-1 and errno on error)
+// Only one coroutine can wait on a fd
+// at a time (EEXIST otherwise)
+//
+// `timeout` in miliseconds, negative for
+// none. Fails with ETIMEDOUT when passed
+ssize_t reactor_read(struct reactor* this, int fd, void* buffer, size_t len, int timeout);
+ssize_t reactor_write(struct reactor* this, int fd, const void* buffer, size_t len, int timeout);
+
+// Accepted fd is nonblocking
+int reactor_accept(struct reactor* this, int fd, int timeout);
+
+bool reactor_sleep(struct reactor* this, uint64_t milisecs);
+
+bool reactor_set_nonblocking(int fd);
+
+// Add `read`, `write`, `accept`, `sleep`
+// and `setnonblocking` to `table` for
+// scripts. I/O errors returned as
+// nil and error message, read, write and
+// accept take optional timeout
+bool reactor_install(struct reactor* this, struct value table);
+
+#endif
+
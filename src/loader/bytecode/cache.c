@@ -0,0 +1,92 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../fluffyvm.h"
+#include "../../hashing.h"
+#include "../../util/util.h"
+#include "cache.h"
+#include "image.h"
+
+static bool writeAll(int fd, const uint8_t* data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0)
+      return false;
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+// Best effort, failures just mean
+// the next start parse again
+static void writeEntry(struct fluffyvm* vm, const char* cacheDir, const char* path, struct fluffyvm_bytecode* bytecode, uint64_t hash) {
+  void* image = NULL;
+  size_t len = 0;
+  char* tmpPath = NULL;
+  int fd = -1;
+
+  if (!bytecode_loader_image_save(vm, bytecode, hash, &image, &len)) {
+    fluffyvm_clear_errmsg(vm);
+    return;
+  }
+
+  mkdir(cacheDir, 0755);
+  if (util_asprintf(&tmpPath, "%s/.%016" PRIx64 ".XXXXXX", cacheDir, hash) < 0) {
+    tmpPath = NULL;
+    goto cleanup;
+  }
+
+  fd = mkstemp(tmpPath);
+  if (fd < 0)
+    goto cleanup;
+
+  // Other processes of the fleet may
+  // run as different user
+  fchmod(fd, 0644);
+  bool res = writeAll(fd, image, len);
+  close(fd);
+
+  if (!res || rename(tmpPath, path) < 0)
+    unlink(tmpPath);
+
+  cleanup:
+  free(tmpPath);
+  free(image);
+}
+
+struct fluffyvm_bytecode* bytecode_cache_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* cacheDir, const void* source, size_t len, bytecode_cache_loader_t loader) {
+  *rootRef = NULL;
+  uint64_t hash = hashing_hash_xxhash(source, len);
+
+  char* path = NULL;
+  if (util_asprintf(&path, "%s/%016" PRIx64 ".fvmi", cacheDir, hash) < 0) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+
+  // Name alone could be stale file from
+  // other VM version or other seed, image
+  // loader also check release number
+  uint64_t entryHash;
+  if (bytecode_loader_image_peek_source_hash(path, &entryHash) && entryHash == hash) {
+    struct fluffyvm_bytecode* bytecode = bytecode_loader_image_load_shared(vm, rootRef, path);
+    if (bytecode) {
+      free(path);
+      return bytecode;
+    }
+
+    // Corrupted entry, replaced below
+    fluffyvm_clear_errmsg(vm);
+  }
+
+  struct fluffyvm_bytecode* bytecode = loader(vm, rootRef, source, len);
+  if (bytecode)
+    writeEntry(vm, cacheDir, path, bytecode, hash);
+  free(path);
+  return bytecode;
+}
+
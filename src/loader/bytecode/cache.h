@@ -0,0 +1,30 @@
+#ifndef header_1655802417_cache_h
+#define header_1655802417_cache_h
+
+#include <stddef.h>
+
+#include "../../bytecode.h"
+
+// Loaded bytecode cache on disk
+//
+// Keyed by xxHash of the source bytes, each
+// entry is an image (see image.h) named
+// after the hash. Hit maps the image back
+// in, only its header and section bounds
+// checked, no parsing, and the mapping
+// shared with other VMs in the process.
+// Miss loads the source with `loader`
+// then write the image for next time
+//
+// Entries written to temporary file then
+// renamed so concurrent processes never
+// see half written image. Failing to write
+// cache is not an error
+
+typedef struct fluffyvm_bytecode* (^bytecode_cache_loader_t)(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const void* source, size_t len);
+
+// `cacheDir` created if not exist
+struct fluffyvm_bytecode* bytecode_cache_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* cacheDir, const void* source, size_t len, bytecode_cache_loader_t loader);
+
+#endif
+
@@ -0,0 +1,731 @@
+#include <Block.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../config.h"
+#include "../../fluffyvm.h"
+#include "../../fluffyvm_types.h"
+#include "../../ref_counter.h"
+#include "../../util/binary.h"
+#include "../../value.h"
+#include "image.h"
+
+#define IMAGE_MAGIC "FVMI"
+#define IMAGE_VERSION (1)
+
+#define HEADER_SIZE (32)
+#define SECTION_ENTRY_SIZE (16)
+#define CONSTANT_SIZE (16)
+#define PROTOTYPE_SIZE (32)
+
+_Static_assert(sizeof(int) == sizeof(int32_t), "line info executed in place expect 32-bit int");
+
+enum section_type {
+  SECTION_CONSTANTS = 1,
+  SECTION_STRINGS,
+  SECTION_PROTOTYPES,
+  SECTION_CHILDREN,
+  SECTION_INSTRUCTIONS,
+  SECTION_LINE_INFO,
+
+  SECTION_COUNT
+};
+
+enum constant_type {
+  CONSTANT_STRING = 1,
+  CONSTANT_DOUBLE = 2,
+  CONSTANT_LONG = 3
+};
+
+static const size_t entrySize[SECTION_COUNT] = {
+  [SECTION_CONSTANTS] = CONSTANT_SIZE,
+  [SECTION_STRINGS] = 1,
+  [SECTION_PROTOTYPES] = PROTOTYPE_SIZE,
+  [SECTION_CHILDREN] = sizeof(uint32_t),
+  [SECTION_INSTRUCTIONS] = sizeof(fluffyvm_instruction_t),
+  [SECTION_LINE_INFO] = sizeof(int32_t)
+};
+
+struct section {
+  uint8_t* data;
+  uint32_t count;
+};
+
+// Backing store's data
+struct image {
+  uint8_t* base;
+  size_t len;
+  struct section sections[SECTION_COUNT];
+};
+
+// Fields of prototype record
+enum prototype_field {
+  PROTO_INSTRUCTIONS_START,
+  PROTO_INSTRUCTIONS_COUNT,
+  PROTO_CHILDREN_START,
+  PROTO_CHILDREN_COUNT,
+  PROTO_LINE_INFO_START,
+  PROTO_LINE_INFO_COUNT,
+  PROTO_SOURCE_FILE_START,
+  PROTO_SOURCE_FILE_LENGTH
+};
+
+bool bytecode_loader_image_init(struct fluffyvm *vm) {
+  return true;
+}
+
+void bytecode_loader_image_cleanup(struct fluffyvm *vm) {
+}
+
+static inline uint32_t prototypeField(struct section* sections, uint32_t index, enum prototype_field field) {
+  return binary_u32_little(sections[SECTION_PROTOTYPES].data + index * PROTOTYPE_SIZE + field * sizeof(uint32_t));
+}
+
+// `start` and `count` within `section`
+static inline bool inRange(struct section* section, uint64_t start, uint64_t count) {
+  return start + count <= section->count;
+}
+
+static bool parseSections(uint8_t* base, size_t len, struct section* sections) {
+  memset(sections, 0, sizeof(*sections) * SECTION_COUNT);
+
+  uint32_t sectionCount = binary_u16_little(base + 6);
+  if (binary_u64_little(base + 16) > len || HEADER_SIZE + (uint64_t) sectionCount * SECTION_ENTRY_SIZE > len)
+    return false;
+
+  for (uint32_t i = 0; i < sectionCount; i++) {
+    uint8_t* entry = base + HEADER_SIZE + i * SECTION_ENTRY_SIZE;
+    uint32_t type = binary_u32_little(entry);
+    uint32_t count = binary_u32_little(entry + 4);
+    uint64_t offset = binary_u64_little(entry + 8);
+
+    if (type == 0 || type >= SECTION_COUNT || sections[type].data)
+      return false;
+    if (offset > len || count * entrySize[type] > len - offset)
+      return false;
+
+    // Used in place so must be aligned
+    if ((uintptr_t) (base + offset) % entrySize[type] != 0)
+      return false;
+
+    sections[type].data = base + offset;
+    sections[type].count = count;
+  }
+
+  return sections[SECTION_PROTOTYPES].count > 0;
+}
+
+// Check every index before creating
+// anything so loading can't half fail
+static bool validate(struct section* sections) {
+  struct section* strings = &sections[SECTION_STRINGS];
+
+  for (uint32_t i = 0; i < sections[SECTION_CONSTANTS].count; i++) {
+    uint8_t* constant = sections[SECTION_CONSTANTS].data + i * CONSTANT_SIZE;
+    switch (constant[0]) {
+      case CONSTANT_STRING:
+        if (!inRange(strings, binary_u64_little(constant + 8), binary_u32_little(constant + 4)))
+          return false;
+        break;
+      case CONSTANT_DOUBLE:
+      case CONSTANT_LONG:
+        break;
+      default:
+        return false;
+    }
+  }
+
+  struct section* children = &sections[SECTION_CHILDREN];
+  for (uint32_t i = 0; i < sections[SECTION_PROTOTYPES].count; i++) {
+    if (!inRange(&sections[SECTION_INSTRUCTIONS], prototypeField(sections, i, PROTO_INSTRUCTIONS_START), prototypeField(sections, i, PROTO_INSTRUCTIONS_COUNT)) ||
+        !inRange(&sections[SECTION_LINE_INFO], prototypeField(sections, i, PROTO_LINE_INFO_START), prototypeField(sections, i, PROTO_LINE_INFO_COUNT)) ||
+        !inRange(strings, prototypeField(sections, i, PROTO_SOURCE_FILE_START), prototypeField(sections, i, PROTO_SOURCE_FILE_LENGTH)))
+      return false;
+
+    uint32_t childrenStart = prototypeField(sections, i, PROTO_CHILDREN_START);
+    uint32_t childrenCount = prototypeField(sections, i, PROTO_CHILDREN_COUNT);
+    if (!inRange(children, childrenStart, childrenCount))
+      return false;
+
+    // Children always come after parent
+    // which also rules out cycles
+    for (uint32_t j = 0; j < childrenCount; j++) {
+      uint32_t child = binary_u32_little(children->data + (childrenStart + j) * sizeof(uint32_t));
+      if (child <= i || child >= sections[SECTION_PROTOTYPES].count)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+static bool loadConstants(struct fluffyvm* vm, struct fluffyvm_bytecode* this, struct section* sections) {
+  for (uint32_t i = 0; i < sections[SECTION_CONSTANTS].count; i++) {
+    uint8_t* constant = sections[SECTION_CONSTANTS].data + i * CONSTANT_SIZE;
+    uint64_t data = binary_u64_little(constant + 8);
+    struct value val = value_not_present;
+    foxgc_root_reference_t* tmpRootRef = NULL;
+
+    switch (constant[0]) {
+      case CONSTANT_STRING:
+        val = value_new_string2_constant(vm, (char*) sections[SECTION_STRINGS].data + data, binary_u32_little(constant + 4), &tmpRootRef);
+        break;
+      case CONSTANT_DOUBLE: {
+        fluffyvm_number num;
+        memcpy(&num, &data, sizeof(num));
+        val = value_new_double(vm, num);
+        break;
+      }
+      case CONSTANT_LONG:
+        val = value_new_long(vm, (fluffyvm_integer) (int64_t) data);
+        break;
+    }
+
+    if (val.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+      return false;
+
+    bytecode_set_constant(vm, this, i, val);
+    if (tmpRootRef)
+      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmpRootRef);
+  }
+
+  return true;
+}
+
+static struct fluffyvm_prototype* newPrototypeFromRecord(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, struct section* sections, uint32_t index, foxgc_root_reference_t** rootRef) {
+  fluffyvm_instruction_t* instructions = (fluffyvm_instruction_t*) sections[SECTION_INSTRUCTIONS].data;
+  int* lineInfo = (int*) sections[SECTION_LINE_INFO].data;
+  foxgc_root_reference_t* sourceFileRootRef = NULL;
+  *rootRef = NULL;
+
+  const char* sourceFile = (char*) sections[SECTION_STRINGS].data + prototypeField(sections, index, PROTO_SOURCE_FILE_START);
+  struct value sourceFileString = value_new_string2_constant(vm, sourceFile, prototypeField(sections, index, PROTO_SOURCE_FILE_LENGTH), &sourceFileRootRef);
+  if (sourceFileString.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    return NULL;
+
+  // Record index is the encoded form
+  struct fluffyvm_prototype* this = bytecode_prototype_new(vm, bytecode, rootRef, (void*) (uintptr_t) index, sourceFileString,
+                                                           prototypeField(sections, index, PROTO_CHILDREN_COUNT),
+                                                           instructions ? instructions + prototypeField(sections, index, PROTO_INSTRUCTIONS_START) : NULL,
+                                                           prototypeField(sections, index, PROTO_INSTRUCTIONS_COUNT),
+                                                           lineInfo ? lineInfo + prototypeField(sections, index, PROTO_LINE_INFO_START) : NULL,
+                                                           prototypeField(sections, index, PROTO_LINE_INFO_COUNT));
+  if (sourceFileRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), sourceFileRootRef);
+  return this;
+}
+
+// Only main prototype built at load, the
+// rest on first `LOAD_PROTOTYPE` so their
+// pages never touched if unused
+static struct fluffyvm_prototype* materializePrototype(struct fluffyvm* vm, struct fluffyvm_prototype* parent, int index, foxgc_root_reference_t** rootRef) {
+  struct image* image = parent->bytecode->backingStore->data;
+  struct section* sections = image->sections;
+  uint32_t record = (uint32_t) (uintptr_t) parent->encoded;
+
+  uint32_t childrenStart = prototypeField(sections, record, PROTO_CHILDREN_START);
+  uint32_t child = binary_u32_little(sections[SECTION_CHILDREN].data + (childrenStart + index) * sizeof(uint32_t));
+  return newPrototypeFromRecord(vm, parent->bytecode, sections, child, rootRef);
+}
+
+// Check header, find sections and validate
+// them. Done once per image even if shared
+static bool checkImage(struct fluffyvm* vm, struct image* image) {
+  uint8_t* base = image->base;
+  size_t len = image->len;
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  fluffyvm_set_errmsg(vm, vm->staticStrings.unsupportedBytecode);
+  return false;
+#endif
+
+  if (len < HEADER_SIZE || memcmp(base, IMAGE_MAGIC, 4) != 0) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+    return false;
+  }
+
+  if (binary_u16_little(base + 4) != IMAGE_VERSION || binary_u32_little(base + 8) != FLUFFYVM_RELEASE_NUM) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.unsupportedBytecode);
+    return false;
+  }
+
+  if (!parseSections(base, len, image->sections) || !validate(image->sections)) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+    return false;
+  }
+  return true;
+}
+
+// Create bytecode from checked image, only
+// read from `image` so many VMs can do it
+// at once. Take `backingStore`'s reference
+// even on failure
+static struct fluffyvm_bytecode* instantiate(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, struct image* image, struct ref_counter* backingStore) {
+  struct section* sections = image->sections;
+  *rootRef = NULL;
+
+  struct fluffyvm_bytecode* this = bytecode_new(vm, rootRef, sections[SECTION_CONSTANTS].count, backingStore, materializePrototype);
+  if (!this) {
+    ref_counter_dec(backingStore);
+    return NULL;
+  }
+
+  // From here bytecode own the backing store
+  if (!loadConstants(vm, this, sections))
+    goto error;
+
+  foxgc_root_reference_t* mainPrototypeRootRef = NULL;
+  struct fluffyvm_prototype* mainPrototype = newPrototypeFromRecord(vm, this, sections, 0, &mainPrototypeRootRef);
+  if (!mainPrototype)
+    goto error;
+  bytecode_set_main_prototype(this, mainPrototype);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), mainPrototypeRootRef);
+  return this;
+
+  error:
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
+  *rootRef = NULL;
+  return NULL;
+}
+
+// Take `backingStore`'s reference even on failure
+static struct fluffyvm_bytecode* loadImage(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, struct image* image, struct ref_counter* backingStore) {
+  *rootRef = NULL;
+  if (!checkImage(vm, image)) {
+    ref_counter_dec(backingStore);
+    return NULL;
+  }
+  return instantiate(vm, rootRef, image, backingStore);
+}
+
+struct fluffyvm_bytecode* bytecode_loader_image_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const void* buffer, size_t len) {
+  *rootRef = NULL;
+
+  // malloc's alignment is enough for instructions
+  struct image* image = malloc(sizeof(*image));
+  void* copy = malloc(len > 0 ? len : 1);
+  if (!image || !copy) {
+    free(image);
+    free(copy);
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+  memcpy(copy, buffer, len);
+  image->base = copy;
+  image->len = len;
+
+  struct ref_counter* backingStore = ref_counter_new(image, Block_copy(^void (struct ref_counter* counter) {
+    struct image* image = counter->data;
+    free(image->base);
+    free(image);
+  }));
+  return loadImage(vm, rootRef, image, backingStore);
+}
+
+static int openImage(struct fluffyvm* vm, const char* path, struct stat* status) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fluffyvm_set_errmsg_printf(vm, "cannot open '%s': %s", path, strerror(errno));
+    return -1;
+  }
+
+  if (fstat(fd, status) < 0) {
+    fluffyvm_set_errmsg_printf(vm, "cannot stat '%s': %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if ((size_t) status->st_size < HEADER_SIZE) {
+    close(fd);
+    fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+    return -1;
+  }
+  return fd;
+}
+
+struct shared_image;
+static void unregisterShared(struct shared_image* entry);
+
+// Return backing store with the mapping
+// or NULL on error (errmsg set), `entry`
+// unregistered when the store released
+static struct ref_counter* mapImage(struct fluffyvm* vm, const char* path, int fd, size_t len, struct shared_image* entry) {
+  // Pages only read in when the code first
+  // runs and shared with other processes
+  // mapping the same file
+  void* mapping = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    fluffyvm_set_errmsg_printf(vm, "cannot map '%s': %s", path, strerror(errno));
+    return NULL;
+  }
+
+  struct image* image = malloc(sizeof(*image));
+  if (!image) {
+    munmap(mapping, len);
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+  image->base = mapping;
+  image->len = len;
+
+  return ref_counter_new(image, Block_copy(^void (struct ref_counter* counter) {
+    struct image* image = counter->data;
+    if (entry)
+      unregisterShared(entry);
+    munmap(image->base, image->len);
+    free(image);
+  }));
+}
+
+struct fluffyvm_bytecode* bytecode_loader_image_load_file(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* path) {
+  *rootRef = NULL;
+
+  struct stat status;
+  int fd = openImage(vm, path, &status);
+  if (fd < 0)
+    return NULL;
+
+  struct ref_counter* backingStore = mapImage(vm, path, fd, status.st_size, NULL);
+  close(fd);
+  if (!backingStore)
+    return NULL;
+  return loadImage(vm, rootRef, backingStore->data, backingStore);
+}
+
+////////////////////////////////////////
+// Shared images                      //
+////////////////////////////////////////
+
+// Same file is same inode with same size
+// and modification time, replaced files
+// (like cache entries) get new entry
+struct shared_image {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+
+  // Weak, entry removed by the backing
+  // store's finalizer when last bytecode
+  // using the image collected
+  struct ref_counter* backingStore;
+  struct shared_image* next;
+};
+
+static pthread_mutex_t sharedImagesLock = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_image* sharedImages = NULL;
+
+static inline bool isSameFile(struct shared_image* entry, struct stat* status) {
+  return entry->device == status->st_dev && entry->inode == status->st_ino && entry->size == status->st_size &&
+         entry->modified.tv_sec == status->st_mtim.tv_sec && entry->modified.tv_nsec == status->st_mtim.tv_nsec;
+}
+
+static void unregisterShared(struct shared_image* entry) {
+  pthread_mutex_lock(&sharedImagesLock);
+  struct shared_image** current = &sharedImages;
+  while (*current && *current != entry)
+    current = &(*current)->next;
+
+  // Not there if checking image failed
+  if (*current)
+    *current = entry->next;
+  pthread_mutex_unlock(&sharedImagesLock);
+  free(entry);
+}
+
+// Return retained backing store of `status`
+// or NULL, call with lock held
+static struct ref_counter* findShared(struct stat* status) {
+  for (struct shared_image* entry = sharedImages; entry; entry = entry->next) {
+    // Entry being finalized is skipped, its
+    // finalizer waits for the lock to
+    // remove it
+    if (isSameFile(entry, status) && ref_counter_inc_not_zero(entry->backingStore))
+      return entry->backingStore;
+  }
+  return NULL;
+}
+
+struct fluffyvm_bytecode* bytecode_loader_image_load_shared(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* path) {
+  *rootRef = NULL;
+
+  struct stat status;
+  int fd = openImage(vm, path, &status);
+  if (fd < 0)
+    return NULL;
+
+  pthread_mutex_lock(&sharedImagesLock);
+  struct ref_counter* backingStore = findShared(&status);
+  if (backingStore) {
+    pthread_mutex_unlock(&sharedImagesLock);
+    close(fd);
+    return instantiate(vm, rootRef, backingStore->data, backingStore);
+  }
+
+  // Failing to register only means
+  // next load maps it again
+  struct shared_image* entry = malloc(sizeof(*entry));
+
+  // Mapped and checked under the lock so
+  // concurrent first loads only do it once
+  backingStore = mapImage(vm, path, fd, status.st_size, entry);
+  close(fd);
+  if (!backingStore) {
+    pthread_mutex_unlock(&sharedImagesLock);
+    free(entry);
+    return NULL;
+  }
+
+  if (!checkImage(vm, backingStore->data)) {
+    pthread_mutex_unlock(&sharedImagesLock);
+    ref_counter_dec(backingStore);
+    return NULL;
+  }
+
+  if (entry) {
+    entry->device = status.st_dev;
+    entry->inode = status.st_ino;
+    entry->size = status.st_size;
+    entry->modified = status.st_mtim;
+    entry->backingStore = backingStore;
+    entry->next = sharedImages;
+    sharedImages = entry;
+  }
+  pthread_mutex_unlock(&sharedImagesLock);
+
+  return instantiate(vm, rootRef, backingStore->data, backingStore);
+}
+
+bool bytecode_loader_image_peek_source_hash(const char* path, uint64_t* hash) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  uint8_t header[HEADER_SIZE];
+  bool res = pread(fd, header, sizeof(header), 0) == sizeof(header) && memcmp(header, IMAGE_MAGIC, 4) == 0;
+  close(fd);
+  if (res)
+    *hash = binary_u64_little(header + 24);
+  return res;
+}
+
+////////////////////////////////////////
+// Image writer                       //
+////////////////////////////////////////
+
+static inline void put16(uint8_t* data, uint16_t val) {
+  data[0] = val;
+  data[1] = val >> 8;
+}
+
+static inline void put32(uint8_t* data, uint32_t val) {
+  put16(data, val);
+  put16(data + 2, val >> 16);
+}
+
+static inline void put64(uint8_t* data, uint64_t val) {
+  put32(data, val);
+  put32(data + 4, val >> 32);
+}
+
+
+static inline size_t sourceFileLength(struct fluffyvm_prototype* proto) {
+  if (proto->sourceFile.type != FLUFFYVM_TVALUE_STRING)
+    return 0;
+  return strlen(value_get_string(proto->sourceFile));
+}
+
+struct flat {
+  struct fluffyvm_prototype** prototypes;
+  uint32_t* childrenStart;
+  uint32_t* children;
+  uint32_t prototypeCount;
+  uint32_t childrenCount;
+};
+
+// Also materialize every lazy prototype
+// so `flatten` can't fail
+static bool countPrototypes(struct fluffyvm* vm, struct fluffyvm_prototype* proto, size_t* count) {
+  *count += 1;
+  for (size_t i = 0; i < proto->prototypes_len; i++) {
+    struct fluffyvm_prototype* child = bytecode_prototype_get_child(vm, proto, i);
+    if (!child || !countPrototypes(vm, child, count))
+      return false;
+  }
+  return true;
+}
+
+// Preorder so every child come after its parent
+static void flatten(struct fluffyvm* vm, struct flat* flat, struct fluffyvm_prototype* proto) {
+  uint32_t index = flat->prototypeCount++;
+  uint32_t start = flat->childrenCount;
+  flat->prototypes[index] = proto;
+  flat->childrenStart[index] = start;
+  flat->childrenCount += proto->prototypes_len;
+
+  for (size_t i = 0; i < proto->prototypes_len; i++) {
+    flat->children[start + i] = flat->prototypeCount;
+    flatten(vm, flat, bytecode_prototype_get_child(vm, proto, i));
+  }
+}
+
+bool bytecode_loader_image_save(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, uint64_t sourceHash, void** result, size_t* len) {
+  struct flat flat = {};
+  uint8_t* image = NULL;
+  bool res = false;
+
+  size_t prototypeCount = 0;
+  if (!countPrototypes(vm, bytecode->mainPrototype, &prototypeCount))
+    return false;
+
+  flat.prototypes = malloc(sizeof(*flat.prototypes) * prototypeCount);
+  flat.childrenStart = malloc(sizeof(*flat.childrenStart) * prototypeCount);
+  flat.children = malloc(sizeof(*flat.children) * prototypeCount);
+  if (!flat.prototypes || !flat.childrenStart || !flat.children) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    goto cleanup;
+  }
+  flatten(vm, &flat, bytecode->mainPrototype);
+
+  uint64_t counts[SECTION_COUNT] = {
+    [SECTION_CONSTANTS] = bytecode->constants_len,
+    [SECTION_PROTOTYPES] = flat.prototypeCount,
+    [SECTION_CHILDREN] = flat.childrenCount
+  };
+
+  for (size_t i = 0; i < bytecode->constants_len; i++)
+    if (bytecode->constants[i].type == FLUFFYVM_TVALUE_STRING)
+      counts[SECTION_STRINGS] += value_get_len(bytecode->constants[i]);
+
+  for (uint32_t i = 0; i < flat.prototypeCount; i++) {
+    counts[SECTION_INSTRUCTIONS] += flat.prototypes[i]->instructions_len;
+    counts[SECTION_LINE_INFO] += flat.prototypes[i]->lineInfo_len;
+    counts[SECTION_STRINGS] += sourceFileLength(flat.prototypes[i]);
+  }
+
+  // Sections with 8 bytes entries first
+  // keep the alignment simple
+  static const enum section_type layout[] = {
+    SECTION_INSTRUCTIONS,
+    SECTION_CONSTANTS,
+    SECTION_PROTOTYPES,
+    SECTION_LINE_INFO,
+    SECTION_CHILDREN,
+    SECTION_STRINGS
+  };
+
+  uint64_t offsets[SECTION_COUNT] = {};
+  uint64_t size = HEADER_SIZE + SECTION_ENTRY_SIZE * (SECTION_COUNT - 1);
+  for (size_t i = 0; i < sizeof(layout) / sizeof(layout[0]); i++) {
+    enum section_type type = layout[i];
+    if (counts[type] > UINT32_MAX) {
+      fluffyvm_set_errmsg_printf(vm, "bytecode too large for image");
+      goto cleanup;
+    }
+
+    size = (size + 7) & ~((uint64_t) 7);
+    offsets[type] = size;
+    size += counts[type] * entrySize[type];
+  }
+
+  image = calloc(1, size);
+  if (!image) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    goto cleanup;
+  }
+
+  memcpy(image, IMAGE_MAGIC, 4);
+  put16(image + 4, IMAGE_VERSION);
+  put16(image + 6, SECTION_COUNT - 1);
+  put32(image + 8, FLUFFYVM_RELEASE_NUM);
+  put64(image + 16, size);
+  put64(image + 24, sourceHash);
+  for (uint32_t type = 1; type < SECTION_COUNT; type++) {
+    uint8_t* entry = image + HEADER_SIZE + (type - 1) * SECTION_ENTRY_SIZE;
+    put32(entry, type);
+    put32(entry + 4, counts[type]);
+    put64(entry + 8, offsets[type]);
+  }
+
+  uint8_t* strings = image + offsets[SECTION_STRINGS];
+  uint32_t stringsUsed = 0;
+  for (size_t i = 0; i < bytecode->constants_len; i++) {
+    uint8_t* constant = image + offsets[SECTION_CONSTANTS] + i * CONSTANT_SIZE;
+    struct value val = bytecode->constants[i];
+
+    switch (val.type) {
+      case FLUFFYVM_TVALUE_STRING:
+        constant[0] = CONSTANT_STRING;
+        put32(constant + 4, value_get_len(val));
+        put64(constant + 8, stringsUsed);
+        memcpy(strings + stringsUsed, value_get_string(val), value_get_len(val));
+        stringsUsed += value_get_len(val);
+        break;
+      case FLUFFYVM_TVALUE_DOUBLE: {
+        uint64_t bits;
+        memcpy(&bits, &val.data.doubleData, sizeof(bits));
+        constant[0] = CONSTANT_DOUBLE;
+        put64(constant + 8, bits);
+        break;
+      }
+      case FLUFFYVM_TVALUE_LONG:
+        constant[0] = CONSTANT_LONG;
+        put64(constant + 8, (uint64_t) val.data.longNum);
+        break;
+      default:
+        fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+        goto cleanup;
+    }
+  }
+
+  uint32_t instructionsUsed = 0;
+  uint32_t lineInfoUsed = 0;
+  for (uint32_t i = 0; i < flat.prototypeCount; i++) {
+    struct fluffyvm_prototype* proto = flat.prototypes[i];
+    uint8_t* record = image + offsets[SECTION_PROTOTYPES] + i * PROTOTYPE_SIZE;
+    size_t sourceFileLen = sourceFileLength(proto);
+
+    put32(record + PROTO_INSTRUCTIONS_START * 4, instructionsUsed);
+    put32(record + PROTO_INSTRUCTIONS_COUNT * 4, proto->instructions_len);
+    put32(record + PROTO_CHILDREN_START * 4, flat.childrenStart[i]);
+    put32(record + PROTO_CHILDREN_COUNT * 4, proto->prototypes_len);
+    put32(record + PROTO_LINE_INFO_START * 4, lineInfoUsed);
+    put32(record + PROTO_LINE_INFO_COUNT * 4, proto->lineInfo_len);
+    put32(record + PROTO_SOURCE_FILE_START * 4, stringsUsed);
+    put32(record + PROTO_SOURCE_FILE_LENGTH * 4, sourceFileLen);
+
+    for (size_t j = 0; j < proto->instructions_len; j++)
+      put64(image + offsets[SECTION_INSTRUCTIONS] + (instructionsUsed + j) * sizeof(uint64_t), proto->instructions[j]);
+    for (size_t j = 0; j < proto->lineInfo_len; j++)
+      put32(image + offsets[SECTION_LINE_INFO] + (lineInfoUsed + j) * sizeof(int32_t), (uint32_t) proto->lineInfo[j]);
+    if (sourceFileLen > 0)
+      memcpy(strings + stringsUsed, value_get_string(proto->sourceFile), sourceFileLen);
+
+    instructionsUsed += proto->instructions_len;
+    lineInfoUsed += proto->lineInfo_len;
+    stringsUsed += sourceFileLen;
+  }
+
+  for (uint32_t i = 0; i < flat.childrenCount; i++)
+    put32(image + offsets[SECTION_CHILDREN] + i * sizeof(uint32_t), flat.children[i]);
+
+  *result = image;
+  *len = size;
+  image = NULL;
+  res = true;
+
+  cleanup:
+  free(image);
+  free(flat.prototypes);
+  free(flat.childrenStart);
+  free(flat.children);
+  return res;
+}
+
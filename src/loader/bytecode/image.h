@@ -0,0 +1,83 @@
+#ifndef header_1655718562_image_h
+#define header_1655718562_image_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../bytecode.h"
+
+// Native bytecode image
+// Intended for big bundles where JSON or
+// ProtoBuf decoding dominate startup time.
+// Instructions and line info are executed
+// in place from the image, only constants
+// and prototype objects get allocated and
+// nested prototypes only when first loaded
+//
+// Format (all little endian):
+//  * Header (32 bytes)
+//      u8[4] magic "FVMI"
+//      u16   format version (1)
+//      u16   number of sections
+//      u32   FLUFFYVM_RELEASE_NUM
+//      u32   reserved
+//      u64   size of whole image
+//      u64   hash of the source it converted
+//            from (see cache.h) or 0
+//  * Section table right after header,
+//    16 bytes each
+//      u32   type
+//      u32   number of entries
+//      u64   offset from image start
+//  * Sections, each type at most once
+//      1 constants     (16 bytes each)
+//          u8    type (1 string, 2 double, 3 long)
+//          u8[3] reserved
+//          u32   string length
+//          u64   string offset into string blob,
+//                or the integer, or double's bits
+//      2 string blob   (1 byte each)
+//      3 prototypes    (32 bytes each, first one
+//                      is the main prototype)
+//          u32   first instruction, count
+//          u32   first child, count
+//          u32   first line info, count
+//          u32   source file offset, length
+//      4 children      (u32 prototype index each)
+//      5 instructions  (u64 each, 8 bytes aligned)
+//      6 line info     (i32 each, 4 bytes aligned)
+//
+// Limitations:
+//  * Only on little endian hosts
+
+bool bytecode_loader_image_init(struct fluffyvm *vm);
+void bytecode_loader_image_cleanup(struct fluffyvm *vm);
+
+// Copy `buffer` once, caller may free it after
+struct fluffyvm_bytecode* bytecode_loader_image_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const void* buffer, size_t len);
+
+// Map the file read only, the mapping
+// stays until bytecode collected
+struct fluffyvm_bytecode* bytecode_loader_image_load_file(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* path);
+
+// Same as `bytecode_loader_image_load_file`
+// but the mapping shared by every VM in the
+// process loading the same file. Image is
+// checked once and its instructions, line
+// info and strings executed and read in
+// place by all of them, each VM only pays
+// for its own prototype and constant objects
+// Unmapped once no bytecode uses it
+struct fluffyvm_bytecode* bytecode_loader_image_load_shared(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* path);
+
+// Read only the header of image at `path`
+// Return false if its not an image
+bool bytecode_loader_image_peek_source_hash(const char* path, uint64_t* hash);
+
+// Serialize `bytecode` into new malloc'ed
+// buffer for converting other formats
+// to image ahead of time
+bool bytecode_loader_image_save(struct fluffyvm* vm, struct fluffyvm_bytecode* bytecode, uint64_t sourceHash, void** result, size_t* len);
+
+#endif
+
@@ -1,394 +1,730 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
-#include <pthread.h>
 #include <string.h>
 
 #include "../../fluffyvm.h"
-#include "../../format/bytecode.pb-c.h"
-#include "../../parser/cjson.h"
 #include "../../fluffyvm_types.h"
+#include "../../value.h"
 #include "json.h"
 
-// cJSON not fully thread safe and
-// i dont want read list of the part
-// that not thread safe
-static pthread_mutex_t cjson_lock = PTHREAD_MUTEX_INITIALIZER;
-
 bool bytecode_loader_json_init(struct fluffyvm *vm) {
   return true;
 }
 void bytecode_loader_json_cleanup(struct fluffyvm *vm) {
 }
 
+// Deeper than any real bytecode, only there
+// so bad input cant overflow the stack
+#define MAX_DEPTH 256
+
 ////////////////////////////////////////
-// JSON loader                        //
+// Tokenizer                          //
 ////////////////////////////////////////
 
-static bool validatePrototype(struct fluffyvm* vm, const char** errorMessage, struct value* errorMessage2, cJSON* prototype) {
-  if (!cJSON_IsObject(prototype)) {
-    *errorMessage = "prototype is not object";
-    return false;
+// Not on top of nxjson, it parses into a
+// tree in place (needs writable copy of
+// the input, a node for every value and
+// another walk over it) and its strings
+// only null terminated so constants with
+// "\u0000" would be cut short
+
+// Everything per call so loads on
+// different threads dont share state
+struct parser {
+  struct fluffyvm* vm;
+  struct fluffyvm_bytecode* bytecode;
+
+  const char* start;
+  const char* pos;
+  const char* end;
+  int depth;
+
+  // Strings with escapes unescaped here,
+  // valid until next string parsed
+  char* scratch;
+  size_t scratchLen;
+  size_t scratchCapacity;
+};
+
+struct vector {
+  void* data;
+  size_t count;
+  size_t capacity;
+};
+
+struct number {
+  bool isInteger;
+  int64_t integer;
+  double number;
+};
+
+static void* vectorPush(struct vector* this, size_t elementSize) {
+  if (this->count == this->capacity) {
+    size_t capacity = this->capacity > 0 ? this->capacity * 2 : 16;
+    void* tmp = realloc(this->data, capacity * elementSize);
+    if (!tmp)
+      return NULL;
+    this->data = tmp;
+    this->capacity = capacity;
   }
 
-  cJSON* prototypes = cJSON_GetObjectItem(prototype, "prototypes");
-  cJSON* instructions = cJSON_GetObjectItem(prototype, "instructions");
-  cJSON* lineInfo = cJSON_GetObjectItem(prototype, "lineInfo");
-  cJSON* sourceFile = cJSON_GetObjectItem(prototype, "sourceFile");
-  
-  if (!cJSON_IsString(sourceFile)) { 
-    *errorMessage = "prototype.sourceFile is not array";
-    return false;
-  }
-  
-  if (!cJSON_IsArray(prototypes)) { 
-    *errorMessage = "prototype.prototypes is not array";
+  return (char*) this->data + (this->count++) * elementSize;
+}
+
+static bool fail(struct parser* p, const char* reason) {
+  fluffyvm_set_errmsg_printf(p->vm, "%s at byte %zu", reason, (size_t) (p->pos - p->start));
+  return false;
+}
+
+static bool noMemory(struct parser* p) {
+  fluffyvm_set_errmsg(p->vm, p->vm->staticStrings.outOfMemory);
+  return false;
+}
+
+// Skip whitespace and return next
+// character or 0 at the end
+static char peek(struct parser* p) {
+  while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r'))
+    p->pos++;
+  return p->pos < p->end ? *p->pos : '\0';
+}
+
+static bool consume(struct parser* p, char c) {
+  if (peek(p) != c)
     return false;
+  p->pos++;
+  return true;
+}
+
+static inline bool isDigit(struct parser* p) {
+  return p->pos < p->end && *p->pos >= '0' && *p->pos <= '9';
+}
+
+static bool appendScratch(struct parser* p, const char* data, size_t len) {
+  if (p->scratchLen + len > p->scratchCapacity) {
+    size_t capacity = p->scratchCapacity > 0 ? p->scratchCapacity : 64;
+    while (capacity < p->scratchLen + len)
+      capacity *= 2;
+
+    char* tmp = realloc(p->scratch, capacity);
+    if (!tmp)
+      return noMemory(p);
+    p->scratch = tmp;
+    p->scratchCapacity = capacity;
   }
-  
-  if (!cJSON_IsArray(instructions)) { 
-    *errorMessage = "prototype.instructions is not array";
-    return false;
+
+  memcpy(p->scratch + p->scratchLen, data, len);
+  p->scratchLen += len;
+  return true;
+}
+
+static bool parseHex4(struct parser* p, uint32_t* result) {
+  if (p->end - p->pos < 4)
+    return fail(p, "truncated unicode escape");
+
+  *result = 0;
+  for (int i = 0; i < 4; i++, p->pos++) {
+    char c = *p->pos;
+    uint32_t digit;
+    if (c >= '0' && c <= '9')
+      digit = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      digit = c - 'A' + 10;
+    else
+      return fail(p, "invalid unicode escape");
+    *result = (*result << 4) | digit;
   }
-  
-  if (!cJSON_IsArray(lineInfo)) { 
-    *errorMessage = "prototype.lineInfo is not array";
-    return false;
+  return true;
+}
+
+static bool appendCodepoint(struct parser* p, uint32_t cp) {
+  char buf[4];
+  size_t len;
+  if (cp < 0x80) {
+    buf[0] = (char) cp;
+    len = 1;
+  } else if (cp < 0x800) {
+    buf[0] = (char) (0xC0 | (cp >> 6));
+    buf[1] = (char) (0x80 | (cp & 0x3F));
+    len = 2;
+  } else if (cp < 0x10000) {
+    buf[0] = (char) (0xE0 | (cp >> 12));
+    buf[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    buf[2] = (char) (0x80 | (cp & 0x3F));
+    len = 3;
+  } else {
+    buf[0] = (char) (0xF0 | (cp >> 18));
+    buf[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+    buf[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    buf[3] = (char) (0x80 | (cp & 0x3F));
+    len = 4;
   }
-  
-  int arrayLen = cJSON_GetArraySize(instructions);
-  for (int i = 0; i < arrayLen; i++) {
-    cJSON* current = cJSON_GetArrayItem(instructions, i);
-    if (!cJSON_IsObject(current)) {
-      *errorMessage = "instruction is not object";
-      return false;
-    }
+  return appendScratch(p, buf, len);
+}
 
-    cJSON* high = cJSON_GetObjectItem(current, "high");
-    cJSON* low = cJSON_GetObjectItem(current, "low");
-    
-    if (!cJSON_IsNumber(high)) {
-      *errorMessage = "instruction.high is not number";
-      return false;
-    }
-    
-    if (!cJSON_IsNumber(low)) {
-      *errorMessage = "instruction.low is not number";
-      return false;
+static bool parseEscape(struct parser* p) {
+  // Skip the backslash
+  p->pos++;
+  if (p->pos >= p->end)
+    return fail(p, "unterminated string");
+
+  char decoded;
+  switch (*p->pos) {
+    case '"':  decoded = '"';  break;
+    case '\\': decoded = '\\'; break;
+    case '/':  decoded = '/';  break;
+    case 'b':  decoded = '\b'; break;
+    case 'f':  decoded = '\f'; break;
+    case 'n':  decoded = '\n'; break;
+    case 'r':  decoded = '\r'; break;
+    case 't':  decoded = '\t'; break;
+    case 'u': {
+      p->pos++;
+      uint32_t cp;
+      if (!parseHex4(p, &cp))
+        return false;
+
+      if (cp >= 0xDC00 && cp <= 0xDFFF)
+        return fail(p, "unpaired surrogate");
+
+      if (cp >= 0xD800 && cp <= 0xDBFF) {
+        uint32_t low;
+        if (p->end - p->pos < 2 || p->pos[0] != '\\' || p->pos[1] != 'u')
+          return fail(p, "unpaired surrogate");
+        p->pos += 2;
+        if (!parseHex4(p, &low))
+          return false;
+        if (low < 0xDC00 || low > 0xDFFF)
+          return fail(p, "unpaired surrogate");
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+      }
+      return appendCodepoint(p, cp);
     }
+    default:
+      return fail(p, "invalid escape");
+  }
 
-    double lowNum = cJSON_GetNumberValue(low);
-    double highNum = cJSON_GetNumberValue(high);
+  p->pos++;
+  return appendScratch(p, &decoded, 1);
+}
 
-    if (lowNum < 0 || lowNum > UINT32_MAX || floor(lowNum) != lowNum) {
-      *errorMessage = "instruction.low is invalid"; 
+// Result points straight into the input
+// unless the string has escapes
+static bool parseString(struct parser* p, const char** result, size_t* len) {
+  if (!consume(p, '"'))
+    return fail(p, "expect string");
+
+  const char* run = p->pos;
+  bool unescaped = false;
+  p->scratchLen = 0;
+
+  while (true) {
+    while (p->pos < p->end && *p->pos != '"' && *p->pos != '\\' && (unsigned char) *p->pos >= 0x20)
+      p->pos++;
+
+    if (p->pos >= p->end)
+      return fail(p, "unterminated string");
+    if ((unsigned char) *p->pos < 0x20)
+      return fail(p, "control character in string");
+    if (*p->pos == '"')
+      break;
+
+    unescaped = true;
+    if (!appendScratch(p, run, p->pos - run) || !parseEscape(p))
       return false;
-    } 
-    
-    if (highNum < 0 || highNum > UINT32_MAX || floor(highNum) != highNum) {
-      *errorMessage = "instruction.high is invalid"; 
-      return false;
-    } 
-  }
-  
-  arrayLen = cJSON_GetArraySize(lineInfo);
-  for (int i = 0; i < arrayLen; i++) {
-    cJSON* current = cJSON_GetArrayItem(lineInfo, i);
-    if (!cJSON_IsNumber(current)) {
-      *errorMessage = "invalid line info array";
-      return false;
-    }
+    run = p->pos;
   }
 
-  arrayLen = cJSON_GetArraySize(prototypes);
-  for (int i = 0; i < arrayLen; i++)
-    if (!validatePrototype(vm, errorMessage, errorMessage2, cJSON_GetArrayItem(prototypes, i)))
+  if (unescaped) {
+    if (!appendScratch(p, run, p->pos - run))
       return false;
+    *result = p->scratch;
+    *len = p->scratchLen;
+  } else {
+    *result = run;
+    *len = p->pos - run;
+  }
 
+  // Closing quote
+  p->pos++;
   return true;
 }
 
-static void freePrototypeProtoBuf(FluffyVmFormat__Bytecode__Prototype* prototype) {
-  if (prototype->prototypes) {
-    for (int i = 0; i < prototype->n_prototypes; i++) {
-      FluffyVmFormat__Bytecode__Prototype* current = prototype->prototypes[i]; 
-      if (current)
-        freePrototypeProtoBuf(current);
-    }
+static bool parseNumber(struct parser* p, struct number* result) {
+  peek(p);
+  const char* begin = p->pos;
+  bool negative = false;
+  if (p->pos < p->end && *p->pos == '-') {
+    negative = true;
+    p->pos++;
   }
 
-  free(prototype->lineinfo);
-  free(prototype->instructions);
-  free(prototype->prototypes);
-  free(prototype);
-}
-
-static void freeBytecodeProtoBuf(FluffyVmFormat__Bytecode__Bytecode* bytecode) {
-  if (bytecode->constants) {
-    for (int i = 0; i < bytecode->n_constants; i++)
-      free(bytecode->constants[i]);
-    free(bytecode->constants);
+  if (!isDigit(p))
+    return fail(p, "expect number");
+
+  uint64_t magnitude = 0;
+  bool isInteger = true;
+  if (*p->pos == '0') {
+    p->pos++;
+  } else {
+    for (; isDigit(p); p->pos++) {
+      unsigned int digit = *p->pos - '0';
+      if (magnitude > (UINT64_MAX - digit) / 10)
+        isInteger = false;
+      else
+        magnitude = magnitude * 10 + digit;
+    }
   }
-  
-  if (bytecode->mainprototype)
-    freePrototypeProtoBuf(bytecode->mainprototype);
-}
 
-static FluffyVmFormat__Bytecode__Prototype* loadPrototype(struct fluffyvm* vm, const char** errorMessage, struct value* errorMessage2, cJSON* prototypeJson) {
-  FluffyVmFormat__Bytecode__Prototype tmp = FLUFFY_VM_FORMAT__BYTECODE__PROTOTYPE__INIT;
-  FluffyVmFormat__Bytecode__Prototype* prototype = malloc(sizeof(FluffyVmFormat__Bytecode__Prototype));
-  if (!prototype) {
-    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
-    return NULL;
+  if (p->pos < p->end && *p->pos == '.') {
+    p->pos++;
+    isInteger = false;
+    if (!isDigit(p))
+      return fail(p, "expect digit");
+    while (isDigit(p))
+      p->pos++;
   }
-  memcpy(prototype, &tmp, sizeof(*prototype));
-  
-  cJSON* prototypes = cJSON_GetObjectItem(prototypeJson, "prototypes");
-  cJSON* instructions = cJSON_GetObjectItem(prototypeJson, "instructions");
-  cJSON* lineInfo = cJSON_GetObjectItem(prototypeJson, "lineInfo");
-  cJSON* sourceFile = cJSON_GetObjectItem(prototypeJson, "sourceFile");
- 
-  prototype->prototypes = NULL;
-  prototype->instructions = NULL; 
-  prototype->lineinfo = NULL; 
-
-  prototype->n_prototypes = cJSON_GetArraySize(prototypes);
-  prototype->prototypes = calloc(prototype->n_prototypes, sizeof(FluffyVmFormat__Bytecode__Prototype*));
-  if (prototype->prototypes == NULL) {
-    freePrototypeProtoBuf(prototype);
-    *errorMessage2 = vm->staticStrings.outOfMemory;
-    return NULL;
+
+  if (p->pos < p->end && (*p->pos == 'e' || *p->pos == 'E')) {
+    p->pos++;
+    isInteger = false;
+    if (p->pos < p->end && (*p->pos == '+' || *p->pos == '-'))
+      p->pos++;
+    if (!isDigit(p))
+      return fail(p, "expect digit");
+    while (isDigit(p))
+      p->pos++;
   }
-  
-  for (int i = 0; i < prototype->n_prototypes; i++) {
-    prototype->prototypes[i] = loadPrototype(vm, errorMessage, errorMessage2, cJSON_GetArrayItem(prototypes, i));
-    if (prototype->prototypes[i] == NULL)
-      return NULL;
+
+  if (isInteger && magnitude <= (negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX)) {
+    result->isInteger = true;
+    result->integer = negative ? (int64_t) (0 - magnitude) : (int64_t) magnitude;
+    result->number = (double) result->integer;
+    return true;
   }
 
-  prototype->n_instructions = cJSON_GetArraySize(instructions);
-  prototype->instructions = calloc(prototype->n_instructions, sizeof(uint64_t));
-  if (prototype->instructions == NULL) {
-    freePrototypeProtoBuf(prototype);
-    *errorMessage2 = vm->staticStrings.outOfMemory;
-    return NULL;
+  // Rare in bytecode so let libc do it
+  char tmp[128];
+  size_t len = p->pos - begin;
+  if (len >= sizeof(tmp))
+    return fail(p, "number too long");
+  memcpy(tmp, begin, len);
+  tmp[len] = '\0';
+
+  result->isInteger = false;
+  result->number = strtod(tmp, NULL);
+  result->integer = (int64_t) result->number;
+  return true;
+}
+
+static bool parseUint32(struct parser* p, uint32_t* result) {
+  struct number num;
+  if (!parseNumber(p, &num))
+    return false;
+
+  if (num.isInteger) {
+    if (num.integer < 0 || num.integer > UINT32_MAX)
+      return fail(p, "expect 32-bit unsigned integer");
+    *result = (uint32_t) num.integer;
+  } else {
+    if (num.number < 0 || num.number > UINT32_MAX || floor(num.number) != num.number)
+      return fail(p, "expect 32-bit unsigned integer");
+    *result = (uint32_t) num.number;
   }
+  return true;
+}
 
-  for (int i = 0; i < prototype->n_instructions; i++) {
-    cJSON* current = cJSON_GetArrayItem(instructions, i);
-    double lowDouble;
-    double highDouble;
-
-    uint64_t low = (uint64_t) (lowDouble = cJSON_GetNumberValue(cJSON_GetObjectItem(current, "low")));
-    uint64_t high = (uint64_t) (highDouble = cJSON_GetNumberValue(cJSON_GetObjectItem(current, "high")));
-    
-    prototype->instructions[i] = (high << 32) | low;
-    //printf("A: Ins: %08X %08X\n",  (uint32_t) high, (uint32_t) low);
-    //printf("   Ins: %lf %lf\n",  highDouble, lowDouble);
+static bool parseArray(struct parser* p, bool (^element)()) {
+  if (!consume(p, '['))
+    return fail(p, "expect array");
+  if (++p->depth > MAX_DEPTH)
+    return fail(p, "nested too deep");
+
+  if (!consume(p, ']')) {
+    do {
+      if (!element())
+        return false;
+    } while (consume(p, ','));
+
+    if (!consume(p, ']'))
+      return fail(p, "expect ',' or ']'");
   }
-  
-  prototype->n_lineinfo = cJSON_GetArraySize(lineInfo);
-  prototype->lineinfo = calloc(prototype->n_lineinfo, sizeof(int32_t));
-  if (prototype->lineinfo == NULL) {
-    freePrototypeProtoBuf(prototype);
-    *errorMessage2 = vm->staticStrings.outOfMemory;
-    return NULL;
+
+  p->depth--;
+  return true;
+}
+
+// `key` only valid until `member` parse
+// something else
+static bool parseObject(struct parser* p, bool (^member)(const char* key, size_t keyLen)) {
+  if (!consume(p, '{'))
+    return fail(p, "expect object");
+  if (++p->depth > MAX_DEPTH)
+    return fail(p, "nested too deep");
+
+  if (!consume(p, '}')) {
+    do {
+      const char* key;
+      size_t keyLen;
+      if (!parseString(p, &key, &keyLen))
+        return false;
+      if (!consume(p, ':'))
+        return fail(p, "expect ':'");
+      if (!member(key, keyLen))
+        return false;
+    } while (consume(p, ','));
+
+    if (!consume(p, '}'))
+      return fail(p, "expect ',' or '}'");
   }
-  
-  for (int i = 0; i < prototype->n_lineinfo; i++)
-    prototype->lineinfo[i] = (int32_t) cJSON_GetNumberValue(cJSON_GetArrayItem(lineInfo, i));
- 
-  prototype->sourcefile = (char*) cJSON_GetStringValue(sourceFile);
 
-  return prototype;
+  p->depth--;
+  return true;
 }
 
-struct fluffyvm_bytecode* bytecode_loader_json_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* buffer, size_t len) {
-  const char* errorMessage = NULL;
-  struct value errorMessage2 = value_not_present;
-  pthread_mutex_lock(&cjson_lock);
-  *rootRef = NULL;
+static inline bool isKey(const char* key, size_t keyLen, const char* expect) {
+  return strlen(expect) == keyLen && memcmp(key, expect, keyLen) == 0;
+}
 
-  // Validating JSON bytecode
-  cJSON* json = cJSON_ParseWithLength(buffer, len);
-  if (json == NULL) {
-    errorMessage = "Error parsing";
-    goto error;
-  }
+static bool skipLiteral(struct parser* p, const char* literal) {
+  size_t len = strlen(literal);
+  if ((size_t) (p->end - p->pos) < len || memcmp(p->pos, literal, len) != 0)
+    return fail(p, "unexpected character");
+  p->pos += len;
+  return true;
+}
 
-  if (!cJSON_IsObject(json)) {
-    errorMessage = "JSON not object";
-    goto error;
+static bool skipValue(struct parser* p) {
+  const char* str;
+  size_t len;
+  struct number num;
+
+  switch (peek(p)) {
+    case '{':
+      return parseObject(p, ^bool (const char* key, size_t keyLen) {
+        return skipValue(p);
+      });
+    case '[':
+      return parseArray(p, ^bool () {
+        return skipValue(p);
+      });
+    case '"':
+      return parseString(p, &str, &len);
+    case 't':
+      return skipLiteral(p, "true");
+    case 'f':
+      return skipLiteral(p, "false");
+    case 'n':
+      return skipLiteral(p, "null");
+    default:
+      return parseNumber(p, &num);
   }
+}
 
-  cJSON* constants = cJSON_GetObjectItem(json, "constants");
-  cJSON* mainPrototype = cJSON_GetObjectItem(json, "mainPrototype");
-  if (!cJSON_IsArray(constants)) { 
-    errorMessage = "root.constants is not array";
-    goto error;
-  }
-  
-  // Validate constants
-  int arrayLen = (int) cJSON_GetArraySize(constants);
-  for (int i = 0; i < arrayLen; i++) {
-    cJSON* current = cJSON_GetArrayItem(constants, i);
-    if (!cJSON_IsObject(current)) {
-      errorMessage = "invalid constant expect JSON object";
-      goto error;
+////////////////////////////////////////
+// JSON loader                        //
+////////////////////////////////////////
+
+enum constant_type {
+  CONSTANT_NONE,
+  CONSTANT_STRING,
+  CONSTANT_INTEGER,
+  CONSTANT_FLOAT
+};
+
+struct constant {
+  struct value value;
+  foxgc_root_reference_t* rootRef;
+};
+
+struct child {
+  struct fluffyvm_prototype* prototype;
+  foxgc_root_reference_t* rootRef;
+};
+
+static bool parseConstant(struct parser* p, struct constant* result) {
+  __block enum constant_type type = CONSTANT_NONE;
+  __block const char* data = NULL;
+
+  bool res = parseObject(p, ^bool (const char* key, size_t keyLen) {
+    if (isKey(key, keyLen, "type")) {
+      const char* str;
+      size_t len;
+      if (!parseString(p, &str, &len))
+        return false;
+
+      if (isKey(str, len, "string"))
+        type = CONSTANT_STRING;
+      else if (isKey(str, len, "integer"))
+        type = CONSTANT_INTEGER;
+      else if (isKey(str, len, "float"))
+        type = CONSTANT_FLOAT;
+      else
+        return fail(p, "unknown constant.type");
+      return true;
+    } else if (isKey(key, keyLen, "data")) {
+      peek(p);
+      data = p->pos;
     }
-    
-    cJSON* type = cJSON_GetObjectItem(current, "type");
-    cJSON* data = cJSON_GetObjectItem(current, "data");
-   
-    if (!cJSON_IsString(type)) {
-      errorMessage = "invalid constant.type expect string";
-      goto error;
+    return skipValue(p);
+  });
+  if (!res)
+    return false;
+
+  if (type == CONSTANT_NONE)
+    return fail(p, "constant.type missing");
+  if (!data)
+    return fail(p, "constant.data missing");
+
+  // Data may come before type so
+  // go back and decode it now
+  const char* resume = p->pos;
+  p->pos = data;
+
+  struct number num;
+  switch (type) {
+    case CONSTANT_STRING: {
+      const char* str;
+      size_t len;
+      if (!parseString(p, &str, &len))
+        return false;
+      result->value = value_new_string2_constant(p->vm, str, len, &result->rootRef);
+      if (result->value.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+        return false;
+      break;
     }
+    case CONSTANT_INTEGER:
+      if (!parseNumber(p, &num))
+        return false;
+      result->value = value_new_long(p->vm, num.isInteger ? num.integer : (fluffyvm_integer) num.number);
+      break;
+    case CONSTANT_FLOAT:
+      if (!parseNumber(p, &num))
+        return false;
+      result->value = value_new_double(p->vm, num.number);
+      break;
+    case CONSTANT_NONE:
+      break;
+  }
 
-    if (strcmp("string", cJSON_GetStringValue(type)) == 0) {
-      if (!cJSON_IsString(data)) {
-        errorMessage = "invalid constant.data expect string";
-        goto error;
-      }
-    } else if (strcmp("integer", cJSON_GetStringValue(type)) == 0 || strcmp("float", cJSON_GetStringValue(type)) == 0) {
-      if (!cJSON_IsNumber(data)) {
-        errorMessage = "invalid constant.data expect number";
-        goto error;
-      }
-    } else {
-      errorMessage = "unknown constant.type";
-      goto error;
+  p->pos = resume;
+  return true;
+}
+
+static bool parseInstruction(struct parser* p, fluffyvm_instruction_t* result) {
+  __block uint32_t high;
+  __block uint32_t low;
+  __block bool hasHigh = false;
+  __block bool hasLow = false;
+
+  bool res = parseObject(p, ^bool (const char* key, size_t keyLen) {
+    if (isKey(key, keyLen, "high"))
+      return (hasHigh = parseUint32(p, &high));
+    else if (isKey(key, keyLen, "low"))
+      return (hasLow = parseUint32(p, &low));
+    return skipValue(p);
+  });
+  if (!res)
+    return false;
+
+  if (!hasHigh)
+    return fail(p, "instruction.high missing");
+  if (!hasLow)
+    return fail(p, "instruction.low missing");
+
+  *result = ((fluffyvm_instruction_t) high << 32) | low;
+  return true;
+}
+
+// Children built as they are parsed and
+// the prototype once its closing brace
+// reached as only then its size known
+static struct fluffyvm_prototype* parsePrototype(struct parser* p, foxgc_root_reference_t** rootRef) {
+  __block struct vector children = {};
+  __block struct vector instructions = {};
+  __block struct vector lineInfo = {};
+  __block struct value sourceFile = value_not_present;
+  __block foxgc_root_reference_t* sourceFileRootRef = NULL;
+  __block bool hasPrototypes = false;
+  __block bool hasInstructions = false;
+  __block bool hasLineInfo = false;
+  struct fluffyvm_prototype* this = NULL;
+  *rootRef = NULL;
+
+  bool res = parseObject(p, ^bool (const char* key, size_t keyLen) {
+    if (isKey(key, keyLen, "prototypes")) {
+      hasPrototypes = true;
+      return parseArray(p, ^bool () {
+        struct child* child = vectorPush(&children, sizeof(*child));
+        if (!child)
+          return noMemory(p);
+        child->prototype = parsePrototype(p, &child->rootRef);
+        return child->prototype != NULL;
+      });
+    } else if (isKey(key, keyLen, "instructions")) {
+      hasInstructions = true;
+      return parseArray(p, ^bool () {
+        fluffyvm_instruction_t instruction;
+        if (!parseInstruction(p, &instruction))
+          return false;
+
+        fluffyvm_instruction_t* slot = vectorPush(&instructions, sizeof(*slot));
+        if (!slot)
+          return noMemory(p);
+        *slot = instruction;
+        return true;
+      });
+    } else if (isKey(key, keyLen, "lineInfo")) {
+      hasLineInfo = true;
+      return parseArray(p, ^bool () {
+        struct number num;
+        if (!parseNumber(p, &num))
+          return false;
+
+        int* slot = vectorPush(&lineInfo, sizeof(*slot));
+        if (!slot)
+          return noMemory(p);
+        *slot = num.isInteger ? (int) num.integer : (int) num.number;
+        return true;
+      });
+    } else if (isKey(key, keyLen, "sourceFile")) {
+      const char* str;
+      size_t len;
+      if (!parseString(p, &str, &len))
+        return false;
+
+      if (sourceFileRootRef)
+        foxgc_api_remove_from_root2(p->vm->heap, fluffyvm_get_root(p->vm), sourceFileRootRef);
+      sourceFileRootRef = NULL;
+      sourceFile = value_new_string2_constant(p->vm, str, len, &sourceFileRootRef);
+      return sourceFile.type != FLUFFYVM_TVALUE_NOT_PRESENT;
     }
+    return skipValue(p);
+  });
+  if (!res)
+    goto cleanup;
+
+  if (sourceFile.type == FLUFFYVM_TVALUE_NOT_PRESENT) {
+    fail(p, "prototype.sourceFile missing");
+    goto cleanup;
   }
-  
-  // Validate main prototype
-  if (!validatePrototype(vm, &errorMessage, &errorMessage2, mainPrototype))
-    goto error;
-
-  /*
-  // Allocate resources
-  foxgc_object_t* obj = foxgc_api_new_object(vm->heap, fluffyvm_get_root(vm), rootRef, vm->bytecodeStaticData->desc_bytecode, NULL);
-  if (obj == NULL) {
-    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
-    return NULL;
+  if (!hasPrototypes) {
+    fail(p, "prototype.prototypes missing");
+    goto cleanup;
   }
-  struct bytecode* this = foxgc_api_object_get_data(obj);
-  
-  // Actually filling in the data
-  */
-  FluffyVmFormat__Bytecode__Bytecode bytecode = FLUFFY_VM_FORMAT__BYTECODE__BYTECODE__INIT;
-  //////////////
-  // Filling  //
-  //////////////
-  
-  bytecode.constants = NULL;
-  bytecode.mainprototype = NULL;
-  bytecode.version = 1;
-  
-  bytecode.n_constants = cJSON_GetArraySize(constants);
-  bytecode.constants = calloc(bytecode.n_constants, sizeof(FluffyVmFormat__Bytecode__Constant*));
-  if (bytecode.constants == NULL) {
-    freeBytecodeProtoBuf(&bytecode);
-    errorMessage2 = vm->staticStrings.outOfMemory;
-    goto error;
+  if (!hasInstructions) {
+    fail(p, "prototype.instructions missing");
+    goto cleanup;
   }
- 
-  arrayLen = (int) cJSON_GetArraySize(constants);
-  for (int i = 0; i < arrayLen; i++) {
-    cJSON* current = cJSON_GetArrayItem(constants, i);  
-    cJSON* type = cJSON_GetObjectItem(current, "type");
-    cJSON* data = cJSON_GetObjectItem(current, "data");
-    static FluffyVmFormat__Bytecode__Constant tmp = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT__INIT;
-    FluffyVmFormat__Bytecode__Constant* constant = malloc(sizeof(FluffyVmFormat__Bytecode__Constant));
-    
-    memcpy(constant, &tmp, sizeof(*constant));
-
-    if (constant == NULL) {
-      freeBytecodeProtoBuf(&bytecode);
-      goto error;
-    }
-    
-    bytecode.constants[i] = constant;
-    constant->data_case = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT__DATA__NOT_SET;
-    constant->data_str.data = NULL;
-
-    if (strcmp("string", cJSON_GetStringValue(type)) == 0) {
-      constant->data_case = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT__DATA_DATA_STR;
-      constant->type = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT_TYPE__STRING;
-      constant->data_str.data = (uint8_t*) cJSON_GetStringValue(data);
-      constant->data_str.len = strlen((char*) constant->data_str.data);
-    } else if (strcmp("integer", cJSON_GetStringValue(type)) == 0) {
-      constant->data_case = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT__DATA_DATA_LONG_NUM;
-      constant->type = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT_TYPE__LONG;
-      constant->data_longnum = (fluffyvm_integer) cJSON_GetNumberValue(data);
-    } else if (strcmp("float", cJSON_GetStringValue(type)) == 0) {
-      constant->data_case = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT__DATA_DATA_DOUBLE_NUM;
-      constant->type = FLUFFY_VM_FORMAT__BYTECODE__CONSTANT_TYPE__DOUBLE;
-      constant->data_doublenum = (fluffyvm_number) cJSON_GetNumberValue(data);
-    }
-
-    assert(constant->data_case != FLUFFY_VM_FORMAT__BYTECODE__CONSTANT__DATA__NOT_SET);
+  if (!hasLineInfo) {
+    fail(p, "prototype.lineInfo missing");
+    goto cleanup;
   }
 
+  this = bytecode_prototype_new_copy(p->vm, p->bytecode, rootRef, NULL, sourceFile, children.count, instructions.data, instructions.count, lineInfo.data, lineInfo.count);
+  if (this)
+    for (size_t i = 0; i < children.count; i++)
+      bytecode_prototype_set_prototype(this, i, ((struct child*) children.data)[i].prototype);
 
-  bytecode.mainprototype = loadPrototype(vm, &errorMessage, &errorMessage2, mainPrototype);
-  if (bytecode.mainprototype == NULL) {
-    freeBytecodeProtoBuf(&bytecode);
-    goto error;
+  cleanup:
+  for (size_t i = 0; i < children.count; i++) {
+    struct child* child = &((struct child*) children.data)[i];
+    if (child->rootRef)
+      foxgc_api_remove_from_root2(p->vm->heap, fluffyvm_get_root(p->vm), child->rootRef);
   }
+  if (sourceFileRootRef)
+    foxgc_api_remove_from_root2(p->vm->heap, fluffyvm_get_root(p->vm), sourceFileRootRef);
 
-  //////////////
+  free(children.data);
+  free(instructions.data);
+  free(lineInfo.data);
+  return this;
+}
 
+struct fluffyvm_bytecode* bytecode_loader_json_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* buffer, size_t len) {
+  struct parser parser = {
+    .vm = vm,
+    .start = buffer,
+    .pos = buffer,
+    .end = buffer + len
+  };
+  struct parser* p = &parser;
+  __block struct vector constants = {};
+  __block struct fluffyvm_prototype* mainPrototype = NULL;
+  __block foxgc_root_reference_t* mainPrototypeRootRef = NULL;
+  __block bool hasConstants = false;
+  struct fluffyvm_bytecode* result = NULL;
+
+  // Constants count only known at the end
+  parser.bytecode = bytecode_new(vm, rootRef, 0, NULL, NULL);
+  if (!parser.bytecode)
+    return NULL;
 
-  size_t packedLen = fluffy_vm_format__bytecode__bytecode__get_packed_size(&bytecode);
-  void* data = malloc(packedLen);
-  if (data == NULL) {
-    freeBytecodeProtoBuf(&bytecode);
-    errorMessage2 = vm->staticStrings.outOfMemory;
-    goto error;
+  bool res = parseObject(p, ^bool (const char* key, size_t keyLen) {
+    if (isKey(key, keyLen, "constants")) {
+      hasConstants = true;
+      return parseArray(p, ^bool () {
+        struct constant* constant = vectorPush(&constants, sizeof(*constant));
+        if (!constant)
+          return noMemory(p);
+        constant->rootRef = NULL;
+        return parseConstant(p, constant);
+      });
+    } else if (isKey(key, keyLen, "mainPrototype")) {
+      if (mainPrototypeRootRef)
+        foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), mainPrototypeRootRef);
+      mainPrototype = parsePrototype(p, &mainPrototypeRootRef);
+      return mainPrototype != NULL;
+    }
+    return skipValue(p);
+  });
+  if (!res)
+    goto cleanup;
+
+  // Embedded bytecode may carry its
+  // null terminator
+  peek(p);
+  while (p->pos < p->end && *p->pos == '\0')
+    p->pos++;
+  if (p->pos < p->end) {
+    fail(p, "trailing data");
+    goto cleanup;
   }
-  // printf("Serializing %zu bytes\n", packedLen);
-  fluffy_vm_format__bytecode__bytecode__pack(&bytecode, data);
-  
-  //fwrite(data, 1, packedLen, stderr);
-  //fflush(stderr);
-  
-  freeBytecodeProtoBuf(&bytecode);
-  // String allocated by cJSON still being used until
-  // this point.
-  cJSON_Delete(json);
-  pthread_mutex_unlock(&cjson_lock);
-  
-  // Error will be still properly propagates to
-  // the caller
-  struct fluffyvm_bytecode* result = bytecode_load(vm, rootRef, data, packedLen);
-  free(data);
-  return result;
 
-  error:
-  if (errorMessage) {
-    foxgc_root_reference_t* ref = NULL;
-    struct value val = value_new_string(vm, errorMessage, &ref);
-    if (val.type != FLUFFYVM_TVALUE_NOT_PRESENT) {
-      fluffyvm_set_errmsg(vm, val);
-      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), ref);
-    } else {
-      fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemoryWhileAnErrorOccured);
-    }
-  } else if (errorMessage2.type != FLUFFYVM_TVALUE_NOT_PRESENT) {
-    fluffyvm_set_errmsg(vm, errorMessage2);
+  if (!hasConstants) {
+    fail(p, "root.constants missing");
+    goto cleanup;
+  }
+  if (!mainPrototype) {
+    fail(p, "root.mainPrototype missing");
+    goto cleanup;
   }
 
-  if (json) {
-    cJSON_Delete(json);
-    pthread_mutex_unlock(&cjson_lock);
+  if (!bytecode_set_constants_count(vm, parser.bytecode, constants.count))
+    goto cleanup;
+  for (size_t i = 0; i < constants.count; i++)
+    bytecode_set_constant(vm, parser.bytecode, i, ((struct constant*) constants.data)[i].value);
+  bytecode_set_main_prototype(parser.bytecode, mainPrototype);
+  result = parser.bytecode;
+
+  cleanup:
+  for (size_t i = 0; i < constants.count; i++) {
+    struct constant* constant = &((struct constant*) constants.data)[i];
+    if (constant->rootRef)
+      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), constant->rootRef);
   }
+  if (mainPrototypeRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), mainPrototypeRootRef);
+  free(constants.data);
+  free(parser.scratch);
 
-  if (*rootRef)
+  if (!result) {
     foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), *rootRef);
-  *rootRef = NULL;
-  return NULL;
-} 
-
-
+    *rootRef = NULL;
+  }
+  return result;
+}
 
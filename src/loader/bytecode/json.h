@@ -8,10 +8,11 @@ void bytecode_loader_json_cleanup(struct fluffyvm *vm);
 
 // JSON loader
 // Intended to load embedded bytecode
-// Limitations:
-//  * Bytecode cannot have strings which have
-//    embedded zeros in it
-//  * Very slow compare to other methods
+// Decoded in one pass straight into
+// prototypes without any global lock so
+// threads can load at the same time.
+// Nested prototypes built eagerly, use
+// image.h or cache.h for lazy loading
 struct fluffyvm_bytecode* bytecode_loader_json_load(struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const char* buffer, size_t len); 
 
 #endif
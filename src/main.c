@@ -9,6 +9,7 @@
 #include <Block.h>
 #include <time.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "coroutine.h"
@@ -19,6 +20,8 @@
 #include "value.h"
 #include "hashtable.h"
 #include "loader/bytecode/json.h"
+#include "loader/bytecode/image.h"
+#include "loader/bytecode/cache.h"
 #include "util/util.h"
 #include "bootloader.h"
 #include "closure.h"
@@ -51,6 +54,11 @@ static void printMemUsage(const char* msg) {
 static void* bytecodeRaw = NULL;
 static size_t bytecodeRawLen = 0;
 
+// Prefer image if present, its mapped
+// instead of read and parsed
+static const char* bytecodeImagePath = "./bytecode.fvmi";
+static bool useBytecodeImage = false;
+
 ATTRIBUTE((format(printf, 1, 2)))
 static void collectAndPrintMemUsage(const char* fmt, ...) {
   char* tmp;
@@ -227,6 +235,11 @@ int main2() {
     goto cannotCreateVm;
   }
   
+  int traceCount;
+  const struct fluffyvm_startup_trace_entry* trace = fluffyvm_get_startup_trace(F, &traceCount);
+  for (int i = 0; i < traceCount; i++)
+    printf("Init %s: %lf ms, %lf KiB heap, %lf KiB metaspace\n", trace[i].component, trace[i].nanoseconds / 1000000.0f, toKB(trace[i].heapBytes), toKB(trace[i].metaspaceBytes));
+
   collectAndPrintMemUsage("After VM creation but before test");
  
   lua_State* L = fluffyvm_get_executing_coroutine(F);
@@ -258,7 +271,13 @@ int main2() {
     lua_State* L = fluffyvm_get_executing_coroutine(F);
 
     foxgc_root_reference_t* bytecodeRootRef = NULL;
-    struct fluffyvm_bytecode* bytecode = bytecode_loader_json_load(F, &bytecodeRootRef, bytecodeRaw, bytecodeRawLen);
+    struct fluffyvm_bytecode* bytecode;
+    if (useBytecodeImage)
+      bytecode = bytecode_loader_image_load_shared(F, &bytecodeRootRef, bytecodeImagePath);
+    else
+      bytecode = bytecode_cache_load(F, &bytecodeRootRef, FLUFFYVM_BYTECODE_CACHE_DIR, bytecodeRaw, bytecodeRawLen, ^struct fluffyvm_bytecode* (struct fluffyvm* vm, foxgc_root_reference_t** rootRef, const void* source, size_t len) {
+        return bytecode_loader_json_load(vm, rootRef, source, len);
+      });
     if (!bytecode)
       goto error; 
     
@@ -299,6 +318,10 @@ int main2() {
   
   test(NULL);
 
+  struct coroutine_pool_stats poolStats;
+  coroutine_get_pool_stats(F, &poolStats);
+  printf("Coroutine pool: %d pooled (%lf KiB), %" PRIu64 " recycled, %" PRIu64 " reused\n", poolStats.count, toKB(poolStats.bytes), poolStats.recycled, poolStats.reused);
+
   /*
   pthread_t testThread;
   fluffyvm_start_thread(F, &testThread, NULL, Block_copy(test), NULL);
@@ -359,6 +382,12 @@ int main2() {
 int main() {
   int ret = 0;
 
+  if (access(bytecodeImagePath, R_OK) == 0) {
+    useBytecodeImage = true;
+    ret = main2();
+    goto do_return;
+  }
+
   // First thing first load the damn bytecode
   // first
   FILE* bytecodeFile = fopen("./bytecode.json", "r");
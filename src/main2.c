@@ -70,8 +70,8 @@ static struct value add_to_root_and_return(struct fluffyvm* F, struct value val,
 static bool stdlib_print(struct fluffyvm* F, struct fluffyvm_call_state* callState, void* udata) {
   foxgc_root_reference_t* tmpRootRef = NULL;
   struct value string;
-  fiber_yield(callState->owner->fiber);
-  fiber_yield(callState->owner->fiber);
+  coroutine_yield(F);
+  coroutine_yield(F);
   while (interpreter_pop(F, callState, &string, &tmpRootRef)) {
     printf("Printer: %.*s\n", (int) value_get_len(string), value_get_string(string));
     foxgc_api_remove_from_root2(F->heap, fluffyvm_get_root(F), tmpRootRef);
@@ -123,6 +123,7 @@ int main2() {
       struct fluffyvm_closure* printFunc = closure_from_cfunction(F, &printRootRef, stdlib_print, NULL, NULL, globalTable);
       if (!printFunc)
         goto error;
+      closure_set_need_fiber(printFunc, true);
 
       struct value printVal = value_new_closure(F, printFunc);
       struct value printString = value_new_string(F, "print", &printStringRootRef);
@@ -0,0 +1,68 @@
+#define FLUFFYVM_INTERNAL
+
+#include <stdlib.h>
+
+#include "closure.h"
+#include "fluffyvm.h"
+#include "interpreter.h"
+#include "native_module.h"
+#include "snapshot.h"
+#include "value.h"
+
+bool native_module_add_function(struct fluffyvm* vm, struct value table, const char* module, const char* name, closure_cfunction_t func, void* udata) {
+  return native_module_add_function2(vm, table, module, name, func, udata, false);
+}
+
+bool native_module_add_function2(struct fluffyvm* vm, struct value table, const char* module, const char* name, closure_cfunction_t func, void* udata, bool needFiber) {
+  foxgc_root_reference_t* funcRootRef = NULL;
+  foxgc_root_reference_t* nameRootRef = NULL;
+  bool res = false;
+
+  struct fluffyvm_closure* closure = closure_from_cfunction(vm, &funcRootRef, func, udata, NULL, table);
+  if (!closure)
+    goto error;
+  closure_set_need_fiber(closure, needFiber);
+
+  // Named so tables holding it can be
+  // saved (see snapshot.h)
+  if (!snapshot_register_native2(vm, module, name, func, udata, needFiber))
+    goto error;
+
+  struct value nameString = value_new_string(vm, name, &nameRootRef);
+  if (nameString.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    goto error;
+
+  res = value_table_set(vm, table, nameString, value_new_closure(vm, closure));
+
+  error:
+  if (funcRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), funcRootRef);
+  if (nameRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), nameRootRef);
+  return res;
+}
+
+struct value native_module_check_value(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index) {
+  struct value val;
+  if (!interpreter_peek(vm, callState, index, &val))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return val;
+}
+
+fluffyvm_integer native_module_check_integer(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index) {
+  struct value val = native_module_check_value(vm, callState, index);
+  if (val.type == FLUFFYVM_TVALUE_LONG)
+    return val.data.longNum;
+  if (val.type == FLUFFYVM_TVALUE_DOUBLE)
+    return (fluffyvm_integer) val.data.doubleData;
+
+  interpreter_error(vm, vm->staticStrings.expectInteger);
+  abort();
+}
+
+struct value native_module_check_string(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index) {
+  struct value val = native_module_check_value(vm, callState, index);
+  if (val.type != FLUFFYVM_TVALUE_STRING)
+    interpreter_error(vm, vm->staticStrings.expectString);
+  return val;
+}
@@ -0,0 +1,32 @@
+#ifndef header_1656050772_native_module_h
+#define header_1656050772_native_module_h
+
+#include <stdbool.h>
+
+#include "closure.h"
+#include "fluffyvm.h"
+#include "value.h"
+
+// Helpers for native modules installed
+// into script tables (channel.h,
+// parallel.h, io/reactor.h)
+
+// Add closure of `func` with `udata` to
+// `table` as `name`, env of the closure is
+// `table`. Also registered for snapshots
+// as "`module`.`name`" (see snapshot.h)
+// Return false on error (errmsg set)
+bool native_module_add_function(struct fluffyvm* vm, struct value table, const char* module, const char* name, closure_cfunction_t func, void* udata);
+// Same but for functions which need a fiber
+// (see `closure_set_need_fiber`)
+bool native_module_add_function2(struct fluffyvm* vm, struct value table, const char* module, const char* name, closure_cfunction_t func, void* udata, bool needFiber);
+
+// Argument checks for native functions
+// Throw script error if wrong
+struct value native_module_check_value(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index);
+// Doubles truncated
+fluffyvm_integer native_module_check_integer(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index);
+struct value native_module_check_string(struct fluffyvm* vm, struct fluffyvm_call_state* callState, int index);
+
+#endif
+
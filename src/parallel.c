@@ -0,0 +1,353 @@
+#define FLUFFYVM_INTERNAL
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "closure.h"
+#include "config.h"
+#include "coroutine.h"
+#include "fluffyvm.h"
+#include "hashtable.h"
+#include "interpreter.h"
+#include "native_module.h"
+#include "parallel.h"
+#include "thread_pool.h"
+#include "value.h"
+
+#define UNIQUE_KEY(name) static uintptr_t name = (uintptr_t) &name
+
+UNIQUE_KEY(keysArrayTypeKey);
+
+struct keys {
+  int count;
+  struct value* keys;
+  foxgc_root_reference_t* rootRef;
+};
+
+// Snapshot keys of `table`, they rooted in
+// current thread's root until `freeKeys`
+// Return false on error (errmsg set)
+static bool collectKeys(struct fluffyvm* vm, struct value table, struct keys* result) {
+  struct hashtable* hashtable = foxgc_api_object_get_data(table.data.table);
+  int capacity = 16;
+  int count = 0;
+  struct value* keys = malloc(sizeof(*keys) * capacity);
+  if (!keys)
+    goto no_memory;
+
+  struct value key = hashtable_next(vm, hashtable, value_not_present);
+  for (; key.type != FLUFFYVM_TVALUE_NOT_PRESENT; key = hashtable_next(vm, hashtable, key)) {
+    if (count == capacity) {
+      capacity *= 2;
+      struct value* tmp = realloc(keys, sizeof(*keys) * capacity);
+      if (!tmp)
+        goto no_memory;
+      keys = tmp;
+    }
+
+    keys[count++] = key;
+  }
+
+  foxgc_object_t* array = foxgc_api_new_array(vm->heap, fluffyvm_get_owner_key(), keysArrayTypeKey, NULL, fluffyvm_get_root(vm), &result->rootRef, count > 0 ? count : 1, NULL);
+  if (!array)
+    goto no_memory;
+
+  for (int i = 0; i < count; i++)
+    foxgc_api_write_array(array, i, value_get_object_ptr(keys[i]));
+
+  result->count = count;
+  result->keys = keys;
+  return true;
+
+  no_memory:
+  free(keys);
+  fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+  return false;
+}
+
+static void freeKeys(struct fluffyvm* vm, struct keys* keys) {
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), keys->rootRef);
+  free(keys->keys);
+}
+
+// Removed entries are called with nil
+static struct value getEntry(struct fluffyvm* vm, struct value table, struct value key, foxgc_root_reference_t** rootRef) {
+  struct value val = value_table_get(vm, table, key, rootRef);
+  if (val.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    return value_nil;
+  return val;
+}
+
+static bool storeResult(struct fluffyvm* vm, struct value results, struct value key, struct value val) {
+  if (results.type == FLUFFYVM_TVALUE_NOT_PRESENT || val.type == FLUFFYVM_TVALUE_NIL)
+    return true;
+  return value_table_set(vm, results, key, val);
+}
+
+// Consecutive keys run by one pool job
+struct chunk {
+  struct value table;
+  struct value func;
+  struct value* keys;
+  int start;
+  int end;
+  bool collect;
+
+  // Key `callEntry` calls fn for
+  int current;
+
+  // Where results go, not present if
+  // not collecting
+  struct value results;
+};
+
+// Base function of each call's coroutine
+static int callEntry(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  struct chunk* chunk = udata;
+  struct value key = chunk->keys[chunk->current];
+
+  foxgc_root_reference_t* valueRootRef = NULL;
+  struct value val = getEntry(vm, chunk->table, key, &valueRootRef);
+  bool pushed = interpreter_push(vm, callState, val) && interpreter_push(vm, callState, key);
+  if (valueRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), valueRootRef);
+  if (!pushed)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+
+  interpreter_call(vm, chunk->func, 2, 1);
+  if (!storeResult(vm, chunk->results, key, callState->generalStack[callState->sp - 1]))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return 0;
+}
+
+// Call fn for every key of the chunk, each in
+// its own (pooled) coroutine so an error or
+// yield in one doesnt affect the others
+// Return false with first error as errmsg
+static bool runChunkCalls(struct fluffyvm* vm, struct chunk* chunk) {
+  foxgc_root_reference_t* entryRootRef = NULL;
+  struct fluffyvm_closure* entry = closure_from_cfunction(vm, &entryRootRef, callEntry, chunk, NULL, value_nil);
+  if (!entry)
+    return false;
+
+  struct value error = value_not_present;
+  foxgc_root_reference_t* errorRootRef = NULL;
+  for (chunk->current = chunk->start; chunk->current < chunk->end; chunk->current++) {
+    foxgc_root_reference_t* coroutineRootRef = NULL;
+    struct fluffyvm_coroutine* co = coroutine_new(vm, &coroutineRootRef, entry);
+    if (co && coroutine_resume(vm, co)) {
+      coroutine_recycle(vm, co);
+      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), coroutineRootRef);
+      continue;
+    }
+
+    // Rooted so later calls (or reusing the
+    // coroutine) cant drop it
+    if (error.type == FLUFFYVM_TVALUE_NOT_PRESENT) {
+      error = co && co->hasError ? co->thrownedError : fluffyvm_get_errmsg(vm);
+      foxgc_object_t* ptr;
+      if ((ptr = value_get_object_ptr(error)))
+        foxgc_api_root_add(vm->heap, ptr, fluffyvm_get_root(vm), &errorRootRef);
+    }
+
+    if (!co)
+      break;
+    coroutine_recycle(vm, co);
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), coroutineRootRef);
+  }
+
+  bool res = error.type == FLUFFYVM_TVALUE_NOT_PRESENT;
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), entryRootRef);
+  if (!res)
+    fluffyvm_set_errmsg(vm, error);
+  if (errorRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), errorRootRef);
+  return res;
+}
+
+static struct value newResultsTable(struct fluffyvm* vm, int count, foxgc_root_reference_t** rootRef) {
+  int capacity = 16;
+  while (capacity < count)
+    capacity <<= 1;
+  return value_new_table(vm, FLUFFYVM_HASHTABLE_DEFAULT_LOAD_FACTOR, capacity, rootRef);
+}
+
+// Pool job, return chunk's results table
+// (merged by the caller) if collecting
+static int runChunk(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  struct chunk* chunk = udata;
+  foxgc_root_reference_t* resultsRootRef = NULL;
+  chunk->results = value_not_present;
+  if (chunk->collect) {
+    chunk->results = newResultsTable(vm, chunk->end - chunk->start, &resultsRootRef);
+    if (chunk->results.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+      interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  }
+
+  bool res = runChunkCalls(vm, chunk);
+  bool pushed = res && (!chunk->collect || interpreter_push(vm, callState, chunk->results));
+  if (resultsRootRef)
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), resultsRootRef);
+  if (!pushed)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return chunk->collect ? 1 : 0;
+}
+
+static bool mergeResults(struct fluffyvm* vm, struct chunk* chunk, struct value chunkResults, struct value results) {
+  for (int i = chunk->start; i < chunk->end; i++) {
+    foxgc_root_reference_t* valueRootRef = NULL;
+    struct value val = getEntry(vm, chunkResults, chunk->keys[i], &valueRootRef);
+    bool res = storeResult(vm, results, chunk->keys[i], val);
+    if (valueRootRef)
+      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), valueRootRef);
+    if (!res)
+      return false;
+  }
+  return true;
+}
+
+// Keys split in one chunk per pool thread
+// so per call overhead is only coroutine
+// switch, submit everything first then
+// wait so the threads all busy at once
+static bool runOnPool(struct fluffyvm* vm, struct value table, struct value func, struct keys* keys, struct value results) {
+  int chunkCount = vm->threadPool->threadCount;
+  if (chunkCount > keys->count)
+    chunkCount = keys->count;
+  if (chunkCount == 0)
+    return true;
+
+  struct chunk* chunks = malloc(sizeof(*chunks) * chunkCount);
+  struct fluffyvm_future** futures = malloc(sizeof(*futures) * chunkCount);
+  if (!chunks || !futures) {
+    free(chunks);
+    free(futures);
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return false;
+  }
+
+  bool res = true;
+  int submitted = 0;
+  for (; submitted < chunkCount; submitted++) {
+    struct chunk* chunk = &chunks[submitted];
+    *chunk = (struct chunk) {
+      .table = table,
+      .func = func,
+      .keys = keys->keys,
+      .start = (int) ((int64_t) keys->count * submitted / chunkCount),
+      .end = (int) ((int64_t) keys->count * (submitted + 1) / chunkCount),
+      .collect = results.type != FLUFFYVM_TVALUE_NOT_PRESENT,
+      .results = value_not_present
+    };
+
+    // Pool roots the closure itself
+    foxgc_root_reference_t* closureRootRef = NULL;
+    struct fluffyvm_closure* closure = closure_from_cfunction(vm, &closureRootRef, runChunk, chunk, NULL, value_nil);
+    if (!closure) {
+      res = false;
+      break;
+    }
+
+    futures[submitted] = fluffyvm_submit(vm, closure, 0, NULL);
+    foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), closureRootRef);
+    if (!futures[submitted]) {
+      res = false;
+      break;
+    }
+  }
+
+  // Submitted calls cant be cancelled, wait
+  // for them anyway but keep first error
+  for (int i = 0; i < submitted; i++) {
+    struct fluffyvm_future* future = futures[i];
+    if (!future_wait(future)) {
+      if (res)
+        fluffyvm_set_errmsg(vm, future_get_error(future));
+      res = false;
+    } else if (res && chunks[i].collect) {
+      res = mergeResults(vm, &chunks[i], future_get_result(future, 0), results);
+    }
+
+    future_release(future);
+  }
+
+  free(futures);
+  free(chunks);
+  return res;
+}
+
+// Whole table as one chunk on the caller
+static bool runInline(struct fluffyvm* vm, struct value table, struct value func, struct keys* keys, struct value results) {
+  struct chunk chunk = {
+    .table = table,
+    .func = func,
+    .keys = keys->keys,
+    .start = 0,
+    .end = keys->count,
+    .collect = results.type != FLUFFYVM_TVALUE_NOT_PRESENT,
+    .results = results
+  };
+  return runChunkCalls(vm, &chunk);
+}
+
+static int run(struct fluffyvm* vm, struct fluffyvm_call_state* callState, bool collect) {
+  struct value table;
+  struct value func;
+  if (!interpreter_peek(vm, callState, 0, &table) || !interpreter_peek(vm, callState, 1, &func))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  if (table.type != FLUFFYVM_TVALUE_TABLE)
+    interpreter_error(vm, vm->staticStrings.expectTable);
+  if (func.type != FLUFFYVM_TVALUE_CLOSURE)
+    interpreter_error(vm, vm->staticStrings.expectFunction);
+
+  struct keys keys;
+  if (!collectKeys(vm, table, &keys))
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+
+  struct value results = value_not_present;
+  foxgc_root_reference_t* resultsRootRef = NULL;
+  if (collect) {
+    results = newResultsTable(vm, keys.count, &resultsRootRef);
+    if (results.type == FLUFFYVM_TVALUE_NOT_PRESENT) {
+      freeKeys(vm, &keys);
+      interpreter_error(vm, fluffyvm_get_errmsg(vm));
+    }
+  }
+
+  bool res;
+  if (thread_pool_is_worker(vm))
+    res = runInline(vm, table, func, &keys, results);
+  else
+    res = runOnPool(vm, table, func, &keys, results);
+  freeKeys(vm, &keys);
+
+  if (!res) {
+    if (resultsRootRef)
+      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), resultsRootRef);
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  }
+
+  if (!collect)
+    return 0;
+
+  bool pushed = interpreter_push(vm, callState, results);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), resultsRootRef);
+  if (!pushed)
+    interpreter_error(vm, fluffyvm_get_errmsg(vm));
+  return 1;
+}
+
+// map(table, fn)
+static int scriptMap(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  return run(vm, callState, true);
+}
+
+// foreach(table, fn)
+static int scriptForeach(struct fluffyvm* vm, struct fluffyvm_call_state* callState, void* udata) {
+  return run(vm, callState, false);
+}
+
+bool parallel_install(struct fluffyvm* vm, struct value table) {
+  return native_module_add_function(vm, table, "parallel", "map", scriptMap, NULL) &&
+         native_module_add_function(vm, table, "parallel", "foreach", scriptForeach, NULL);
+}
@@ -0,0 +1,39 @@
+#ifndef header_1655631204_parallel_h
+#define header_1655631204_parallel_h
+
+#include <stdbool.h>
+
+#include "fluffyvm.h"
+#include "value.h"
+
+// Data parallel helpers for scripts
+//
+// Keys are split into one range per thread
+// of VM's thread pool (see thread_pool.h)
+// and each range is one job, the caller
+// waits until all of them done. Every call
+// runs in its own (pooled) coroutine so an
+// error or yield in one cant affect others.
+// Keys are snapshotted before the calls so
+// changing the table meanwhile is safe but
+// the calls run in no particular order
+//
+// Called from the pool's own threads they
+// run one by one on the caller instead, as
+// waiting there could deadlock the pool
+
+// Add `map` and `foreach` to `table`
+//
+// map(table, fn), call fn(value, key) for
+// each entry and return new table with fn's
+// first result under the same key
+//
+// foreach(table, fn), same but discard
+// the results
+//
+// First error raised by fn is rethrown
+// after all calls finished
+bool parallel_install(struct fluffyvm* vm, struct value table);
+
+#endif
+
@@ -18,6 +18,14 @@ void ref_counter_inc(struct ref_counter* ref) {
   assert(prev > 0);
 }
 
+bool ref_counter_inc_not_zero(struct ref_counter* ref) {
+  int prev = atomic_load(&ref->counter);
+  while (prev > 0)
+    if (atomic_compare_exchange_weak(&ref->counter, &prev, prev + 1))
+      return true;
+  return false;
+}
+
 void ref_counter_dec(struct ref_counter* ref) {
   int prev = atomic_fetch_sub(&ref->counter, 1);
   assert(prev > 0);
@@ -2,6 +2,7 @@
 #define header_1650778015_ref_counter_h
 
 #include <stdatomic.h>
+#include <stdbool.h>
 
 struct ref_counter;
 
@@ -18,5 +19,10 @@ struct ref_counter* ref_counter_new(void* data, ref_counter_finalizer finalizer)
 void ref_counter_inc(struct ref_counter* counter);
 void ref_counter_dec(struct ref_counter* counter);
 
+// Increment unless it already dropped to
+// zero (finalizer running), for weak
+// references like caches
+bool ref_counter_inc_not_zero(struct ref_counter* counter);
+
 #endif
 
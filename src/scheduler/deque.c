@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "deque.h"
+
+static struct deque_array* newArray(size_t size) {
+  struct deque_array* array = malloc(sizeof(*array) + sizeof(_Atomic(void*)) * size);
+  if (!array)
+    return NULL;
+
+  array->size = size;
+  array->prev = NULL;
+  return array;
+}
+
+bool deque_init(struct deque* this, size_t initialSize) {
+  // Size must be power of two
+  size_t size = 1;
+  while (size < initialSize)
+    size <<= 1;
+
+  struct deque_array* array = newArray(size);
+  if (!array)
+    return false;
+
+  atomic_init(&this->top, 0);
+  atomic_init(&this->bottom, 0);
+  atomic_init(&this->array, array);
+  return true;
+}
+
+void deque_cleanup(struct deque* this) {
+  // Older arrays kept until now because
+  // thieves may still reading it
+  struct deque_array* current = atomic_load(&this->array);
+  while (current) {
+    struct deque_array* prev = current->prev;
+    free(current);
+    current = prev;
+  }
+}
+
+static struct deque_array* grow(struct deque* this, struct deque_array* old, size_t top, size_t bottom) {
+  struct deque_array* array = newArray(old->size * 2);
+  if (!array)
+    return NULL;
+
+  for (size_t i = top; i < bottom; i++)
+    atomic_store_explicit(&array->items[i & (array->size - 1)], atomic_load_explicit(&old->items[i & (old->size - 1)], memory_order_relaxed), memory_order_relaxed);
+
+  array->prev = old;
+  atomic_store_explicit(&this->array, array, memory_order_release);
+  return array;
+}
+
+bool deque_push(struct deque* this, void* item) {
+  size_t bottom = atomic_load_explicit(&this->bottom, memory_order_relaxed);
+  size_t top = atomic_load_explicit(&this->top, memory_order_acquire);
+  struct deque_array* array = atomic_load_explicit(&this->array, memory_order_relaxed);
+
+  if (bottom - top > array->size - 1) {
+    array = grow(this, array, top, bottom);
+    if (!array)
+      return false;
+  }
+
+  atomic_store_explicit(&array->items[bottom & (array->size - 1)], item, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&this->bottom, bottom + 1, memory_order_relaxed);
+  return true;
+}
+
+void* deque_pop(struct deque* this) {
+  size_t bottom = atomic_load_explicit(&this->bottom, memory_order_relaxed) - 1;
+  struct deque_array* array = atomic_load_explicit(&this->array, memory_order_relaxed);
+  atomic_store_explicit(&this->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  size_t top = atomic_load_explicit(&this->top, memory_order_relaxed);
+
+  void* item = NULL;
+  if ((intptr_t) (bottom - top) >= 0) {
+    item = atomic_load_explicit(&array->items[bottom & (array->size - 1)], memory_order_relaxed);
+    if (top == bottom) {
+      // Last item, race with thieves
+      if (!atomic_compare_exchange_strong_explicit(&this->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+        item = NULL;
+      atomic_store_explicit(&this->bottom, bottom + 1, memory_order_relaxed);
+    }
+  } else {
+    // Empty
+    atomic_store_explicit(&this->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return item;
+}
+
+void* deque_steal(struct deque* this) {
+  size_t top = atomic_load_explicit(&this->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  size_t bottom = atomic_load_explicit(&this->bottom, memory_order_acquire);
+
+  if ((intptr_t) (bottom - top) <= 0)
+    return NULL;
+
+  struct deque_array* array = atomic_load_explicit(&this->array, memory_order_consume);
+  void* item = atomic_load_explicit(&array->items[top & (array->size - 1)], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&this->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+    return NULL;
+  return item;
+}
+
+bool deque_is_empty(struct deque* this) {
+  size_t top = atomic_load_explicit(&this->top, memory_order_relaxed);
+  size_t bottom = atomic_load_explicit(&this->bottom, memory_order_relaxed);
+  return (intptr_t) (bottom - top) <= 0;
+}
+
@@ -0,0 +1,47 @@
+#ifndef header_1655197624_scheduler_deque_h
+#define header_1655197624_scheduler_deque_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Chase-Lev work stealing deque
+// (Lê et al. "Correct and Efficient
+// Work-Stealing for Weak Memory Models")
+//
+// Only the owner thread may push and
+// pop, other threads may steal
+
+struct deque_array {
+  size_t size;
+  struct deque_array* prev;
+  _Atomic(void*) items[];
+};
+
+struct deque {
+  atomic_size_t top;
+  atomic_size_t bottom;
+  _Atomic(struct deque_array*) array;
+};
+
+bool deque_init(struct deque* this, size_t initialSize);
+
+// Not thread safe, no other thread can
+// access the deque
+void deque_cleanup(struct deque* this);
+
+// Owner only, return false if cant grow
+bool deque_push(struct deque* this, void* item);
+
+// Owner only, return NULL if empty
+void* deque_pop(struct deque* this);
+
+// Any thread, return NULL if empty or lost
+// race with other thief/owner
+void* deque_steal(struct deque* this);
+
+// Approximate
+bool deque_is_empty(struct deque* this);
+
+#endif
+
@@ -0,0 +1,706 @@
+#define FLUFFYVM_INTERNAL
+
+#include <Block.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../config.h"
+#include "../coroutine.h"
+#include "../closure.h"
+#include "../interpreter.h"
+#include "scheduler.h"
+
+// How long idle worker sleep before
+// checking for work again, its only
+// a safety net wake ups are explicit
+#define PARK_TIMEOUT_NS (10 * 1000 * 1000)
+
+#define TIMER_TICK_NS (1000 * 1000)
+
+static void queueInit(struct scheduler_task_queue* queue) {
+  pthread_mutex_init(&queue->lock, NULL);
+  atomic_init(&queue->head, NULL);
+  queue->tail = NULL;
+}
+
+static void queuePush(struct scheduler_task_queue* queue, struct scheduler_task* task) {
+  task->nextInQueue = NULL;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail)
+    queue->tail->nextInQueue = task;
+  else
+    atomic_store(&queue->head, task);
+  queue->tail = task;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static struct scheduler_task* queuePop(struct scheduler_task_queue* queue) {
+  // Unlocked peek to avoid taking lock
+  // everytime worker look for work
+  if (!atomic_load_explicit(&queue->head, memory_order_relaxed))
+    return NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  struct scheduler_task* task = atomic_load(&queue->head);
+  if (task) {
+    atomic_store(&queue->head, task->nextInQueue);
+    if (!task->nextInQueue)
+      queue->tail = NULL;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return task;
+}
+
+static bool queueIsEmpty(struct scheduler_task_queue* queue) {
+  return atomic_load_explicit(&queue->head, memory_order_relaxed) == NULL;
+}
+
+static struct scheduler_worker* getCurrentWorker(struct scheduler* this) {
+  return pthread_getspecific(this->currentWorkerKey);
+}
+
+static void wakeWorker(struct scheduler_worker* worker) {
+  pthread_mutex_lock(&worker->parkLock);
+  worker->wakeup = true;
+  pthread_cond_signal(&worker->parkSignal);
+  pthread_mutex_unlock(&worker->parkLock);
+}
+
+// Wake one idle worker (except `self`) so
+// it can steal the new work
+static void notifyIdle(struct scheduler* this, struct scheduler_worker* self) {
+  // Pairs with fence in `park`, either the
+  // worker sees the work or we see it parked
+  atomic_thread_fence(memory_order_seq_cst);
+  for (int i = 0; i < this->workerCount; i++) {
+    struct scheduler_worker* worker = &this->workers[i];
+    if (worker != self && atomic_load_explicit(&worker->parked, memory_order_relaxed)) {
+      wakeWorker(worker);
+      return;
+    }
+  }
+}
+
+// Return the class to queue in
+static scheduler_priority_t markQueued(struct scheduler* this, struct scheduler_task* task) {
+  atomic_store(&task->state, SCHEDULER_TASK_RUNNABLE);
+  task->queuedClass = atomic_load(&task->priority);
+  atomic_fetch_add(&this->queuedCount[task->queuedClass], 1);
+  return task->queuedClass;
+}
+
+static void enqueue(struct scheduler* this, struct scheduler_task* task) {
+  scheduler_priority_t class = markQueued(this, task);
+
+  if (task->pinnedTo >= 0) {
+    struct scheduler_worker* worker = &this->workers[task->pinnedTo];
+    queuePush(&worker->inboxes[class], task);
+    wakeWorker(worker);
+    return;
+  }
+
+  struct scheduler_worker* self = getCurrentWorker(this);
+  if (self && deque_push(&self->deques[class], task)) {
+    notifyIdle(this, self);
+    return;
+  }
+
+  queuePush(&this->injectors[class], task);
+  notifyIdle(this, self);
+}
+
+static bool hasWork(struct scheduler* this, struct scheduler_worker* self) {
+  for (int class = 0; class < SCHEDULER_PRIORITY_COUNT; class++) {
+    if (!queueIsEmpty(&self->inboxes[class]) || !queueIsEmpty(&this->injectors[class]))
+      return true;
+
+    for (int i = 0; i < this->workerCount; i++)
+      if (!deque_is_empty(&this->workers[i].deques[class]))
+        return true;
+  }
+  return false;
+}
+
+static uint64_t currentTick(struct scheduler* this) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t elapsed = (uint64_t) (now.tv_sec - this->startTime.tv_sec) * 1000000000 + now.tv_nsec - this->startTime.tv_nsec;
+  return elapsed / TIMER_TICK_NS;
+}
+
+static void park(struct scheduler* this, struct scheduler_worker* self, uint64_t timeoutNs) {
+  atomic_store(&self->parked, true);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (hasWork(this, self) || this->shuttingDown) {
+    atomic_store(&self->parked, false);
+    return;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeoutNs / 1000000000;
+  deadline.tv_nsec += timeoutNs % 1000000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&self->parkLock);
+  while (!self->wakeup && !this->shuttingDown)
+    if (pthread_cond_timedwait(&self->parkSignal, &self->parkLock, &deadline) == ETIMEDOUT)
+      break;
+  self->wakeup = false;
+  pthread_mutex_unlock(&self->parkLock);
+
+  atomic_store(&self->parked, false);
+}
+
+static struct scheduler_task* findInClass(struct scheduler* this, struct scheduler_worker* self, scheduler_priority_t class) {
+  struct scheduler_task* task;
+  if ((task = deque_pop(&self->deques[class])))
+    return task;
+  if ((task = queuePop(&this->injectors[class])))
+    return task;
+
+  // Try steal starting from random worker
+  int start = rand_r(&self->stealSeed) % this->workerCount;
+  for (int i = 0; i < this->workerCount; i++) {
+    struct scheduler_worker* victim = &this->workers[(start + i) % this->workerCount];
+    if (victim == self)
+      continue;
+
+    if ((task = deque_steal(&victim->deques[class])))
+      return task;
+  }
+  return NULL;
+}
+
+static struct scheduler_task* findTask(struct scheduler* this, struct scheduler_worker* self) {
+  struct scheduler_task* task = NULL;
+
+  // Higher class first but sometimes lowest
+  // first so it cant be starved forever
+  bool lowestFirst = ++self->pickCount % FLUFFYVM_SCHEDULER_STARVATION_INTERVAL == 0;
+  for (int i = 0; !task && i < SCHEDULER_PRIORITY_COUNT; i++) {
+    scheduler_priority_t class = lowestFirst ? SCHEDULER_PRIORITY_COUNT - 1 - i : i;
+
+    // Pinned ones first in a class, they
+    // hold a fiber
+    if (!(task = queuePop(&self->inboxes[class])))
+      task = findInClass(this, self, class);
+  }
+
+  if (task) {
+    atomic_fetch_sub(&this->queuedCount[task->queuedClass], 1);
+    atomic_fetch_add(&this->dispatchedCount[task->queuedClass], 1);
+  }
+  return task;
+}
+
+static void finishTask(struct scheduler_task* task, bool hasError) {
+  pthread_mutex_lock(&task->lock);
+  task->hasError = hasError;
+  atomic_store(&task->state, SCHEDULER_TASK_DONE);
+  struct scheduler_task* waiter = task->waiters;
+  task->waiters = NULL;
+  pthread_cond_broadcast(&task->doneSignal);
+  pthread_mutex_unlock(&task->lock);
+
+  while (waiter) {
+    struct scheduler_task* next = waiter->nextWaiter;
+    scheduler_wake(waiter);
+    scheduler_task_release(waiter);
+    waiter = next;
+  }
+
+  // Drop scheduler's reference
+  scheduler_task_release(task);
+}
+
+static void runTask(struct scheduler* this, struct scheduler_worker* self, struct scheduler_task* task) {
+  atomic_store(&task->state, SCHEDULER_TASK_RUNNING);
+  self->current = task;
+  bool res = coroutine_resume(this->vm, task->co);
+  self->current = NULL;
+
+  if (task->co->state != COROUTINE_SUSPENDED) {
+    finishTask(task, !res || task->co->hasError);
+    return;
+  }
+
+  // Its C stack is on this thread
+  task->pinnedTo = task->co->fiber ? self->id : -1;
+
+  // Ran out of instruction budget, go to the
+  // back of global queue so others run first
+  if (task->co->preempted) {
+    queuePush(&this->injectors[markQueued(this, task)], task);
+    notifyIdle(this, self);
+    return;
+  }
+
+  int expect = SCHEDULER_TASK_RUNNING;
+  if (atomic_compare_exchange_strong(&task->state, &expect, SCHEDULER_TASK_PARKED))
+    return;
+
+  // Woken while running
+  assert(expect == SCHEDULER_TASK_NOTIFIED);
+  enqueue(this, task);
+}
+
+static void workerLoop(struct scheduler* this, struct scheduler_worker* self) {
+  pthread_setspecific(this->currentWorkerKey, self);
+
+  while (!this->shuttingDown) {
+    timer_wheel_advance(&self->timers, currentTick(this));
+
+    struct scheduler_task* task = findTask(this, self);
+    if (!task) {
+      // Sleep only until next timer need attention
+      uint64_t timeout = PARK_TIMEOUT_NS;
+      uint64_t nextTick = timer_wheel_next_tick(&self->timers);
+      if (nextTick != UINT64_MAX) {
+        uint64_t now = currentTick(this);
+        uint64_t untilNext = nextTick > now ? (nextTick - now) * TIMER_TICK_NS : 0;
+        if (untilNext < timeout)
+          timeout = untilNext;
+      }
+
+      if (timeout > 0)
+        park(this, self, timeout);
+      continue;
+    }
+
+    runTask(this, self, task);
+  }
+
+  pthread_setspecific(this->currentWorkerKey, NULL);
+}
+
+static void freeTask(struct scheduler* this, struct scheduler_task* task) {
+  // Only the task had the coroutine, give
+  // it to this thread's pool if finished
+  coroutine_recycle(this->vm, task->co);
+
+  pthread_mutex_lock(&this->rootLock);
+  foxgc_api_remove_from_root2(this->vm->heap, this->root, task->rootRef);
+  pthread_mutex_unlock(&this->rootLock);
+
+  pthread_mutex_destroy(&task->lock);
+  pthread_cond_destroy(&task->doneSignal);
+  free(task);
+}
+
+struct scheduler* scheduler_new(struct fluffyvm* vm, int workerCount) {
+  struct scheduler* this = malloc(sizeof(*this));
+  if (!this)
+    goto no_memory;
+
+  this->vm = vm;
+  atomic_fetch_add(&vm->liveSchedulers, 1);
+  this->workerCount = workerCount;
+  this->shuttingDown = false;
+  this->tasks = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &this->startTime);
+  for (int class = 0; class < SCHEDULER_PRIORITY_COUNT; class++) {
+    queueInit(&this->injectors[class]);
+    atomic_init(&this->queuedCount[class], 0);
+    atomic_init(&this->dispatchedCount[class], 0);
+  }
+  pthread_mutex_init(&this->rootLock, NULL);
+  pthread_mutex_init(&this->tasksLock, NULL);
+  pthread_key_create(&this->currentWorkerKey, NULL);
+
+  this->root = foxgc_api_new_root(vm->heap);
+  this->workers = calloc(workerCount, sizeof(*this->workers));
+  if (!this->root || !this->workers) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    goto error;
+  }
+
+  for (int i = 0; i < workerCount; i++) {
+    struct scheduler_worker* worker = &this->workers[i];
+    worker->owner = this;
+    worker->id = i;
+    worker->hasStarted = false;
+    worker->parked = false;
+    worker->wakeup = false;
+    worker->current = NULL;
+    worker->stealSeed = (unsigned int) (uintptr_t) worker;
+    worker->pickCount = 0;
+    for (int class = 0; class < SCHEDULER_PRIORITY_COUNT; class++)
+      queueInit(&worker->inboxes[class]);
+    timer_wheel_init(&worker->timers, 0);
+    pthread_mutex_init(&worker->parkLock, NULL);
+    pthread_cond_init(&worker->parkSignal, NULL);
+
+    for (int class = 0; class < SCHEDULER_PRIORITY_COUNT; class++) {
+      if (!deque_init(&worker->deques[class], 64)) {
+        fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+        goto error;
+      }
+    }
+  }
+
+  for (int i = 0; i < workerCount; i++) {
+    struct scheduler_worker* worker = &this->workers[i];
+    fluffyvm_thread_routine_t routine = ^void* (void* args) {
+      workerLoop(this, worker);
+      return NULL;
+    };
+
+    if (!fluffyvm_start_thread(vm, &worker->thread, NULL, Block_copy(routine), NULL))
+      goto error;
+    worker->hasStarted = true;
+  }
+
+  return this;
+
+  no_memory:
+  fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+  return NULL;
+
+  error:
+  scheduler_free(this);
+  return NULL;
+}
+
+static void releaseTimer(struct scheduler_timer* timer) {
+  if (atomic_fetch_sub(&timer->refCount, 1) == 1)
+    free(timer);
+}
+
+static void fireTimer(struct timer_wheel_entry* entry) {
+  struct scheduler_timer* timer = (struct scheduler_timer*) entry;
+  struct scheduler_task* task = timer->task;
+
+  int expect = SCHEDULER_TIMER_PENDING;
+  if (atomic_compare_exchange_strong(&timer->state, &expect, SCHEDULER_TIMER_FIRED))
+    scheduler_wake(task);
+
+  scheduler_task_release(task);
+  releaseTimer(timer);
+}
+
+// Tasks are freed separately on shutdown and
+// caller of `scheduler_timer_start` may still
+// hold the timer so only drop wheel's ref
+static void discardTimer(struct timer_wheel_entry* entry) {
+  releaseTimer((struct scheduler_timer*) entry);
+}
+
+void scheduler_free(struct scheduler* this) {
+  this->shuttingDown = true;
+
+  if (this->workers) {
+    for (int i = 0; i < this->workerCount; i++)
+      if (this->workers[i].hasStarted)
+        wakeWorker(&this->workers[i]);
+
+    for (int i = 0; i < this->workerCount; i++) {
+      struct scheduler_worker* worker = &this->workers[i];
+      if (worker->hasStarted)
+        pthread_join(worker->thread, NULL);
+
+      for (int class = 0; class < SCHEDULER_PRIORITY_COUNT; class++) {
+        deque_cleanup(&worker->deques[class]);
+        pthread_mutex_destroy(&worker->inboxes[class].lock);
+      }
+      timer_wheel_cleanup(&worker->timers, discardTimer);
+      pthread_mutex_destroy(&worker->parkLock);
+      pthread_cond_destroy(&worker->parkSignal);
+    }
+  }
+
+  // Workers gone so nothing else touching tasks
+  struct scheduler_task* task = this->tasks;
+  while (task) {
+    struct scheduler_task* next = task->next;
+    freeTask(this, task);
+    task = next;
+  }
+
+  if (this->root)
+    foxgc_api_delete_root(this->vm->heap, this->root);
+
+  pthread_key_delete(this->currentWorkerKey);
+  for (int class = 0; class < SCHEDULER_PRIORITY_COUNT; class++)
+    pthread_mutex_destroy(&this->injectors[class].lock);
+  pthread_mutex_destroy(&this->rootLock);
+  pthread_mutex_destroy(&this->tasksLock);
+  free(this->workers);
+  atomic_fetch_sub(&this->vm->liveSchedulers, 1);
+  free(this);
+}
+
+struct scheduler_task* scheduler_spawn(struct scheduler* this, struct fluffyvm_closure* func) {
+  return scheduler_spawn_with_priority(this, func, SCHEDULER_PRIORITY_NORMAL);
+}
+
+static bool isValidPriority(scheduler_priority_t priority) {
+  return priority >= 0 && priority < SCHEDULER_PRIORITY_COUNT;
+}
+
+struct scheduler_task* scheduler_spawn_with_priority(struct scheduler* this, struct fluffyvm_closure* func, scheduler_priority_t priority) {
+  struct fluffyvm* vm = this->vm;
+  if (!isValidPriority(priority)) {
+    fluffyvm_set_errmsg_printf(vm, "invalid priority %d", (int) priority);
+    return NULL;
+  }
+
+  struct scheduler_task* task = malloc(sizeof(*task));
+  if (!task) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+
+  foxgc_root_reference_t* coroutineRootRef = NULL;
+  struct fluffyvm_coroutine* co = coroutine_new(vm, &coroutineRootRef, func);
+  if (!co) {
+    free(task);
+    return NULL;
+  }
+
+  // Move it to scheduler's root
+  pthread_mutex_lock(&this->rootLock);
+  foxgc_api_root_add(vm->heap, co->gc_this, this->root, &task->rootRef);
+  pthread_mutex_unlock(&this->rootLock);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), coroutineRootRef);
+
+  coroutine_set_instruction_budget(co, FLUFFYVM_SCHEDULER_INSTRUCTION_BUDGET);
+
+  task->owner = this;
+  task->co = co;
+  task->pinnedTo = -1;
+  atomic_init(&task->priority, priority);
+  task->queuedClass = priority;
+  task->hasError = false;
+  task->waiters = NULL;
+  task->nextWaiter = NULL;
+  task->nextInQueue = NULL;
+  pthread_mutex_init(&task->lock, NULL);
+  pthread_cond_init(&task->doneSignal, NULL);
+  atomic_init(&task->state, SCHEDULER_TASK_RUNNABLE);
+
+  // One for scheduler and one for caller
+  atomic_init(&task->refCount, 2);
+
+  pthread_mutex_lock(&this->tasksLock);
+  task->prev = NULL;
+  task->next = this->tasks;
+  if (this->tasks)
+    this->tasks->prev = task;
+  this->tasks = task;
+  pthread_mutex_unlock(&this->tasksLock);
+
+  enqueue(this, task);
+  return task;
+}
+
+bool scheduler_task_set_priority(struct scheduler_task* task, scheduler_priority_t priority) {
+  if (!isValidPriority(priority))
+    return false;
+  atomic_store(&task->priority, priority);
+  return true;
+}
+
+scheduler_priority_t scheduler_task_get_priority(struct scheduler_task* task) {
+  return atomic_load(&task->priority);
+}
+
+void scheduler_get_stats(struct scheduler* this, struct scheduler_stats* stats) {
+  for (int class = 0; class < SCHEDULER_PRIORITY_COUNT; class++) {
+    stats->classes[class].queued = atomic_load(&this->queuedCount[class]);
+    stats->classes[class].dispatched = atomic_load(&this->dispatchedCount[class]);
+  }
+}
+
+void scheduler_task_release(struct scheduler_task* task) {
+  if (atomic_fetch_sub(&task->refCount, 1) != 1)
+    return;
+
+  struct scheduler* this = task->owner;
+  pthread_mutex_lock(&this->tasksLock);
+  if (task->prev)
+    task->prev->next = task->next;
+  else
+    this->tasks = task->next;
+  if (task->next)
+    task->next->prev = task->prev;
+  pthread_mutex_unlock(&this->tasksLock);
+
+  freeTask(this, task);
+}
+
+void scheduler_wake(struct scheduler_task* task) {
+  int state = atomic_load(&task->state);
+  while (true) {
+    switch (state) {
+      case SCHEDULER_TASK_PARKED:
+        if (atomic_compare_exchange_weak(&task->state, &state, SCHEDULER_TASK_RUNNABLE)) {
+          enqueue(task->owner, task);
+          return;
+        }
+        break;
+      case SCHEDULER_TASK_RUNNING:
+        // Worker will requeue it once it suspend
+        if (atomic_compare_exchange_weak(&task->state, &state, SCHEDULER_TASK_NOTIFIED))
+          return;
+        break;
+      default:
+        // Already runnable or done
+        return;
+    }
+  }
+}
+
+struct scheduler_task* scheduler_get_current_task(struct scheduler* this) {
+  struct scheduler_worker* worker = getCurrentWorker(this);
+  if (!worker)
+    return NULL;
+  return worker->current;
+}
+
+struct scheduler_task* scheduler_get_executing_task(struct scheduler* this) {
+  struct scheduler_task* task = scheduler_get_current_task(this);
+  if (!task || fluffyvm_get_executing_coroutine(this->vm) != task->co)
+    return NULL;
+  return task;
+}
+
+struct scheduler_task* scheduler_get_suspendable_task(struct scheduler* this) {
+  if (!this)
+    return NULL;
+
+  struct scheduler_task* task = scheduler_get_executing_task(this);
+  if (!task || !task->co->fiber || !coroutine_can_yield(task->co))
+    return NULL;
+  return task;
+}
+
+int scheduler_suspend(struct scheduler* this) {
+  if (!scheduler_get_executing_task(this))
+    interpreter_error(this->vm, this->vm->staticStrings.notInScheduledCoroutine);
+  return coroutine_yield_stackless(this->vm, 0);
+}
+
+int scheduler_yield(struct scheduler* this) {
+  struct scheduler_task* task = scheduler_get_executing_task(this);
+  if (!task)
+    interpreter_error(this->vm, this->vm->staticStrings.notInScheduledCoroutine);
+
+  // Mark it notified so the worker
+  // requeue it right after it suspend
+  scheduler_wake(task);
+  return coroutine_yield_stackless(this->vm, 0);
+}
+
+int scheduler_join(struct scheduler* this, struct scheduler_task* task) {
+  if (scheduler_task_is_done(task))
+    return 0;
+
+  struct scheduler_task* current = scheduler_get_executing_task(this);
+  if (!current || !coroutine_can_yield(current->co)) {
+    // Blocking would pin the worker and with
+    // one worker `task` never gets to run
+    if (getCurrentWorker(this))
+      interpreter_error(this->vm, this->vm->staticStrings.cannotBlockSchedulerWorker);
+
+    scheduler_wait(task);
+    return 0;
+  }
+
+  pthread_mutex_lock(&task->lock);
+  if (atomic_load(&task->state) == SCHEDULER_TASK_DONE) {
+    pthread_mutex_unlock(&task->lock);
+    return 0;
+  }
+
+  // Waiter list hold a reference so its
+  // safe even if current task die first
+  atomic_fetch_add(&current->refCount, 1);
+  current->nextWaiter = task->waiters;
+  task->waiters = current;
+  pthread_mutex_unlock(&task->lock);
+
+  return coroutine_yield_stackless(this->vm, 0);
+}
+
+static struct scheduler_timer* startTimer(struct scheduler* this, uint64_t milisecs, int refCount) {
+  struct scheduler_worker* worker = getCurrentWorker(this);
+  struct scheduler_task* task = scheduler_get_executing_task(this);
+  if (!task) {
+    fluffyvm_set_errmsg(this->vm, this->vm->staticStrings.notInScheduledCoroutine);
+    return NULL;
+  }
+
+  struct scheduler_timer* timer = malloc(sizeof(*timer));
+  if (!timer) {
+    fluffyvm_set_errmsg(this->vm, this->vm->staticStrings.outOfMemory);
+    return NULL;
+  }
+
+  // Round up so it never fire early
+  uint64_t ticks = (milisecs * 1000000 + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+
+  timer->task = task;
+  timer->entry.callback = fireTimer;
+  timer->entry.expires = currentTick(this) + ticks;
+  atomic_init(&timer->state, SCHEDULER_TIMER_PENDING);
+  atomic_init(&timer->refCount, refCount);
+  atomic_fetch_add(&task->refCount, 1);
+
+  timer_wheel_add(&worker->timers, &timer->entry);
+  return timer;
+}
+
+int scheduler_sleep(struct scheduler* this, uint64_t milisecs) {
+  // Only the wheel hold it
+  if (!startTimer(this, milisecs, 1))
+    interpreter_error(this->vm, fluffyvm_get_errmsg(this->vm));
+  return coroutine_yield_stackless(this->vm, 0);
+}
+
+struct scheduler_timer* scheduler_timer_start(struct scheduler* this, uint64_t milisecs) {
+  return startTimer(this, milisecs, 2);
+}
+
+bool scheduler_timer_stop(struct scheduler_timer* timer) {
+  int expect = SCHEDULER_TIMER_PENDING;
+  bool fired = !atomic_compare_exchange_strong(&timer->state, &expect, SCHEDULER_TIMER_CANCELLED) &&
+               expect == SCHEDULER_TIMER_FIRED;
+  releaseTimer(timer);
+  return fired;
+}
+
+bool scheduler_timer_has_fired(struct scheduler_timer* timer) {
+  return atomic_load(&timer->state) == SCHEDULER_TIMER_FIRED;
+}
+
+bool scheduler_wait(struct scheduler_task* task) {
+  pthread_mutex_lock(&task->lock);
+  while (atomic_load(&task->state) != SCHEDULER_TASK_DONE)
+    pthread_cond_wait(&task->doneSignal, &task->lock);
+  bool hasError = task->hasError;
+  pthread_mutex_unlock(&task->lock);
+  return !hasError;
+}
+
+bool scheduler_task_is_done(struct scheduler_task* task) {
+  return atomic_load(&task->state) == SCHEDULER_TASK_DONE;
+}
+
+bool scheduler_task_has_error(struct scheduler_task* task) {
+  return task->hasError;
+}
+
+struct value scheduler_task_get_error(struct scheduler_task* task) {
+  if (!task->hasError)
+    return value_not_present;
+  return task->co->thrownedError;
+}
+
@@ -0,0 +1,281 @@
+#ifndef header_1655198012_scheduler_h
+#define header_1655198012_scheduler_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../fluffyvm.h"
+#include "../foxgc.h"
+#include "../value.h"
+#include "deque.h"
+#include "timer_wheel.h"
+
+// M:N scheduler running coroutines on N
+// managed worker threads. Each worker has
+// its own deque for each priority class
+// and steal from others when idle
+//
+// Coroutines can move between workers
+// while suspended because nothing of
+// them lives on C stack or in per thread
+// state then (its all in their call stack).
+// Except when suspended inside native
+// function running on a fiber, those are
+// pinned to the worker they suspended on
+// until they finish that native call
+
+struct fluffyvm_coroutine;
+struct fluffyvm_closure;
+struct scheduler;
+
+typedef enum {
+  // Latency sensitive (e.g. request handling)
+  SCHEDULER_PRIORITY_HIGH,
+  SCHEDULER_PRIORITY_NORMAL,
+  // Background batch work
+  SCHEDULER_PRIORITY_LOW,
+  SCHEDULER_PRIORITY_COUNT
+} scheduler_priority_t;
+
+typedef enum {
+  // In a deque or inbox
+  SCHEDULER_TASK_RUNNABLE,
+  SCHEDULER_TASK_RUNNING,
+  // Got woken while running so
+  // reschedule when it suspend
+  SCHEDULER_TASK_NOTIFIED,
+  // Suspended waiting for wake
+  SCHEDULER_TASK_PARKED,
+  SCHEDULER_TASK_DONE
+} scheduler_task_state_t;
+
+struct scheduler_task {
+  struct scheduler* owner;
+  struct fluffyvm_coroutine* co;
+  foxgc_root_reference_t* rootRef;
+
+  volatile atomic_int state;
+  atomic_int refCount;
+
+  // Worker it must run on (-1 if any)
+  int pinnedTo;
+
+  // scheduler_priority_t, atomic as it
+  // can be changed from any thread
+  atomic_int priority;
+  // Class it was queued under last
+  // time (priority may change since)
+  scheduler_priority_t queuedClass;
+
+  pthread_mutex_t lock;
+  pthread_cond_t doneSignal;
+  bool hasError;
+
+  // Tasks waiting on this task to finish
+  struct scheduler_task* waiters;
+  struct scheduler_task* nextWaiter;
+
+  // For inbox and injector queue
+  struct scheduler_task* nextInQueue;
+
+  // All live tasks
+  struct scheduler_task* prev;
+  struct scheduler_task* next;
+};
+
+typedef enum {
+  SCHEDULER_TIMER_PENDING,
+  SCHEDULER_TIMER_FIRED,
+  SCHEDULER_TIMER_CANCELLED
+} scheduler_timer_state_t;
+
+// Timers live in the wheel of the worker which
+// started it. Stopping only mark it cancelled
+// so any thread can do it, the wheel free it
+// once it would have expired
+struct scheduler_timer {
+  struct timer_wheel_entry entry;
+  struct scheduler_task* task;
+
+  volatile atomic_int state;
+  // One for the wheel and one for the handle
+  atomic_int refCount;
+};
+
+struct scheduler_task_queue {
+  pthread_mutex_t lock;
+  // Atomic so workers can check if its
+  // empty without locking
+  _Atomic(struct scheduler_task*) head;
+  struct scheduler_task* tail;
+};
+
+struct scheduler_worker {
+  struct scheduler* owner;
+  int id;
+  pthread_t thread;
+  bool hasStarted;
+
+  // One for each priority class
+  struct deque deques[SCHEDULER_PRIORITY_COUNT];
+
+  // Tasks pinned to this worker, one for
+  // each priority class
+  struct scheduler_task_queue inboxes[SCHEDULER_PRIORITY_COUNT];
+
+  // For starvation protection
+  unsigned int pickCount;
+
+  volatile atomic_bool parked;
+  pthread_mutex_t parkLock;
+  pthread_cond_t parkSignal;
+  bool wakeup;
+
+  struct scheduler_task* current;
+  unsigned int stealSeed;
+
+  // Only touched by this worker
+  struct timer_wheel timers;
+};
+
+struct scheduler {
+  struct fluffyvm* vm;
+
+  int workerCount;
+  struct scheduler_worker* workers;
+  volatile atomic_bool shuttingDown;
+
+  // For tasks queued from non worker thread
+  // (and preempted ones) for each class
+  struct scheduler_task_queue injectors[SCHEDULER_PRIORITY_COUNT];
+
+  // Run queue length and number of
+  // times picked to run for each class
+  atomic_int queuedCount[SCHEDULER_PRIORITY_COUNT];
+  atomic_uint_fast64_t dispatchedCount[SCHEDULER_PRIORITY_COUNT];
+
+  pthread_key_t currentWorkerKey;
+
+  // Scheduled coroutines are rooted here
+  // because they dont belong to any thread
+  pthread_mutex_t rootLock;
+  foxgc_root_t* root;
+
+  pthread_mutex_t tasksLock;
+  struct scheduler_task* tasks;
+
+  // Timer ticks counted from here
+  struct timespec startTime;
+};
+
+// Return NULL on error (errmsg set)
+struct scheduler* scheduler_new(struct fluffyvm* vm, int workerCount);
+
+// Stops all workers, all tasks are discarded
+// and their handles no longer valid
+void scheduler_free(struct scheduler* this);
+
+// Create coroutine for `func` and queue it
+// Returned task must be released with
+// `scheduler_task_release`. Caller must be
+// managed thread
+// Return NULL on error (errmsg set)
+struct scheduler_task* scheduler_spawn(struct scheduler* this, struct fluffyvm_closure* func);
+
+// Workers pick higher classes first, except
+// every `FLUFFYVM_SCHEDULER_STARVATION_INTERVAL`
+// picks the lowest class with work goes first
+// so batch tasks still progress under load
+// `scheduler_spawn` use SCHEDULER_PRIORITY_NORMAL
+// Return NULL on error or invalid
+// `priority` (errmsg set)
+struct scheduler_task* scheduler_spawn_with_priority(struct scheduler* this, struct fluffyvm_closure* func, scheduler_priority_t priority);
+
+// Take effect next time the task queued
+// Return false if `priority` not valid
+bool scheduler_task_set_priority(struct scheduler_task* task, scheduler_priority_t priority);
+scheduler_priority_t scheduler_task_get_priority(struct scheduler_task* task);
+
+struct scheduler_stats {
+  struct {
+    // Tasks waiting to run right now
+    int queued;
+    // Times tasks of the class picked to run
+    uint64_t dispatched;
+  } classes[SCHEDULER_PRIORITY_COUNT];
+};
+
+void scheduler_get_stats(struct scheduler* this, struct scheduler_stats* stats);
+
+void scheduler_task_release(struct scheduler_task* task);
+
+// Make parked task runnable again
+// Can be called from any thread
+void scheduler_wake(struct scheduler_task* task);
+
+// Task currently running on caller's
+// thread, NULL if not in a worker
+struct scheduler_task* scheduler_get_current_task(struct scheduler* this);
+
+// Like `scheduler_get_current_task` but NULL
+// if the executing coroutine is not the task
+// (e.g. a coroutine resumed by the task)
+struct scheduler_task* scheduler_get_executing_task(struct scheduler* this);
+
+// Executing task if it runs on a fiber so
+// native function can suspend it and continue
+// afterward (with `scheduler_suspend`), NULL
+// if not possible. `this` can be NULL
+struct scheduler_task* scheduler_get_suspendable_task(struct scheduler* this);
+
+// These must be used as `return scheduler_xxx(...)`
+// by native function called from bytecode in a
+// scheduled coroutine (see `coroutine_yield_stackless`)
+
+// Give other tasks chance to run
+int scheduler_yield(struct scheduler* this);
+
+// Suspend until someone call `scheduler_wake`
+int scheduler_suspend(struct scheduler* this);
+
+// Suspend until `task` finish, if caller is not
+// scheduled coroutine it blocks the thread
+// (may return early if woken by something else)
+// Error thrown if caller is on a worker but
+// cant suspend
+int scheduler_join(struct scheduler* this, struct scheduler_task* task);
+
+// Suspend for `milisecs`, woken early if someone
+// else wake the task (1 ms resolution)
+int scheduler_sleep(struct scheduler* this, uint64_t milisecs);
+
+// Wake executing task after `milisecs`, for
+// deadlines on operations. The caller suspend
+// and check `scheduler_timer_has_fired` when
+// woken. Must be called from scheduled coroutine
+// Return NULL on error (errmsg set)
+struct scheduler_timer* scheduler_timer_start(struct scheduler* this, uint64_t milisecs);
+
+// Cancel if not yet fired and release the handle
+// Return true if the timer already fired. Handle
+// stays valid after `scheduler_free`
+bool scheduler_timer_stop(struct scheduler_timer* timer);
+
+bool scheduler_timer_has_fired(struct scheduler_timer* timer);
+
+// Block calling thread until `task` finish
+// Return false if the task errored
+// Do not call from worker
+bool scheduler_wait(struct scheduler_task* task);
+
+bool scheduler_task_is_done(struct scheduler_task* task);
+
+// Only valid after task is done
+bool scheduler_task_has_error(struct scheduler_task* task);
+struct value scheduler_task_get_error(struct scheduler_task* task);
+
+#endif
+
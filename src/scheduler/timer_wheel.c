@@ -0,0 +1,132 @@
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Largest delay fit in the wheel, anything
+// further get placed at the end and
+// reinserted when cascaded
+#define MAX_DELTA ((UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+void timer_wheel_init(struct timer_wheel* this, uint64_t currentTick) {
+  this->currentTick = currentTick;
+  this->count = 0;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+      this->slots[level][slot] = NULL;
+}
+
+// Cascaded entries can expire on current
+// tick, which is not yet processed then
+static void insert(struct timer_wheel* this, struct timer_wheel_entry* entry) {
+  uint64_t expires = entry->expires;
+  uint64_t delta = expires - this->currentTick;
+  if (delta > MAX_DELTA) {
+    delta = MAX_DELTA;
+    expires = this->currentTick + MAX_DELTA;
+  }
+
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * (level + 1))))
+    level++;
+
+  int slot = (expires >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+  entry->next = this->slots[level][slot];
+  this->slots[level][slot] = entry;
+}
+
+void timer_wheel_add(struct timer_wheel* this, struct timer_wheel_entry* entry) {
+  // Already expired ones fire on next tick
+  if (entry->expires <= this->currentTick)
+    entry->expires = this->currentTick + 1;
+
+  this->count++;
+  insert(this, entry);
+}
+
+static void cascade(struct timer_wheel* this, int level, int slot) {
+  struct timer_wheel_entry* entry = this->slots[level][slot];
+  this->slots[level][slot] = NULL;
+
+  while (entry) {
+    struct timer_wheel_entry* next = entry->next;
+    insert(this, entry);
+    entry = next;
+  }
+}
+
+static void tick(struct timer_wheel* this) {
+  this->currentTick++;
+
+  // Move higher levels down first so
+  // they can expire on this tick
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    int shift = TIMER_WHEEL_SLOT_BITS * level;
+    if (this->currentTick & ((UINT64_C(1) << shift) - 1))
+      break;
+    cascade(this, level, (this->currentTick >> shift) & SLOT_MASK);
+  }
+
+  int slot = this->currentTick & SLOT_MASK;
+  struct timer_wheel_entry* entry = this->slots[0][slot];
+  this->slots[0][slot] = NULL;
+
+  while (entry) {
+    struct timer_wheel_entry* next = entry->next;
+    if (entry->expires <= this->currentTick) {
+      this->count--;
+      entry->callback(entry);
+    } else {
+      // Was clamped to MAX_DELTA
+      insert(this, entry);
+    }
+    entry = next;
+  }
+}
+
+void timer_wheel_advance(struct timer_wheel* this, uint64_t tickTo) {
+  // Nothing to cascade or expire
+  if (this->count == 0) {
+    if (tickTo > this->currentTick)
+      this->currentTick = tickTo;
+    return;
+  }
+
+  while (this->currentTick < tickTo)
+    tick(this);
+}
+
+uint64_t timer_wheel_next_tick(struct timer_wheel* this) {
+  if (this->count == 0)
+    return UINT64_MAX;
+
+  // Only scan first level, higher level
+  // need cascade when this one wraps
+  uint64_t current = this->currentTick;
+  for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+    uint64_t tick = current + i;
+    if (this->slots[0][tick & SLOT_MASK])
+      return tick;
+    if ((tick & SLOT_MASK) == 0)
+      return tick;
+  }
+  return current + TIMER_WHEEL_SLOTS;
+}
+
+void timer_wheel_cleanup(struct timer_wheel* this, timer_wheel_callback_t func) {
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      struct timer_wheel_entry* entry = this->slots[level][slot];
+      this->slots[level][slot] = NULL;
+
+      while (entry) {
+        struct timer_wheel_entry* next = entry->next;
+        func(entry);
+        entry = next;
+      }
+    }
+  }
+  this->count = 0;
+}
+
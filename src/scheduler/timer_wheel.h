@@ -0,0 +1,55 @@
+#ifndef header_1655289211_scheduler_timer_wheel_h
+#define header_1655289211_scheduler_timer_wheel_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel (Varghese & Lauck)
+// Insert and expire are O(1) per timer,
+// each timer cascade to lower level at
+// most TIMER_WHEEL_LEVELS - 1 times
+//
+// Not thread safe, each scheduler worker
+// owns one
+
+#define TIMER_WHEEL_SLOT_BITS (6)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS (4)
+
+struct timer_wheel_entry;
+typedef void (*timer_wheel_callback_t)(struct timer_wheel_entry* entry);
+
+struct timer_wheel_entry {
+  // In ticks
+  uint64_t expires;
+  timer_wheel_callback_t callback;
+  struct timer_wheel_entry* next;
+};
+
+struct timer_wheel {
+  uint64_t currentTick;
+  int count;
+  struct timer_wheel_entry* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel* this, uint64_t currentTick);
+
+// Entry must not be in any wheel, callback is
+// called from `timer_wheel_advance` at or after
+// `expires` and the wheel no longer reference the
+// entry after that (so callback can free it)
+void timer_wheel_add(struct timer_wheel* this, struct timer_wheel_entry* entry);
+
+// Expire everything up to `tick`
+void timer_wheel_advance(struct timer_wheel* this, uint64_t tick);
+
+// Ticks until wheel need to be advanced
+// (may be earlier than next expiry because of
+// cascading) or UINT64_MAX if empty
+uint64_t timer_wheel_next_tick(struct timer_wheel* this);
+
+// Call `func` on each remaining entry
+void timer_wheel_cleanup(struct timer_wheel* this, timer_wheel_callback_t func);
+
+#endif
+
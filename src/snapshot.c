@@ -0,0 +1,889 @@
+#define FLUFFYVM_INTERNAL
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "closure.h"
+#include "config.h"
+#include "fluffyvm.h"
+#include "fluffyvm_types.h"
+#include "hashtable.h"
+#include "loader/bytecode/image.h"
+#include "snapshot.h"
+#include "util/binary.h"
+#include "util/util.h"
+#include "value.h"
+
+#define SNAPSHOT_MAGIC "FVMS"
+#define SNAPSHOT_VERSION (1)
+#define HEADER_SIZE (16)
+
+// Deeper nesting of functions than
+// this cant be saved
+#define MAX_PROTOTYPE_DEPTH (256)
+
+enum record_kind {
+  RECORD_STRING = 1,
+  RECORD_TABLE,
+  RECORD_BYTECODE,
+  RECORD_BYTECODE_CLOSURE,
+  RECORD_NATIVE_CLOSURE
+};
+
+enum value_tag {
+  TAG_NIL = 1,
+  TAG_FALSE,
+  TAG_TRUE,
+  TAG_LONG,
+  TAG_DOUBLE,
+  TAG_REFERENCE
+};
+
+bool snapshot_init(struct fluffyvm* vm) {
+  vm->snapshotStaticData = malloc(sizeof(*vm->snapshotStaticData));
+  if (!vm->snapshotStaticData)
+    return false;
+
+  pthread_mutex_init(&vm->snapshotStaticData->nativesLock, NULL);
+  vm->snapshotStaticData->nativesCount = 0;
+  vm->snapshotStaticData->nativesCapacity = 0;
+  vm->snapshotStaticData->natives = NULL;
+  return true;
+}
+
+void snapshot_cleanup(struct fluffyvm* vm) {
+  if (!vm->snapshotStaticData)
+    return;
+
+  for (int i = 0; i < vm->snapshotStaticData->nativesCount; i++)
+    free(vm->snapshotStaticData->natives[i].name);
+  free(vm->snapshotStaticData->natives);
+  pthread_mutex_destroy(&vm->snapshotStaticData->nativesLock);
+  free(vm->snapshotStaticData);
+}
+
+bool snapshot_register_native(struct fluffyvm* vm, const char* module, const char* name, closure_cfunction_t func, void* udata) {
+  return snapshot_register_native2(vm, module, name, func, udata, false);
+}
+
+bool snapshot_register_native2(struct fluffyvm* vm, const char* module, const char* name, closure_cfunction_t func, void* udata, bool needFiber) {
+  struct snapshot_static_data* data = vm->snapshotStaticData;
+  char* fullName = NULL;
+  if (module && util_asprintf(&fullName, "%s.%s", module, name) < 0) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return false;
+  }
+  if (fullName)
+    name = fullName;
+
+  bool res = false;
+  pthread_mutex_lock(&data->nativesLock);
+
+  struct snapshot_native* native = NULL;
+  for (int i = 0; i < data->nativesCount; i++) {
+    if (strcmp(data->natives[i].name, name) == 0) {
+      native = &data->natives[i];
+      break;
+    }
+  }
+
+  if (!native) {
+    if (data->nativesCount == data->nativesCapacity) {
+      int capacity = data->nativesCapacity > 0 ? data->nativesCapacity * 2 : 16;
+      struct snapshot_native* tmp = realloc(data->natives, sizeof(*tmp) * capacity);
+      if (!tmp)
+        goto no_memory;
+      data->natives = tmp;
+      data->nativesCapacity = capacity;
+    }
+
+    char* copy = strdup(name);
+    if (!copy)
+      goto no_memory;
+    native = &data->natives[data->nativesCount++];
+    native->name = copy;
+  }
+
+  native->func = func;
+  native->udata = udata;
+  native->needFiber = needFiber;
+  res = true;
+
+  no_memory:
+  pthread_mutex_unlock(&data->nativesLock);
+  free(fullName);
+  if (!res)
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+  return res;
+}
+
+////////////////////////////////////////
+// Writer                             //
+////////////////////////////////////////
+
+struct writer {
+  uint8_t* data;
+  size_t len;
+  size_t capacity;
+  bool failed;
+};
+
+// Return where the bytes go or NULL
+// if it cant grow (and writer failed)
+static uint8_t* reserve(struct writer* this, size_t len) {
+  if (this->failed)
+    return NULL;
+
+  if (this->len + len > this->capacity) {
+    size_t capacity = this->capacity > 0 ? this->capacity : 4096;
+    while (capacity < this->len + len)
+      capacity *= 2;
+
+    uint8_t* tmp = realloc(this->data, capacity);
+    if (!tmp) {
+      this->failed = true;
+      return NULL;
+    }
+    this->data = tmp;
+    this->capacity = capacity;
+  }
+
+  uint8_t* result = this->data + this->len;
+  this->len += len;
+  return result;
+}
+
+static inline void set32(uint8_t* data, uint32_t val) {
+  for (int i = 0; i < 4; i++)
+    data[i] = (val >> (i * 8)) & 0xFF;
+}
+
+static void put8(struct writer* this, uint8_t val) {
+  uint8_t* data = reserve(this, 1);
+  if (data)
+    data[0] = val;
+}
+
+static void put32(struct writer* this, uint32_t val) {
+  uint8_t* data = reserve(this, 4);
+  if (data)
+    set32(data, val);
+}
+
+static void put64(struct writer* this, uint64_t val) {
+  uint8_t* data = reserve(this, 8);
+  if (data) {
+    set32(data, val & 0xFFFFFFFF);
+    set32(data + 4, val >> 32);
+  }
+}
+
+static void putBytes(struct writer* this, const void* bytes, size_t len) {
+  uint8_t* data = reserve(this, len);
+  if (data && len > 0)
+    memcpy(data, bytes, len);
+}
+
+////////////////////////////////////////
+// Saving                             //
+////////////////////////////////////////
+
+struct record {
+  enum record_kind kind;
+  struct value value;
+  struct fluffyvm_bytecode* bytecode;
+};
+
+// Where a prototype is below main prototype
+struct prototype_path {
+  struct fluffyvm_prototype* prototype;
+  // Child indices at `offset` in `pathData`
+  size_t offset;
+  int depth;
+};
+
+struct saved_bytecode {
+  struct fluffyvm_bytecode* bytecode;
+  uint32_t index;
+
+  // Built once when interned, sorted by
+  // prototype for bsearch
+  struct prototype_path* paths;
+  size_t pathsCount;
+  size_t pathsCapacity;
+  uint32_t* pathData;
+  size_t pathDataLen;
+  size_t pathDataCapacity;
+};
+
+struct saver {
+  struct fluffyvm* vm;
+  struct writer out;
+
+  struct saved_bytecode* bytecodes;
+  int bytecodesCount;
+  int bytecodesCapacity;
+
+  // Every value which got record to its
+  // index, also keeps them alive
+  struct value ids;
+  foxgc_root_reference_t* idsRootRef;
+
+  // Written in index order, writing one
+  // may add more
+  struct record* records;
+  int recordsCount;
+  int recordsCapacity;
+};
+
+static bool addRecord(struct saver* this, struct record record, uint32_t* index) {
+  if (this->recordsCount == this->recordsCapacity) {
+    int capacity = this->recordsCapacity > 0 ? this->recordsCapacity * 2 : 64;
+    struct record* tmp = realloc(this->records, sizeof(*tmp) * capacity);
+    if (!tmp) {
+      fluffyvm_set_errmsg(this->vm, this->vm->staticStrings.outOfMemory);
+      return false;
+    }
+    this->records = tmp;
+    this->recordsCapacity = capacity;
+  }
+
+  *index = this->recordsCount;
+  this->records[this->recordsCount++] = record;
+  return true;
+}
+
+static bool internValue(struct saver* this, struct value val, uint32_t* index) {
+  struct fluffyvm* vm = this->vm;
+  // Ids are integers so never rooted
+  struct value existing = value_table_get(vm, this->ids, val, NULL);
+  if (existing.type == FLUFFYVM_TVALUE_LONG) {
+    *index = (uint32_t) existing.data.longNum;
+    return true;
+  }
+
+  struct record record = {
+    .value = val,
+    .bytecode = NULL
+  };
+
+  switch (val.type) {
+    case FLUFFYVM_TVALUE_STRING:
+      record.kind = RECORD_STRING;
+      break;
+    case FLUFFYVM_TVALUE_TABLE:
+      record.kind = RECORD_TABLE;
+      break;
+    case FLUFFYVM_TVALUE_CLOSURE:
+      record.kind = val.data.closure->isNative ? RECORD_NATIVE_CLOSURE : RECORD_BYTECODE_CLOSURE;
+      break;
+    default:
+      fluffyvm_set_errmsg_printf(vm, "cannot snapshot '%s'", value_get_string(value_typename(vm, val)));
+      return false;
+  }
+
+  return addRecord(this, record, index) &&
+         value_table_set(vm, this->ids, val, value_new_long(vm, *index));
+}
+
+static bool grow(void** array, size_t* capacity, size_t needed, size_t elementSize) {
+  if (needed <= *capacity)
+    return true;
+
+  size_t newCapacity = *capacity > 0 ? *capacity : 16;
+  while (newCapacity < needed)
+    newCapacity *= 2;
+
+  void* tmp = realloc(*array, newCapacity * elementSize);
+  if (!tmp)
+    return false;
+  *array = tmp;
+  *capacity = newCapacity;
+  return true;
+}
+
+// Only children already built are visited,
+// closures can only exist for those
+static bool collectPaths(struct saved_bytecode* this, struct fluffyvm_prototype* proto, uint32_t* path, int depth) {
+  if (!grow((void**) &this->paths, &this->pathsCapacity, this->pathsCount + 1, sizeof(*this->paths)) ||
+      !grow((void**) &this->pathData, &this->pathDataCapacity, this->pathDataLen + depth, sizeof(*this->pathData)))
+    return false;
+
+  this->paths[this->pathsCount++] = (struct prototype_path) {
+    .prototype = proto,
+    .offset = this->pathDataLen,
+    .depth = depth
+  };
+  if (depth > 0)
+    memcpy(this->pathData + this->pathDataLen, path, sizeof(*path) * depth);
+  this->pathDataLen += depth;
+
+  if (depth == MAX_PROTOTYPE_DEPTH)
+    return true;
+
+  for (size_t i = 0; i < proto->prototypes_len; i++) {
+    struct fluffyvm_prototype* child = bytecode_prototype_peek_child(proto, i);
+    if (!child)
+      continue;
+
+    path[depth] = i;
+    if (!collectPaths(this, child, path, depth + 1))
+      return false;
+  }
+  return true;
+}
+
+static int comparePaths(const void* a, const void* b) {
+  uintptr_t protoA = (uintptr_t) ((const struct prototype_path*) a)->prototype;
+  uintptr_t protoB = (uintptr_t) ((const struct prototype_path*) b)->prototype;
+  return (protoA > protoB) - (protoA < protoB);
+}
+
+// Few bytecodes per VM so linear search
+static struct saved_bytecode* internBytecode(struct saver* this, struct fluffyvm_bytecode* bytecode) {
+  for (int i = 0; i < this->bytecodesCount; i++)
+    if (this->bytecodes[i].bytecode == bytecode)
+      return &this->bytecodes[i];
+
+  if (this->bytecodesCount == this->bytecodesCapacity) {
+    int capacity = this->bytecodesCapacity > 0 ? this->bytecodesCapacity * 2 : 4;
+    struct saved_bytecode* tmp = realloc(this->bytecodes, sizeof(*tmp) * capacity);
+    if (!tmp)
+      goto no_memory;
+    this->bytecodes = tmp;
+    this->bytecodesCapacity = capacity;
+  }
+
+  struct saved_bytecode* saved = &this->bytecodes[this->bytecodesCount];
+  *saved = (struct saved_bytecode) {
+    .bytecode = bytecode
+  };
+
+  uint32_t path[MAX_PROTOTYPE_DEPTH];
+  if (!collectPaths(saved, bytecode->mainPrototype, path, 0)) {
+    free(saved->paths);
+    free(saved->pathData);
+    goto no_memory;
+  }
+  qsort(saved->paths, saved->pathsCount, sizeof(*saved->paths), comparePaths);
+
+  struct record record = {
+    .kind = RECORD_BYTECODE,
+    .value = value_not_present,
+    .bytecode = bytecode
+  };
+  if (!addRecord(this, record, &saved->index)) {
+    free(saved->paths);
+    free(saved->pathData);
+    return NULL;
+  }
+
+  this->bytecodesCount++;
+  return saved;
+
+  no_memory:
+  fluffyvm_set_errmsg(this->vm, this->vm->staticStrings.outOfMemory);
+  return NULL;
+}
+
+static bool writeValue(struct saver* this, struct value val) {
+  uint32_t index;
+  switch (val.type) {
+    case FLUFFYVM_TVALUE_NIL:
+      put8(&this->out, TAG_NIL);
+      return true;
+    case FLUFFYVM_TVALUE_BOOL:
+      put8(&this->out, val.data.boolean ? TAG_TRUE : TAG_FALSE);
+      return true;
+    case FLUFFYVM_TVALUE_LONG:
+      put8(&this->out, TAG_LONG);
+      put64(&this->out, (uint64_t) val.data.longNum);
+      return true;
+    case FLUFFYVM_TVALUE_DOUBLE: {
+      uint64_t bits;
+      memcpy(&bits, &val.data.doubleData, sizeof(bits));
+      put8(&this->out, TAG_DOUBLE);
+      put64(&this->out, bits);
+      return true;
+    }
+    default:
+      if (!internValue(this, val, &index))
+        return false;
+      put8(&this->out, TAG_REFERENCE);
+      put32(&this->out, index);
+      return true;
+  }
+}
+
+static bool writeTable(struct saver* this, struct value table) {
+  struct fluffyvm* vm = this->vm;
+  struct hashtable* hashtable = foxgc_api_object_get_data(table.data.table);
+
+  // Count patched after iterating
+  size_t countOffset = this->out.len;
+  put32(&this->out, 0);
+
+  uint32_t count = 0;
+  struct value key = hashtable_next(vm, hashtable, value_not_present);
+  for (; key.type != FLUFFYVM_TVALUE_NOT_PRESENT; key = hashtable_next(vm, hashtable, key)) {
+    foxgc_root_reference_t* valRootRef = NULL;
+    struct value val = hashtable_get(vm, hashtable, key, &valRootRef);
+    if (val.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+      continue;
+
+    // Interning keeps `val` alive after this
+    bool res = writeValue(this, key) && writeValue(this, val);
+    if (valRootRef)
+      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), valRootRef);
+    if (!res)
+      return false;
+    count++;
+  }
+
+  if (!this->out.failed)
+    set32(this->out.data + countOffset, count);
+  return true;
+}
+
+static bool writeBytecodeClosure(struct saver* this, struct fluffyvm_closure* closure) {
+  struct fluffyvm* vm = this->vm;
+  struct saved_bytecode* saved = internBytecode(this, closure->prototype->bytecode);
+  if (!saved)
+    return false;
+
+  struct prototype_path key = {
+    .prototype = closure->prototype
+  };
+  struct prototype_path* found = bsearch(&key, saved->paths, saved->pathsCount, sizeof(*saved->paths), comparePaths);
+  if (!found) {
+    fluffyvm_set_errmsg_printf(vm, "cannot snapshot function nested too deep");
+    return false;
+  }
+
+  // Paths never move once built but
+  // `saved` may when env interns more
+  const uint32_t* pathData = saved->pathData;
+  size_t offset = found->offset;
+  int depth = found->depth;
+
+  put32(&this->out, saved->index);
+  if (!writeValue(this, closure->env))
+    return false;
+
+  put32(&this->out, depth);
+  for (int i = 0; i < depth; i++)
+    put32(&this->out, pathData[offset + i]);
+  return true;
+}
+
+static bool writeNativeClosure(struct saver* this, struct fluffyvm_closure* closure) {
+  struct fluffyvm* vm = this->vm;
+  struct snapshot_static_data* data = vm->snapshotStaticData;
+
+  // Copied so registry can change meanwhile
+  char* name = NULL;
+  pthread_mutex_lock(&data->nativesLock);
+  for (int i = 0; i < data->nativesCount; i++) {
+    if (data->natives[i].func == closure->func && data->natives[i].udata == closure->udata) {
+      name = strdup(data->natives[i].name);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&data->nativesLock);
+
+  if (!name) {
+    fluffyvm_set_errmsg_printf(vm, "cannot snapshot native function not registered with snapshot_register_native");
+    return false;
+  }
+
+  bool res = writeValue(this, closure->env);
+  put32(&this->out, strlen(name));
+  putBytes(&this->out, name, strlen(name));
+  free(name);
+  return res;
+}
+
+static bool writeBytecode(struct saver* this, struct fluffyvm_bytecode* bytecode) {
+  void* image = NULL;
+  size_t len = 0;
+  if (!bytecode_loader_image_save(this->vm, bytecode, 0, &image, &len))
+    return false;
+  putBytes(&this->out, image, len);
+  free(image);
+  return true;
+}
+
+static bool writeRecord(struct saver* this, int index) {
+  // Copy as writing can grow `records`
+  struct record record = this->records[index];
+
+  put8(&this->out, record.kind);
+  size_t lengthOffset = this->out.len;
+  put32(&this->out, 0);
+
+  bool res = false;
+  switch (record.kind) {
+    case RECORD_STRING:
+      putBytes(&this->out, value_get_string(record.value), value_get_len(record.value));
+      res = true;
+      break;
+    case RECORD_TABLE:
+      res = writeTable(this, record.value);
+      break;
+    case RECORD_BYTECODE:
+      res = writeBytecode(this, record.bytecode);
+      break;
+    case RECORD_BYTECODE_CLOSURE:
+      res = writeBytecodeClosure(this, record.value.data.closure);
+      break;
+    case RECORD_NATIVE_CLOSURE:
+      res = writeNativeClosure(this, record.value.data.closure);
+      break;
+  }
+
+  if (!res || this->out.failed)
+    return res;
+
+  size_t len = this->out.len - lengthOffset - 4;
+  if (len > UINT32_MAX) {
+    fluffyvm_set_errmsg_printf(this->vm, "cannot snapshot object larger than 4 GiB");
+    return false;
+  }
+  set32(this->out.data + lengthOffset, len);
+  return true;
+}
+
+bool snapshot_save(struct fluffyvm* vm, void** result, size_t* len) {
+  struct saver saver = {
+    .vm = vm,
+    .out = {},
+    .idsRootRef = NULL,
+    .bytecodes = NULL,
+    .bytecodesCount = 0,
+    .bytecodesCapacity = 0,
+    .records = NULL,
+    .recordsCount = 0,
+    .recordsCapacity = 0
+  };
+  bool res = false;
+
+  saver.ids = value_new_table(vm, FLUFFYVM_HASHTABLE_DEFAULT_LOAD_FACTOR, 64, &saver.idsRootRef);
+  if (saver.ids.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    return false;
+
+  // Record count patched at the end
+  putBytes(&saver.out, SNAPSHOT_MAGIC, 4);
+  put8(&saver.out, SNAPSHOT_VERSION & 0xFF);
+  put8(&saver.out, SNAPSHOT_VERSION >> 8);
+  put8(&saver.out, 0);
+  put8(&saver.out, 0);
+  put32(&saver.out, FLUFFYVM_RELEASE_NUM);
+  put32(&saver.out, 0);
+
+  uint32_t rootIndex;
+  if (!internValue(&saver, fluffyvm_get_global(vm), &rootIndex))
+    goto error;
+
+  for (int i = 0; i < saver.recordsCount; i++)
+    if (!writeRecord(&saver, i))
+      goto error;
+
+  if (saver.out.failed) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    goto error;
+  }
+
+  set32(saver.out.data + 12, saver.recordsCount);
+  *result = saver.out.data;
+  *len = saver.out.len;
+  saver.out.data = NULL;
+  res = true;
+
+  error:
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), saver.idsRootRef);
+  for (int i = 0; i < saver.bytecodesCount; i++) {
+    free(saver.bytecodes[i].paths);
+    free(saver.bytecodes[i].pathData);
+  }
+  free(saver.bytecodes);
+  free(saver.records);
+  free(saver.out.data);
+  return res;
+}
+
+////////////////////////////////////////
+// Restoring                          //
+////////////////////////////////////////
+
+struct reader {
+  uint8_t* pos;
+  uint8_t* end;
+};
+
+struct entry {
+  enum record_kind kind;
+  struct reader data;
+
+  // Bytecode records have no value
+  struct value value;
+  struct fluffyvm_bytecode* bytecode;
+  foxgc_root_reference_t* rootRef;
+};
+
+static bool get8(struct reader* this, uint8_t* result) {
+  if (this->end - this->pos < 1)
+    return false;
+  *result = *this->pos++;
+  return true;
+}
+
+static bool get32(struct reader* this, uint32_t* result) {
+  if (this->end - this->pos < 4)
+    return false;
+  *result = binary_u32_little(this->pos);
+  this->pos += 4;
+  return true;
+}
+
+static bool get64(struct reader* this, uint64_t* result) {
+  if (this->end - this->pos < 8)
+    return false;
+  *result = binary_u64_little(this->pos);
+  this->pos += 8;
+  return true;
+}
+
+static bool readValue(struct fluffyvm* vm, struct reader* reader, struct entry* entries, uint32_t count, struct value* result) {
+  uint8_t tag;
+  uint64_t bits;
+  uint32_t index;
+  if (!get8(reader, &tag))
+    return false;
+
+  switch (tag) {
+    case TAG_NIL:
+      *result = value_nil;
+      return true;
+    case TAG_FALSE:
+    case TAG_TRUE:
+      *result = value_new_bool(vm, tag == TAG_TRUE);
+      return true;
+    case TAG_LONG:
+      if (!get64(reader, &bits))
+        return false;
+      *result = value_new_long(vm, (fluffyvm_integer) (int64_t) bits);
+      return true;
+    case TAG_DOUBLE: {
+      if (!get64(reader, &bits))
+        return false;
+      fluffyvm_number num;
+      memcpy(&num, &bits, sizeof(num));
+      *result = value_new_double(vm, num);
+      return true;
+    }
+    case TAG_REFERENCE:
+      if (!get32(reader, &index) || index >= count)
+        return false;
+      *result = entries[index].value;
+      return result->type != FLUFFYVM_TVALUE_NOT_PRESENT;
+  }
+  return false;
+}
+
+// Tables, strings and bytecodes first as
+// closures need them
+static bool createObject(struct fluffyvm* vm, struct entry* entry) {
+  struct reader data = entry->data;
+  uint32_t pairs;
+
+  switch (entry->kind) {
+    case RECORD_STRING:
+      entry->value = value_new_string2(vm, (char*) data.pos, data.end - data.pos, &entry->rootRef);
+      return entry->value.type != FLUFFYVM_TVALUE_NOT_PRESENT;
+    case RECORD_TABLE: {
+      if (!get32(&data, &pairs))
+        goto invalid;
+
+      int capacity = 16;
+      while ((uint32_t) capacity < pairs && capacity < (1 << 24))
+        capacity <<= 1;
+      entry->value = value_new_table(vm, FLUFFYVM_HASHTABLE_DEFAULT_LOAD_FACTOR, capacity, &entry->rootRef);
+      return entry->value.type != FLUFFYVM_TVALUE_NOT_PRESENT;
+    }
+    case RECORD_BYTECODE:
+      entry->bytecode = bytecode_loader_image_load(vm, &entry->rootRef, data.pos, data.end - data.pos);
+      return entry->bytecode != NULL;
+    case RECORD_BYTECODE_CLOSURE:
+    case RECORD_NATIVE_CLOSURE:
+      return true;
+  }
+
+  invalid:
+  fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+  return false;
+}
+
+static bool createClosure(struct fluffyvm* vm, struct entry* entries, uint32_t count, struct entry* entry) {
+  struct reader data = entry->data;
+  struct fluffyvm_closure* closure = NULL;
+  struct value env;
+
+  if (entry->kind == RECORD_BYTECODE_CLOSURE) {
+    uint32_t bytecodeIndex;
+    uint32_t depth;
+    if (!get32(&data, &bytecodeIndex) || bytecodeIndex >= count || !entries[bytecodeIndex].bytecode)
+      goto invalid;
+    if (!readValue(vm, &data, entries, count, &env) || !get32(&data, &depth))
+      goto invalid;
+
+    struct fluffyvm_prototype* proto = entries[bytecodeIndex].bytecode->mainPrototype;
+    for (uint32_t i = 0; i < depth; i++) {
+      uint32_t child;
+      if (!get32(&data, &child) || child >= proto->prototypes_len)
+        goto invalid;
+      proto = bytecode_prototype_get_child(vm, proto, child);
+      if (!proto)
+        return false;
+    }
+
+    if (env.type != FLUFFYVM_TVALUE_TABLE && env.type != FLUFFYVM_TVALUE_NIL)
+      goto invalid;
+    closure = closure_new(vm, &entry->rootRef, proto, env);
+  } else {
+    uint32_t nameLen;
+    if (!readValue(vm, &data, entries, count, &env) || !get32(&data, &nameLen) || nameLen != (size_t) (data.end - data.pos))
+      goto invalid;
+    if (env.type != FLUFFYVM_TVALUE_TABLE && env.type != FLUFFYVM_TVALUE_NIL)
+      goto invalid;
+
+    struct snapshot_static_data* staticData = vm->snapshotStaticData;
+    struct snapshot_native native = {};
+    bool found = false;
+    pthread_mutex_lock(&staticData->nativesLock);
+    for (int i = 0; i < staticData->nativesCount; i++) {
+      if (strlen(staticData->natives[i].name) == nameLen && memcmp(staticData->natives[i].name, data.pos, nameLen) == 0) {
+        native = staticData->natives[i];
+        found = true;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&staticData->nativesLock);
+
+    if (!found) {
+      fluffyvm_set_errmsg_printf(vm, "native function '%.*s' not registered", (int) nameLen, (char*) data.pos);
+      return false;
+    }
+    closure = closure_from_cfunction(vm, &entry->rootRef, native.func, native.udata, NULL, env);
+    if (closure)
+      closure_set_need_fiber(closure, native.needFiber);
+  }
+
+  if (!closure)
+    return false;
+  entry->value = value_new_closure(vm, closure);
+  return true;
+
+  invalid:
+  fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+  return false;
+}
+
+static bool fillTable(struct fluffyvm* vm, struct entry* entries, uint32_t count, struct entry* entry) {
+  struct reader data = entry->data;
+  uint32_t pairs;
+  if (!get32(&data, &pairs))
+    goto invalid;
+
+  for (uint32_t i = 0; i < pairs; i++) {
+    struct value key;
+    struct value val;
+    if (!readValue(vm, &data, entries, count, &key) || !readValue(vm, &data, entries, count, &val) || key.type == FLUFFYVM_TVALUE_NIL)
+      goto invalid;
+    if (!value_table_set(vm, entry->value, key, val))
+      return false;
+  }
+  return true;
+
+  invalid:
+  fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+  return false;
+}
+
+bool snapshot_restore(struct fluffyvm* vm, const void* buffer, size_t len) {
+  struct reader reader = {
+    .pos = (uint8_t*) buffer,
+    .end = (uint8_t*) buffer + len
+  };
+
+  if (len < HEADER_SIZE || memcmp(buffer, SNAPSHOT_MAGIC, 4) != 0) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+    return false;
+  }
+
+  if (binary_u16_little(reader.pos + 4) != SNAPSHOT_VERSION || binary_u32_little(reader.pos + 8) != FLUFFYVM_RELEASE_NUM) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.unsupportedBytecode);
+    return false;
+  }
+
+  // Each record at least 5 bytes
+  uint32_t count = binary_u32_little(reader.pos + 12);
+  reader.pos += HEADER_SIZE;
+  if (count == 0 || count > (len - HEADER_SIZE) / 5) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+    return false;
+  }
+
+  struct entry* entries = calloc(count, sizeof(*entries));
+  if (!entries) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return false;
+  }
+
+  bool res = false;
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t kind;
+    uint32_t recordLen;
+    if (!get8(&reader, &kind) || !get32(&reader, &recordLen) || recordLen > (size_t) (reader.end - reader.pos) || kind < RECORD_STRING || kind > RECORD_NATIVE_CLOSURE) {
+      fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+      goto error;
+    }
+
+    entries[i].kind = kind;
+    entries[i].data.pos = reader.pos;
+    entries[i].data.end = reader.pos + recordLen;
+    entries[i].value = value_not_present;
+    reader.pos += recordLen;
+  }
+
+  for (uint32_t i = 0; i < count; i++)
+    if (!createObject(vm, &entries[i]))
+      goto error;
+
+  for (uint32_t i = 0; i < count; i++)
+    if ((entries[i].kind == RECORD_BYTECODE_CLOSURE || entries[i].kind == RECORD_NATIVE_CLOSURE) && !createClosure(vm, entries, count, &entries[i]))
+      goto error;
+
+  for (uint32_t i = 0; i < count; i++)
+    if (entries[i].kind == RECORD_TABLE && !fillTable(vm, entries, count, &entries[i]))
+      goto error;
+
+  if (entries[0].kind != RECORD_TABLE) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.invalidBytecode);
+    goto error;
+  }
+
+  fluffyvm_replace_global(vm, entries[0].value);
+  res = true;
+
+  error:
+  for (uint32_t i = 0; i < count; i++)
+    if (entries[i].rootRef)
+      foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), entries[i].rootRef);
+  free(entries);
+  return res;
+}
+
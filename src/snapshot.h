@@ -0,0 +1,72 @@
+#ifndef header_1655889310_snapshot_h
+#define header_1655889310_snapshot_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "closure.h"
+#include "fluffyvm.h"
+
+// VM state snapshot
+//
+// Serialize everything reachable from the
+// global table so new VM can start from it
+// instead of rerunning script initialization
+//
+// Saved are nil, booleans, numbers, strings,
+// tables (shared and cyclic references kept)
+// and closures. Bytecode closures saved with
+// their bytecode as image (see image.h) and
+// native ones by name given to
+// `snapshot_register_native`. Userdata and
+// coroutines cant be saved
+//
+// Format (all little endian):
+//  * Header (16 bytes)
+//      u8[4] magic "FVMS"
+//      u16   format version (1)
+//      u16   reserved
+//      u32   FLUFFYVM_RELEASE_NUM
+//      u32   number of records
+//  * Records, first one is the global table
+//      u8    kind (1 string, 2 table, 3 bytecode,
+//            4 bytecode closure, 5 native closure)
+//      u32   length of the rest
+//      ...   kind specific, references to other
+//            records are their index
+//
+// Restore create all records first then fill
+// tables so order of records doesnt matter
+
+struct snapshot_native {
+  char* name;
+  closure_cfunction_t func;
+  void* udata;
+  bool needFiber;
+};
+
+bool snapshot_init(struct fluffyvm* vm);
+void snapshot_cleanup(struct fluffyvm* vm);
+
+// Closures of `func` with `udata` saved as
+// "`module`.`name`" (just `name` if `module`
+// is NULL), VM restoring must register same
+// name. Registering name again replace it
+bool snapshot_register_native(struct fluffyvm* vm, const char* module, const char* name, closure_cfunction_t func, void* udata);
+// Same but restored closures get `needFiber`
+// (see `closure_set_need_fiber`)
+bool snapshot_register_native2(struct fluffyvm* vm, const char* module, const char* name, closure_cfunction_t func, void* udata, bool needFiber);
+
+// Serialize into new malloc'ed buffer, other
+// threads must not change the state meanwhile
+// Return false on error (errmsg set)
+bool snapshot_save(struct fluffyvm* vm, void** result, size_t* len);
+
+// Replace global table of `vm` with the
+// one in snapshot (main thread _ENV too),
+// `buffer` not used after
+// Return false on error (errmsg set)
+bool snapshot_restore(struct fluffyvm* vm, const void* buffer, size_t len);
+
+#endif
+
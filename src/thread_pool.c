@@ -0,0 +1,397 @@
+#define FLUFFYVM_INTERNAL
+
+#include <Block.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+
+#include "closure.h"
+#include "collections/queue.h"
+#include "config.h"
+#include "coroutine.h"
+#include "fluffyvm.h"
+#include "interpreter.h"
+#include "thread_pool.h"
+#include "util/util.h"
+#include "value.h"
+
+#define UNIQUE_KEY(name) static uintptr_t name = (uintptr_t) &name
+
+UNIQUE_KEY(valuesArrayTypeKey);
+
+struct job {
+  // The closure at index 0 then arguments
+  int count;
+  struct value* values;
+  foxgc_root_reference_t* rootRef;
+
+  struct fluffyvm_future* future;
+};
+
+bool thread_pool_init(struct fluffyvm* vm) {
+  struct thread_pool* this = malloc(sizeof(*this));
+  vm->threadPool = this;
+  if (!this)
+    return false;
+
+  int threadCount = FLUFFYVM_THREAD_POOL_SIZE;
+  if (threadCount <= 0)
+    threadCount = util_get_online_core_count();
+  if (threadCount <= 0)
+    threadCount = 1;
+
+  this->vm = vm;
+  this->threadCount = threadCount;
+  this->startedCount = 0;
+  this->hasShutdown = false;
+  this->isQuiescing = false;
+  this->submitting = 0;
+  pthread_mutex_init(&this->startLock, NULL);
+  pthread_cond_init(&this->stateChanged, NULL);
+  pthread_mutex_init(&this->rootLock, NULL);
+  pthread_key_create(&this->workerKey, NULL);
+
+  this->threads = malloc(sizeof(*this->threads) * threadCount);
+  this->jobs = queue_new(FLUFFYVM_THREAD_POOL_QUEUE_SIZE);
+  this->root = foxgc_api_new_root(vm->heap);
+  return this->threads && this->jobs && this->root;
+}
+
+// Caller hold `startLock`, return number
+// of threads to stop with the lock released
+static int beginStop(struct thread_pool* this) {
+  // Queue is FIFO so sentinels come after
+  // every job already submitted
+  while (this->submitting > 0)
+    pthread_cond_wait(&this->stateChanged, &this->startLock);
+  int count = this->startedCount;
+  pthread_mutex_unlock(&this->startLock);
+  return count;
+}
+
+// Joined without `startLock` so running
+// jobs can still submit (and fail)
+static void stopThreads(struct thread_pool* this, int count) {
+  for (int i = 0; i < count; i++)
+    queue_enqueue(this->jobs, NULL);
+  for (int i = 0; i < count; i++)
+    pthread_join(this->threads[i], NULL);
+}
+
+void thread_pool_shutdown(struct fluffyvm* vm) {
+  struct thread_pool* this = vm->threadPool;
+  if (!this)
+    return;
+
+  pthread_mutex_lock(&this->startLock);
+  while (this->isQuiescing)
+    pthread_cond_wait(&this->stateChanged, &this->startLock);
+
+  bool hasShutdown = this->hasShutdown;
+  this->hasShutdown = true;
+  if (hasShutdown) {
+    pthread_mutex_unlock(&this->startLock);
+    return;
+  }
+
+  stopThreads(this, beginStop(this));
+}
+
+void thread_pool_quiesce(struct fluffyvm* vm) {
+  struct thread_pool* this = vm->threadPool;
+
+  pthread_mutex_lock(&this->startLock);
+  while (this->isQuiescing)
+    pthread_cond_wait(&this->stateChanged, &this->startLock);
+
+  if (this->hasShutdown) {
+    pthread_mutex_unlock(&this->startLock);
+    return;
+  }
+
+  this->isQuiescing = true;
+  stopThreads(this, beginStop(this));
+
+  pthread_mutex_lock(&this->startLock);
+  this->startedCount = 0;
+  this->isQuiescing = false;
+  pthread_cond_broadcast(&this->stateChanged);
+  pthread_mutex_unlock(&this->startLock);
+}
+
+void thread_pool_cleanup(struct fluffyvm* vm) {
+  struct thread_pool* this = vm->threadPool;
+  if (!this)
+    return;
+
+  if (this->jobs) {
+    thread_pool_shutdown(vm);
+    queue_destroy(this->jobs);
+  }
+
+  if (this->root)
+    foxgc_api_delete_root(vm->heap, this->root);
+
+  pthread_mutex_destroy(&this->startLock);
+  pthread_cond_destroy(&this->stateChanged);
+  pthread_mutex_destroy(&this->rootLock);
+  pthread_key_delete(this->workerKey);
+  free(this->threads);
+  free(this);
+}
+
+// Keep objects referenced by `values` alive
+// in pool's root as they may not belong to
+// any thread for a while
+static bool rootValues(struct thread_pool* this, struct value* values, int count, foxgc_root_reference_t** rootRef) {
+  struct fluffyvm* vm = this->vm;
+  foxgc_root_reference_t* tmpRef = NULL;
+  foxgc_object_t* array = foxgc_api_new_array(vm->heap, fluffyvm_get_owner_key(), valuesArrayTypeKey, NULL, fluffyvm_get_root(vm), &tmpRef, count > 0 ? count : 1, NULL);
+  if (!array) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return false;
+  }
+
+  for (int i = 0; i < count; i++)
+    foxgc_api_write_array(array, i, value_get_object_ptr(values[i]));
+
+  pthread_mutex_lock(&this->rootLock);
+  foxgc_api_root_add(vm->heap, array, this->root, rootRef);
+  pthread_mutex_unlock(&this->rootLock);
+  foxgc_api_remove_from_root2(vm->heap, fluffyvm_get_root(vm), tmpRef);
+  return true;
+}
+
+static void unrootValues(struct thread_pool* this, foxgc_root_reference_t* rootRef) {
+  if (!rootRef)
+    return;
+
+  pthread_mutex_lock(&this->rootLock);
+  foxgc_api_remove_from_root2(this->vm->heap, this->root, rootRef);
+  pthread_mutex_unlock(&this->rootLock);
+}
+
+static void completeFuture(struct fluffyvm_future* future, bool hasError) {
+  pthread_mutex_lock(&future->lock);
+  future->hasError = hasError;
+  atomic_store(&future->isDone, true);
+  pthread_cond_broadcast(&future->doneSignal);
+  pthread_mutex_unlock(&future->lock);
+
+  // Drop pool's reference
+  future_release(future);
+}
+
+static void runJob(struct thread_pool* this, struct job* job) {
+  struct fluffyvm* vm = this->vm;
+  struct fluffyvm_future* future = job->future;
+
+  // Thread's main coroutine, stays on
+  // its native function forever
+  struct fluffyvm_call_state* callState = fluffyvm_get_executing_coroutine(vm)->currentCallState;
+  int base = callState->sp;
+
+  struct value* values = job->values;
+  int nargs = job->count - 1;
+  bool res = interpreter_xpcall(vm, ^void () {
+    for (int i = 1; i <= nargs; i++)
+      if (!interpreter_push(vm, callState, values[i]))
+        interpreter_error(vm, fluffyvm_get_errmsg(vm));
+    interpreter_call(vm, values[0], nargs, -1);
+  }, NULL);
+
+  if (res) {
+    int resultCount = callState->sp - base;
+    struct value* results = malloc(sizeof(*results) * (resultCount > 0 ? resultCount : 1));
+    for (int i = 0; results && i < resultCount; i++)
+      results[i] = callState->generalStack[base + i];
+
+    // Root before popping as stack is
+    // the one keeping them alive now
+    if (results && rootValues(this, results, resultCount, &future->resultsRootRef)) {
+      future->results = results;
+      future->resultCount = resultCount;
+    } else {
+      free(results);
+      res = false;
+      fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    }
+  }
+
+  if (!res) {
+    future->error = fluffyvm_get_errmsg(vm);
+    // Static strings need no rooting
+    if (!rootValues(this, &future->error, 1, &future->resultsRootRef))
+      future->error = vm->staticStrings.outOfMemory;
+  }
+
+  while (callState->sp > base)
+    interpreter_pop(vm, callState, NULL, NULL);
+  fluffyvm_clear_errmsg(vm);
+
+  unrootValues(this, job->rootRef);
+  free(job->values);
+  free(job);
+  completeFuture(future, !res);
+}
+
+static void workerLoop(struct thread_pool* this) {
+  pthread_setspecific(this->workerKey, this);
+  while (true) {
+    struct job* job = NULL;
+    queue_remove(this->jobs, (void**) &job);
+    if (!job)
+      break;
+
+    runJob(this, job);
+  }
+}
+
+// Caller hold `startLock`
+static bool startThreads(struct thread_pool* this) {
+  for (int i = this->startedCount; i < this->threadCount; i++) {
+    fluffyvm_thread_routine_t routine = ^void* (void* args) {
+      prctl(PR_SET_NAME, "Thread Pool");
+      workerLoop(this);
+      return NULL;
+    };
+
+    if (!fluffyvm_start_thread(this->vm, &this->threads[i], NULL, Block_copy(routine), NULL))
+      return false;
+    this->startedCount++;
+  }
+
+  return true;
+}
+
+struct fluffyvm_future* thread_pool_submit(struct fluffyvm* vm, struct fluffyvm_closure* closure, int nargs, struct value* args) {
+  struct thread_pool* this = vm->threadPool;
+
+  struct job* job = malloc(sizeof(*job));
+  struct fluffyvm_future* future = malloc(sizeof(*future));
+  struct value* values = malloc(sizeof(*values) * (nargs + 1));
+  if (!job || !future || !values) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    goto error;
+  }
+
+  values[0] = value_new_closure(vm, closure);
+  for (int i = 0; i < nargs; i++)
+    values[i + 1] = args[i];
+
+  job->count = nargs + 1;
+  job->values = values;
+  job->future = future;
+  if (!rootValues(this, values, job->count, &job->rootRef))
+    goto error;
+
+  future->owner = this;
+  future->hasError = false;
+  future->resultCount = 0;
+  future->results = NULL;
+  future->error = value_not_present;
+  future->resultsRootRef = NULL;
+  pthread_mutex_init(&future->lock, NULL);
+  pthread_cond_init(&future->doneSignal, NULL);
+  atomic_init(&future->isDone, false);
+
+  // One for pool and one for caller
+  atomic_init(&future->refCount, 2);
+
+  pthread_mutex_lock(&this->startLock);
+
+  // Worker would wait for its own job
+  // to finish
+  bool isWorker = thread_pool_is_worker(vm);
+  while (this->isQuiescing && !isWorker)
+    pthread_cond_wait(&this->stateChanged, &this->startLock);
+
+  if (this->hasShutdown || this->isQuiescing) {
+    fluffyvm_set_errmsg(vm, this->hasShutdown ? vm->staticStrings.threadPoolShutDown : vm->staticStrings.threadPoolStopping);
+    pthread_mutex_unlock(&this->startLock);
+    goto error_rooted;
+  }
+
+  // Partially started pool retry the rest next time
+  if (this->startedCount != this->threadCount && !startThreads(this)) {
+    pthread_mutex_unlock(&this->startLock);
+    goto error_rooted;
+  }
+  this->submitting++;
+  pthread_mutex_unlock(&this->startLock);
+
+  // Blocks if queue full, its the backpressure
+  bool enqueued = true;
+  if (isWorker)
+    enqueued = queue_enqueue_nonblocking(this->jobs, job);
+  else
+    queue_enqueue(this->jobs, job);
+
+  pthread_mutex_lock(&this->startLock);
+  if (--this->submitting == 0)
+    pthread_cond_broadcast(&this->stateChanged);
+  pthread_mutex_unlock(&this->startLock);
+
+  if (!enqueued) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.threadPoolQueueFull);
+    goto error_rooted;
+  }
+  return future;
+
+  error_rooted:
+  unrootValues(this, job->rootRef);
+  pthread_mutex_destroy(&future->lock);
+  pthread_cond_destroy(&future->doneSignal);
+
+  error:
+  free(values);
+  free(future);
+  free(job);
+  return NULL;
+}
+
+bool thread_pool_is_worker(struct fluffyvm* vm) {
+  return pthread_getspecific(vm->threadPool->workerKey) != NULL;
+}
+
+bool future_wait(struct fluffyvm_future* this) {
+  pthread_mutex_lock(&this->lock);
+  while (!atomic_load(&this->isDone))
+    pthread_cond_wait(&this->doneSignal, &this->lock);
+  bool hasError = this->hasError;
+  pthread_mutex_unlock(&this->lock);
+  return !hasError;
+}
+
+bool future_is_done(struct fluffyvm_future* this) {
+  return atomic_load(&this->isDone);
+}
+
+int future_get_result_count(struct fluffyvm_future* this) {
+  return this->resultCount;
+}
+
+struct value future_get_result(struct fluffyvm_future* this, int index) {
+  if (index < 0 || index >= this->resultCount)
+    return value_nil;
+  return this->results[index];
+}
+
+bool future_has_error(struct fluffyvm_future* this) {
+  return this->hasError;
+}
+
+struct value future_get_error(struct fluffyvm_future* this) {
+  return this->error;
+}
+
+void future_release(struct fluffyvm_future* this) {
+  if (atomic_fetch_sub(&this->refCount, 1) != 1)
+    return;
+
+  unrootValues(this->owner, this->resultsRootRef);
+  free(this->results);
+  pthread_mutex_destroy(&this->lock);
+  pthread_cond_destroy(&this->doneSignal);
+  free(this);
+}
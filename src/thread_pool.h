@@ -0,0 +1,116 @@
+#ifndef header_1655545731_thread_pool_h
+#define header_1655545731_thread_pool_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "fluffyvm.h"
+#include "foxgc.h"
+#include "value.h"
+
+// VM owned pool of managed threads for
+// running closures without paying for
+// `fluffyvm_start_thread` on every call
+//
+// Threads started on first `fluffyvm_submit`
+// and stay initialized (root, coroutine stack,
+// main coroutine) until VM is freed. Closures
+// run on the thread's main coroutine so each
+// thread run one closure at a time
+
+struct queue;
+struct fluffyvm_closure;
+struct thread_pool;
+
+struct fluffyvm_future {
+  struct thread_pool* owner;
+  atomic_int refCount;
+
+  pthread_mutex_t lock;
+  pthread_cond_t doneSignal;
+  volatile atomic_bool isDone;
+  bool hasError;
+
+  int resultCount;
+  struct value* results;
+  struct value error;
+
+  // Keeps objects in `results` or `error`
+  // alive (rooted in pool's root)
+  foxgc_root_reference_t* resultsRootRef;
+};
+
+struct thread_pool {
+  struct fluffyvm* vm;
+
+  int threadCount;
+  pthread_t* threads;
+  int startedCount;
+
+  // Protect lazy start, shutdown and
+  // quiesce
+  pthread_mutex_t startLock;
+  bool hasShutdown;
+  bool isQuiescing;
+
+  // Submits enqueueing right now, the enqueue
+  // itself done without `startLock` as it may
+  // block. Sentinels only put in once this
+  // is 0 so no job land behind them
+  int submitting;
+  pthread_cond_t stateChanged;
+
+  // Set on pool's threads
+  pthread_key_t workerKey;
+
+  // Jobs to run, NULL tells thread to exit
+  struct queue* jobs;
+
+  // Queued closures and their arguments and
+  // results of futures are rooted here
+  // because they belong to no thread
+  pthread_mutex_t rootLock;
+  foxgc_root_t* root;
+};
+
+bool thread_pool_init(struct fluffyvm* vm);
+void thread_pool_cleanup(struct fluffyvm* vm);
+
+// Let queued jobs finish and stop threads
+// Nothing may be submitted after this
+void thread_pool_shutdown(struct fluffyvm* vm);
+
+// Same but threads start again on next
+// submit (see `fluffyvm_prefork`). Submit
+// from pool's thread fails while it runs
+// (the job may be what quiesce waits for)
+// and from other threads waits for it
+void thread_pool_quiesce(struct fluffyvm* vm);
+
+// Return NULL on error (errmsg set). Pool's
+// own threads never block on full queue, it
+// fails instead as they could all end up
+// waiting for each other
+struct fluffyvm_future* thread_pool_submit(struct fluffyvm* vm, struct fluffyvm_closure* closure, int nargs, struct value* args);
+
+// Caller is one of pool's threads, waiting
+// on futures there may deadlock the pool
+bool thread_pool_is_worker(struct fluffyvm* vm);
+
+// Block calling thread until done
+// Return false if the closure errored
+bool future_wait(struct fluffyvm_future* this);
+bool future_is_done(struct fluffyvm_future* this);
+
+// Only valid after done. Returned values
+// stay alive until `future_release`
+int future_get_result_count(struct fluffyvm_future* this);
+struct value future_get_result(struct fluffyvm_future* this, int index);
+bool future_has_error(struct fluffyvm_future* this);
+struct value future_get_error(struct fluffyvm_future* this);
+
+void future_release(struct fluffyvm_future* this);
+
+#endif
+
@@ -28,5 +28,15 @@ static inline uint32_t binary_u32_big(void* _data) {
          (data[1] << 16) | (data[0] << 24);
 }
 
+static inline uint64_t binary_u64_little(void* _data) {
+  uint8_t* data = (uint8_t*) _data;
+  return ((uint64_t) binary_u32_little(data + 4) << 32) | binary_u32_little(data);
+}
+
+static inline uint64_t binary_u64_big(void* _data) {
+  uint8_t* data = (uint8_t*) _data;
+  return ((uint64_t) binary_u32_big(data) << 32) | binary_u32_big(data + 4);
+}
+
 #endif
 
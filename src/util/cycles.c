@@ -0,0 +1,48 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cycles.h"
+
+static pthread_once_t calibrateOnce = PTHREAD_ONCE_INIT;
+static double ticksPerNs = 1.0;
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t monotonicNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+static void calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t startNs = monotonicNs();
+  uint64_t startTicks = cycles_now();
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 5 * 1000 * 1000
+  };
+  nanosleep(&delay, NULL);
+
+  uint64_t elapsedNs = monotonicNs() - startNs;
+  uint64_t elapsedTicks = cycles_now() - startTicks;
+  if (elapsedNs > 0 && elapsedTicks > 0)
+    ticksPerNs = (double) elapsedTicks / (double) elapsedNs;
+#elif defined(__aarch64__)
+  uint64_t frequency;
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r" (frequency));
+  if (frequency > 0)
+    ticksPerNs = (double) frequency / 1e9;
+#endif
+}
+
+uint64_t cycles_from_ns(uint64_t ns) {
+  pthread_once(&calibrateOnce, calibrate);
+
+  double ticks = (double) ns * ticksPerNs;
+  if (ticks >= (double) UINT64_MAX)
+    return UINT64_MAX;
+  return (uint64_t) ticks;
+}
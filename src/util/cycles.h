@@ -0,0 +1,36 @@
+#ifndef header_1655716208_util_cycles_h
+#define header_1655716208_util_cycles_h
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+// Cheap monotonic counter for checks done
+// too often for clock_gettime. TSC on x86
+// (assumed invariant, true for anything
+// recent), virtual counter on AArch64 and
+// nanoseconds from clock_gettime elsewhere
+static inline uint64_t cycles_now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t val;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r" (val));
+  return val;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Convert nanoseconds to counter ticks
+// First call on x86 sleep few miliseconds
+// to measure TSC rate
+uint64_t cycles_from_ns(uint64_t ns);
+
+#endif
+
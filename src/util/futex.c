@@ -0,0 +1,20 @@
+// For syscall()
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "futex.h"
+
+bool futex_wait(atomic_uint* addr, unsigned int expected, const struct timespec* timeout) {
+  long res = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+  return !(res < 0 && errno == ETIMEDOUT);
+}
+
+void futex_wake(atomic_uint* addr, int count) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
@@ -0,0 +1,20 @@
+#ifndef header_1655372104_util_futex_h
+#define header_1655372104_util_futex_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Thin wrapper around Linux futex
+// (private to the process)
+
+// Sleep while `*addr == expected`, can return
+// spuriously. `timeout` is relative and can
+// be NULL. Return false on timeout
+bool futex_wait(atomic_uint* addr, unsigned int expected, const struct timespec* timeout);
+
+// Wake up to `count` waiters on `addr`
+void futex_wake(atomic_uint* addr, int count);
+
+#endif
+
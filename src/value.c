@@ -1,3 +1,5 @@
+// For MAP_ANONYMOUS
+#define _DEFAULT_SOURCE
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,6 +9,10 @@
 #include <Block.h>
 #include <math.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "api_layer/types.h"
 #include "coroutine.h"
@@ -42,6 +48,20 @@ int value_get_module_id() {
 static void commonStringInit(struct value_string* str, foxgc_object_t* strObj) {
   str->hashCode = 0;
   str->str = strObj;
+  str->external = NULL;
+  str->externalLen = 0;
+}
+
+static const char* getStringData(struct value_string* str) {
+  if (str->external)
+    return str->external;
+  return foxgc_api_object_get_data(str->str);
+}
+
+static size_t getStringLen(struct value_string* str) {
+  if (str->external)
+    return str->externalLen;
+  return foxgc_api_get_array_length(str->str) - 1;
 }
 
 struct value value_string_allocator(struct fluffyvm* vm, const char* str, size_t len, foxgc_root_reference_t** rootRef, void* udata, runnable_t finalizer) {
@@ -83,6 +103,106 @@ struct value value_string_allocator(struct fluffyvm* vm, const char* str, size_t
   return value;
 }
 
+struct value value_new_string_external(struct fluffyvm* vm, const char* str, size_t len, bool hasNullTerminator, foxgc_root_reference_t** rootRef, runnable_t release) {
+  // Strings always null terminated so
+  // copy it if the bytes cant give that
+  if (!hasNullTerminator) {
+    struct value value = value_new_string2(vm, str, len, rootRef);
+    if (value.type != FLUFFYVM_TVALUE_NOT_PRESENT && release)
+      release();
+    return value;
+  }
+
+  struct value_string* strStruct = malloc(sizeof(*strStruct));
+  if (!strStruct) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    return value_not_present;
+  }
+
+  // Bytes not in the object, its only there
+  // so GC tell when the string is dead
+  if (release)
+    release = Block_copy(release);
+  foxgc_object_t* strObj = foxgc_api_new_data_array(vm->heap, fluffyvm_get_owner_key(), stringDataArrayKey, NULL, fluffyvm_get_root(vm), rootRef, 1, 1, Block_copy(^void (foxgc_object_t* obj) {
+    if (release) {
+      release();
+      Block_release(release);
+    }
+    free(strStruct);
+  }));
+
+  if (!strObj) {
+    fluffyvm_set_errmsg(vm, vm->staticStrings.outOfMemory);
+    if (release)
+      Block_release(release);
+    free(strStruct);
+    return value_not_present;
+  }
+
+  // Empty string if `str` is NULL
+  ((char*) foxgc_api_object_get_data(strObj))[0] = '\0';
+  commonStringInit(strStruct, strObj);
+  strStruct->external = str;
+  strStruct->externalLen = len;
+
+  struct value value = {
+    .data.str = strStruct,
+    .type = FLUFFYVM_TVALUE_STRING
+  };
+  return value;
+}
+
+struct value value_new_string_from_file(struct fluffyvm* vm, const char* path, foxgc_root_reference_t** rootRef) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fluffyvm_set_errmsg_printf(vm, "cannot open '%s': %s", path, strerror(errno));
+    return value_not_present;
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) < 0) {
+    fluffyvm_set_errmsg_printf(vm, "cannot stat '%s': %s", path, strerror(errno));
+    close(fd);
+    return value_not_present;
+  }
+  
+  // Cant map zero bytes
+  size_t len = status.st_size;
+  if (len == 0) {
+    close(fd);
+    return value_new_string2(vm, "", 0, rootRef);
+  }
+
+  // Reserve one more zeroed page than the
+  // file needs and map the file over its
+  // start so '\0' always follow the data
+  // even if file ends at page boundary
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t mappingLen = (len / pageSize + 1) * pageSize;
+  void* mapping = mmap(NULL, mappingLen, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    fluffyvm_set_errmsg_printf(vm, "cannot map '%s': %s", path, strerror(errno));
+    close(fd);
+    return value_not_present;
+  }
+
+  if (mmap(mapping, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    fluffyvm_set_errmsg_printf(vm, "cannot map '%s': %s", path, strerror(errno));
+    munmap(mapping, mappingLen);
+    close(fd);
+    return value_not_present;
+  }
+  close(fd);
+
+  struct value value = value_new_string_external(vm, mapping, len, true, rootRef, ^void () {
+    munmap(mapping, mappingLen);
+  });
+
+  if (value.type == FLUFFYVM_TVALUE_NOT_PRESENT)
+    munmap(mapping, mappingLen);
+  return value;
+}
+
 struct value value_new_string2(struct fluffyvm* vm, const char* str, size_t len, foxgc_root_reference_t** rootRef) {
   return value_string_allocator(vm, str, len, rootRef, NULL, NULL);
 }
@@ -94,6 +214,10 @@ struct value value_new_string(struct fluffyvm* vm, const char* cstr, foxgc_root_
 struct value value_new_string2_constant(struct fluffyvm* vm, const char* str, size_t len, foxgc_root_reference_t** rootRef) {
   if (!vm->stringCache)
     return value_string_allocator(vm, str, len, rootRef, NULL, NULL);
+
+  // Cache still usable without poller, just
+  // nothing cleaned up until it starts
+  fluffyvm_start_cache_poller(vm);
   return string_cache_create_string(vm, vm->stringCache, str, len, rootRef);
 }
 
@@ -255,8 +379,8 @@ bool value_hash_code(struct value value, uint64_t* hashCode) {
         break;
       }
       
-      void* data = foxgc_api_object_get_data(value.data.str->str);
-      size_t len = value_get_len(value);
+      const char* data = getStringData(value.data.str);
+      size_t len = getStringLen(value.data.str);
 
       hash = hashing_hash_default(data, len);
       value.data.str->hashCode = hash;
@@ -317,6 +441,8 @@ struct value value_new_coroutine(struct fluffyvm* vm, struct fluffyvm_closure* c
   return value;
 }
 struct value value_new_coroutine2(struct fluffyvm* vm, struct fluffyvm_coroutine* co) {
+  // Cant be recycled anymore
+  co->isExposed = true;
   struct value value = {
     .data.coroutine = co,
     .type = FLUFFYVM_TVALUE_COROUTINE
@@ -338,7 +464,7 @@ const char* value_get_string(struct value value) {
     return NULL;
   }
 
-  return (const char*) foxgc_api_object_get_data(value.data.str->str);
+  return getStringData(value.data.str);
 }
 
 size_t value_get_len(struct value value) {
@@ -346,7 +472,7 @@ size_t value_get_len(struct value value) {
 
   switch (value.type) {
     case FLUFFYVM_TVALUE_STRING:
-      return foxgc_api_get_array_length(value.data.str->str) - 1;
+      return getStringLen(value.data.str);
     case FLUFFYVM_TVALUE_TABLE:
       return ((struct hashtable*) foxgc_api_object_get_data(value.data.table))->usage;
     default:
@@ -512,9 +638,9 @@ struct value value_todouble(struct fluffyvm* vm, struct value value) {
   char* lastChar = NULL;
   double number = 0.0f;
   switch (value.type) {
-    case FLUFFYVM_TVALUE_STRING:
+    case FLUFFYVM_TVALUE_STRING: {
       errno = 0;
-      number = strtod(foxgc_api_object_get_data(value.data.str->str), &lastChar);
+      number = strtod(value_get_string(value), &lastChar);
       if (*lastChar != '\0') {
         fluffyvm_set_errmsg(vm, vm->staticStrings.strtodDidNotProcessAllTheData);
         return value_not_present;
@@ -546,6 +672,7 @@ struct value value_todouble(struct fluffyvm* vm, struct value value) {
         return value_not_present;
       } 
       break;
+    }
 
     case FLUFFYVM_TVALUE_LONG:
       number = (double) value.data.longNum;
@@ -629,7 +756,7 @@ bool value_equals_cstring(struct value op1, const char* str, size_t len) {
   if (op1Hash != op2Hash)
     return false;
 
-  if (memcmp(str, foxgc_api_object_get_data(op1.data.str->str), len) != 0)
+  if (memcmp(str, getStringData(op1.data.str), len) != 0)
     return false;
 
   return true;
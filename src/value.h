@@ -71,7 +71,12 @@ struct value_string {
   
   // const char*
   foxgc_object_t* str;
-  bool hasNullTerminator;
+
+  // Bytes outside of the heap for strings
+  // from `value_new_string_external`,
+  // NULL if they are in `str`
+  const char* external;
+  size_t externalLen;
 };
 
 typedef struct value {
@@ -94,6 +99,8 @@ typedef struct value {
   } data;
 } value_t;
 
+// Always null terminated but may have
+// embedded null, use the len
 const char* value_get_string(struct value value);
 size_t value_get_len(struct value value);
 
@@ -104,6 +111,24 @@ struct value value_string_allocator(struct fluffyvm* vm, const char* str, size_t
 struct value value_new_string2(struct fluffyvm* vm, const char* str, size_t len, foxgc_root_reference_t** rootRef);
 struct value value_new_string(struct fluffyvm* vm, const char* cstr, foxgc_root_reference_t** rootRef);
 
+// String using `str` in place instead
+// of copying it into the heap, the bytes
+// must not change until `release` called
+// when the string collected (NULL if
+// nothing to release). Set
+// `hasNullTerminator` if there is '\0'
+// right after `len` bytes, else bytes
+// copied and `release` called at once
+// On error `release` not called and
+// caller still own `str`
+struct value value_new_string_external(struct fluffyvm* vm, const char* str, size_t len, bool hasNullTerminator, foxgc_root_reference_t** rootRef, runnable_t release);
+
+// Whole file as string backed by read only
+// mapping of it, pages read in only when
+// accessed. File must not be modified
+// while the string alive
+struct value value_new_string_from_file(struct fluffyvm* vm, const char* path, foxgc_root_reference_t** rootRef);
+
 // Like other 2 variant but this will cache
 // the string for faster future access
 struct value value_new_string2_constant(struct fluffyvm* vm, const char* str, size_t len, foxgc_root_reference_t** rootRef);
@@ -0,0 +1,62 @@
+#include <Block.h>
+#include <stdlib.h>
+
+#include "fluffyvm.h"
+#include "vm_pool.h"
+
+struct vm_pool* vm_pool_new(int capacity, vm_pool_create_t create, vm_pool_prepare_t prepare, vm_pool_destroy_t destroy) {
+  struct vm_pool* this = malloc(sizeof(*this));
+  if (!this)
+    return NULL;
+
+  this->idle = malloc(sizeof(*this->idle) * (capacity > 0 ? capacity : 1));
+  if (!this->idle) {
+    free(this);
+    return NULL;
+  }
+
+  this->capacity = capacity;
+  this->count = 0;
+  this->create = Block_copy(create);
+  this->prepare = prepare ? Block_copy(prepare) : NULL;
+  this->destroy = Block_copy(destroy);
+  return this;
+}
+
+void vm_pool_free(struct vm_pool* this) {
+  for (int i = 0; i < this->count; i++)
+    this->destroy(this->idle[i]);
+
+  Block_release(this->create);
+  if (this->prepare)
+    Block_release(this->prepare);
+  Block_release(this->destroy);
+  free(this->idle);
+  free(this);
+}
+
+struct fluffyvm* vm_pool_checkout(struct vm_pool* this) {
+  // Idle ones already prepared
+  if (this->count > 0)
+    return this->idle[--this->count];
+
+  struct fluffyvm* vm = this->create();
+  if (!vm)
+    return NULL;
+
+  if (this->prepare && !this->prepare(vm)) {
+    this->destroy(vm);
+    return NULL;
+  }
+  return vm;
+}
+
+void vm_pool_checkin(struct vm_pool* this, struct fluffyvm* vm) {
+  if (this->count >= this->capacity || !fluffyvm_reset(vm) || (this->prepare && !this->prepare(vm))) {
+    this->destroy(vm);
+    return;
+  }
+
+  this->idle[this->count++] = vm;
+}
+
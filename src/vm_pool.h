@@ -0,0 +1,54 @@
+#ifndef header_1655972548_vm_pool_h
+#define header_1655972548_vm_pool_h
+
+#include <stdbool.h>
+
+#include "fluffyvm.h"
+
+// Pool of ready VMs so jobs dont pay for
+// `fluffyvm_new` and `fluffyvm_free` each
+// time, VMs checked in are reset with
+// `fluffyvm_reset` instead
+//
+// VM can only be used by the thread created
+// it so pool is too, have one per thread
+
+// Make new VM (with its own heap or not)
+typedef struct fluffyvm* (^vm_pool_create_t)();
+
+// Run after VM created and after each reset
+// to set globals up (e.g. `snapshot_restore`)
+typedef bool (^vm_pool_prepare_t)(struct fluffyvm* vm);
+
+// Free VM made by `vm_pool_create_t`
+typedef void (^vm_pool_destroy_t)(struct fluffyvm* vm);
+
+struct vm_pool {
+  vm_pool_create_t create;
+  vm_pool_prepare_t prepare;
+  vm_pool_destroy_t destroy;
+
+  int capacity;
+  int count;
+  struct fluffyvm** idle;
+};
+
+// `prepare` can be NULL
+struct vm_pool* vm_pool_new(int capacity, vm_pool_create_t create, vm_pool_prepare_t prepare, vm_pool_destroy_t destroy);
+
+// Destroy idle VMs, checked out ones
+// must be destroyed by caller
+void vm_pool_free(struct vm_pool* this);
+
+// Take idle VM or make new one
+// Return NULL on error
+struct fluffyvm* vm_pool_checkout(struct vm_pool* this);
+
+// Reset `vm` and keep it for next checkout,
+// destroyed instead if pool is full or
+// reset failed. Schedulers and reactors
+// made on `vm` must be freed before
+void vm_pool_checkin(struct vm_pool* this, struct fluffyvm* vm);
+
+#endif
+